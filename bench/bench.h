@@ -0,0 +1,67 @@
+/*
+ * teleinfuse is a FUSE module to access to the Télé information of linky electric meter running in standard mode
+ * Télé info data are transmitted by french electric meters (EDF/ERDF)
+ * [FR] Permet de lire la téléinformation cliente (TIC) d'un compteur linky en mode standard.
+ * [FR] Pour le mode TIC historique, voir le projet original
+ *
+ * Based on https://github.com/neomilium/teleinfuse project by Romuald Conty
+ *
+ * Copyright (C) 2020 itineric
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _BENCH_H_
+#define _BENCH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+// A corpus is a raw byte stream as sent by the meter (STX ... ETX frames)
+typedef struct {
+  const char * name;
+  char * data;
+  size_t length;
+  size_t frames;
+  size_t lines;
+} bench_corpus;
+
+enum {
+  BENCH_CORPUS_TYPICAL,  // single phase meter, about 40 messages
+  BENCH_CORPUS_MAX,      // every label of the specification with its longest value
+  BENCH_CORPUS_CHECKSUM, // typical frames, one in two rejected for bad checksums
+  BENCH_CORPUS_DATETIME, // only messages carrying a datetime
+  BENCH_CORPUS_COUNT,
+};
+
+// Writes frame number frame of a kind at p (STX to ETX), adds its messages to lines
+// returns the end of the frame
+char * bench_frame (char * p, int kind, unsigned int frame, size_t * lines);
+
+// Builds frames of a kind, repeated until the corpus holds about size bytes
+void bench_corpus_build (bench_corpus * corpus, int kind, size_t size);
+void bench_corpus_free (bench_corpus * corpus);
+
+// Allocations done by the code under test (malloc/calloc/realloc are wrapped at link time)
+extern unsigned long bench_allocations;
+
+static inline double bench_now (void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+#endif
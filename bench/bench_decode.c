@@ -0,0 +1,176 @@
+/*
+ * teleinfuse is a FUSE module to access to the Télé information of linky electric meter running in standard mode
+ * Télé info data are transmitted by french electric meters (EDF/ERDF)
+ * [FR] Permet de lire la téléinformation cliente (TIC) d'un compteur linky en mode standard.
+ * [FR] Pour le mode TIC historique, voir le projet original
+ *
+ * Based on https://github.com/neomilium/teleinfuse project by Romuald Conty
+ *
+ * Copyright (C) 2020 itineric
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Framing and decoding benchmark: runs the decoder, the buffered reader and
+// teleinfo_decode over corpora of standard mode frames.
+
+#include "bench.h"
+#include "../teleinfo.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+// Each measure runs at least this long
+#define BENCH_DURATION 0.5
+#define BENCH_CORPUS_SIZE (256 * 1024)
+
+typedef struct {
+  double seconds;
+  unsigned long frames;
+  unsigned long lines;
+  unsigned long long bytes;
+  unsigned long allocations;
+  unsigned long syscalls;
+} bench_result;
+
+static void bench_report (const bench_corpus * corpus, const char * function, const bench_result * r)
+{
+  printf("%-9s %-18s %10.0f %9.1f %9.2f %13.2f", corpus->name, function,
+         r->frames / r->seconds, r->seconds * 1e9 / (r->lines ? r->lines : 1),
+         r->bytes / r->seconds / 1e6, (double)r->allocations / (r->frames ? r->frames : 1));
+  if (r->syscalls) {
+    printf(" %15.2f", (double)r->syscalls / r->frames);
+  }
+  printf("\n");
+}
+
+// Decoder alone, bytes already in memory
+static void bench_feed (const bench_corpus * corpus, int salvage)
+{
+  static teleinfo_decoder decoder;
+  bench_result r = { 0 };
+  unsigned long allocations = bench_allocations;
+  double start = bench_now();
+
+  teleinfo_decoder_init(&decoder, NULL, NULL);
+  decoder.salvage = salvage;
+  do {
+    for (size_t n=0; n<corpus->length; n++) {
+      switch (teleinfo_decoder_feed(&decoder, corpus->data[n])) {
+        case TI_EVENT_LINE:
+          r.lines++;
+          break;
+        case TI_EVENT_FRAME:
+          r.frames++;
+          break;
+      }
+    }
+    r.bytes += corpus->length;
+    r.seconds = bench_now() - start;
+  } while (r.seconds < BENCH_DURATION);
+  r.allocations = bench_allocations - allocations;
+  bench_report(corpus, salvage ? "decoder_salvage" : "decoder_feed", &r);
+}
+
+// Reader + decoder from a file descriptor
+static void bench_read_frame (const bench_corpus * corpus)
+{
+  static teleinfo_decoder decoder;
+  teleinfo_reader reader;
+  bench_result r = { 0 };
+  char path[] = "/tmp/teleinfo-bench-XXXXXX";
+  int fd = mkstemp(path);
+
+  if (fd == -1 || write(fd, corpus->data, corpus->length) != corpus->length) {
+    perror("unable to write corpus");
+    exit(EXIT_FAILURE);
+  }
+  unlink(path);
+
+  unsigned long allocations = bench_allocations;
+  double start = bench_now();
+  do {
+    int err;
+    lseek(fd, 0, SEEK_SET);
+    teleinfo_reader_init(&reader, fd);
+    teleinfo_decoder_init(&decoder, NULL, NULL);
+    while ((err = teleinfo_read_frame(&reader, &decoder)) != EIO) {
+      if (!err) {
+        r.frames++;
+        r.lines += decoder.frame.datasetlen;
+      }
+    }
+    r.syscalls += reader.syscalls;
+    r.bytes += corpus->length;
+    r.seconds = bench_now() - start;
+  } while (r.seconds < BENCH_DURATION);
+  r.allocations = bench_allocations - allocations;
+  close(fd);
+  bench_report(corpus, "read_frame", &r);
+}
+
+// teleinfo_decode over frames captured without STX/ETX
+static void bench_decode (const bench_corpus * corpus)
+{
+  static teleinfo_frame frame;
+  bench_result r = { 0 };
+  char ** frames = malloc(corpus->frames * sizeof(char*));
+  size_t count = 0;
+
+  for (const char * p = corpus->data; (p = memchr(p, '\x02', corpus->data + corpus->length - p)); p++) {
+    const char * end = memchr(p, '\x03', corpus->data + corpus->length - p);
+    frames[count] = strndup(p + 1, end - p - 1);
+    count++;
+  }
+
+  unsigned long allocations = bench_allocations;
+  double start = bench_now();
+  do {
+    for (size_t n=0; n<count; n++) {
+      if (!teleinfo_decode(frames[n], &frame)) {
+        r.frames++;
+        r.lines += frame.datasetlen;
+      }
+      r.bytes += strlen(frames[n]) + 2;
+    }
+    r.seconds = bench_now() - start;
+  } while (r.seconds < BENCH_DURATION);
+  r.allocations = bench_allocations - allocations;
+  bench_report(corpus, "decode", &r);
+
+  for (size_t n=0; n<count; n++) {
+    free(frames[n]);
+  }
+  free(frames);
+}
+
+int main (int argc, char * argv[])
+{
+  printf("%-9s %-18s %10s %9s %9s %13s %15s\n", "corpus", "function", "frames/s", "ns/line", "MB/s", "allocs/frame", "syscalls/frame");
+  for (int kind=0; kind<BENCH_CORPUS_COUNT; kind++) {
+    bench_corpus corpus;
+    bench_corpus_build(&corpus, kind, BENCH_CORPUS_SIZE);
+    bench_feed(&corpus, 0);
+    if (kind == BENCH_CORPUS_CHECKSUM) {
+      bench_feed(&corpus, 1);
+    }
+    bench_read_frame(&corpus);
+    bench_decode(&corpus);
+    bench_corpus_free(&corpus);
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,385 @@
+/*
+ * teleinfuse is a FUSE module to access to the Télé information of linky electric meter running in standard mode
+ * Télé info data are transmitted by french electric meters (EDF/ERDF)
+ * [FR] Permet de lire la téléinformation cliente (TIC) d'un compteur linky en mode standard.
+ * [FR] Pour le mode TIC historique, voir le projet original
+ *
+ * Based on https://github.com/neomilium/teleinfuse project by Romuald Conty
+ *
+ * Copyright (C) 2020 itineric
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// FUSE read path benchmark: reader threads do what "cat LABEL" costs the
+// daemon when the kernel has nothing cached (lookup, open, read, release) while
+// the updater publishes frames. The request handlers are called directly,
+// without the kernel round-trip.
+
+#include <dirent.h>
+
+#include "bench.h"
+
+#define main teleinfuse_main
+#include "../teleinfuse.c"
+#undef main
+
+#define BENCH_READERS 4
+#define BENCH_DURATION 1.0
+#define BENCH_SAMPLES_MAX (4 * 1024 * 1024)
+
+typedef struct {
+  const char * paths[TI_MESSAGE_COUNT_MAX]; // names in the root directory
+  size_t path_count;
+  uint32_t * latencies; // ns
+  size_t count;
+  unsigned long errors;
+} bench_reader;
+
+static volatile int bench_stop = 0;
+
+static void* bench_read_loop (void * arg)
+{
+  bench_reader * reader = arg;
+  struct fuse_entry_param entry;
+  teleinfuse_handle * handle;
+  const char * data;
+  unsigned int seed = (uintptr_t)arg;
+
+  while (!bench_stop && reader->count < BENCH_SAMPLES_MAX / BENCH_READERS) {
+    const char * path = reader->paths[rand_r(&seed) % reader->path_count];
+    double start = bench_now();
+    if (teleinfuse_entry(FUSE_ROOT_ID, path, &entry) || teleinfuse_handle_open(entry.ino, &handle)) {
+      reader->errors++;
+      continue;
+    }
+    if (teleinfuse_handle_read(handle, NULL, 64 * 1024, 0, &data) < 0) {
+      reader->errors++;
+    }
+    teleinfuse_handle_close(handle);
+    reader->latencies[reader->count++] = (bench_now() - start) * 1e9;
+  }
+  return NULL;
+}
+
+static int bench_compare (const void * a, const void * b)
+{
+  uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+  return (x > y) - (x < y);
+}
+
+static void bench_percentiles (const char * name, uint32_t * latencies, size_t count, double seconds, unsigned long allocations)
+{
+  qsort(latencies, count, sizeof(uint32_t), bench_compare);
+  printf("%-10s %10.0f %8u %8u %8u %8u %8u %8.2f\n", name, count / seconds,
+         latencies[count / 2], latencies[count * 9 / 10], latencies[count * 99 / 100],
+         latencies[count * 999 / 1000], latencies[count - 1], (double)allocations / count);
+}
+
+// One run: readers on paths while the updater publishes the corpus frames
+static void bench_run (const char * name, const char ** paths, size_t path_count,
+                       const teleinfo_frame * frames, size_t frame_count)
+{
+  static bench_reader readers[BENCH_READERS];
+  pthread_t threads[BENCH_READERS];
+  uint32_t * publish = malloc(BENCH_SAMPLES_MAX * sizeof(uint32_t));
+  size_t publish_count = 0;
+
+  bench_stop = 0;
+  unsigned long allocations = bench_allocations;
+  for (int n=0; n<BENCH_READERS; n++) {
+    memcpy(readers[n].paths, paths, path_count * sizeof(char*));
+    readers[n].path_count = path_count;
+    readers[n].latencies = malloc(BENCH_SAMPLES_MAX / BENCH_READERS * sizeof(uint32_t));
+    readers[n].count = 0;
+    readers[n].errors = 0;
+    pthread_create(&threads[n], NULL, bench_read_loop, &readers[n]);
+  }
+
+  // Live updater, one frame every 100us (far more than a meter sends)
+  double start = bench_now();
+  double seconds;
+  do {
+    size_t frame = publish_count % frame_count;
+    double t = bench_now();
+    teleinfuse_update(&(teleinfuse_meters[0]), &(frames[frame]), "online");
+    publish[publish_count++] = (bench_now() - t) * 1e9;
+    usleep(100);
+    seconds = bench_now() - start;
+  } while (seconds < BENCH_DURATION && publish_count < BENCH_SAMPLES_MAX);
+  bench_stop = 1;
+
+  size_t count = 0;
+  unsigned long errors = 0;
+  for (int n=0; n<BENCH_READERS; n++) {
+    pthread_join(threads[n], NULL);
+    count += readers[n].count;
+    errors += readers[n].errors;
+  }
+  allocations = bench_allocations - allocations - BENCH_READERS; // latency buffers
+  uint32_t * latencies = malloc(count * sizeof(uint32_t));
+  count = 0;
+  for (int n=0; n<BENCH_READERS; n++) {
+    memcpy(latencies + count, readers[n].latencies, readers[n].count * sizeof(uint32_t));
+    count += readers[n].count;
+    free(readers[n].latencies);
+  }
+  bench_percentiles(name, latencies, count, seconds, allocations);
+  bench_percentiles("  publish", publish, publish_count, seconds, 0);
+  if (errors) {
+    printf("  %lu failed reads\n", errors);
+  }
+  free(latencies);
+  free(publish);
+}
+
+// Derived values: windowed averages, minimums and maximums compared with a
+// brute force computation over the same random samples. Frames come slowly,
+// then faster than the ring of samples holds, from just before the monotonic
+// milliseconds wrap at 32 bits.
+// returns the number of wrong values
+static unsigned long bench_derived_check (void)
+{
+  static const int64_t windows[] = { 60000, 300000, 900000 };
+  static const char * const what[] = { "avg", "min", "max" };
+  const int count = 60000;
+  int64_t * times = malloc(count * sizeof(int64_t));
+  int64_t * values = malloc(count * sizeof(int64_t));
+  static teleinfo_frame frame;
+  int id = teleinfo_label_find("SINSTS", 6);
+  unsigned int seed = 1;
+  unsigned long wrong = 0;
+  int64_t now = UINT32_MAX - 1000000;
+
+  if (!times || !values) {
+    free(times);
+    free(values);
+    return 1;
+  }
+  teleinfuse_derived_init(1, 1, "SINSTS");
+  frame.datasetlen = 1;
+  frame.dataset[0].id = id;
+  frame.dataset[0].numeric = 1;
+  for (int n=0; n<count; n++) {
+    now += n < count / 2 ? 100 + rand_r(&seed) % 900 : 50 + rand_r(&seed) % 100;
+    times[n] = now;
+    values[n] = frame.dataset[0].number = rand_r(&seed) % 10000;
+    teleinfuse_derived_update(0, &frame, now);
+    if (n % 997) {
+      continue;
+    }
+    for (int w=0; w<3; w++) {
+      // The ring keeps the last 2048 samples (TELEINFUSE_DERIVED_SAMPLES)
+      int64_t sum = 0, min = INT64_MAX, max = INT64_MIN, samples = 0;
+      for (int k=n; k>=0 && k>n-2048 && now-times[k]<windows[w]; k--) {
+        sum += values[k];
+        samples++;
+        min = values[k] < min ? values[k] : min;
+        max = values[k] > max ? values[k] : max;
+      }
+      int64_t expected[3] = { (sum + samples / 2) / samples, min, max };
+      for (int kind=0; kind<3; kind++) {
+        size_t length;
+        char * text = teleinfuse_derived_render(0, TELEINFUSE_DERIVED_FILE(id, TELEINFUSE_DERIVED_AVG_1M + 3 * kind + w), &length);
+        if (!text || strtoll(text, NULL, 10) != expected[kind]) {
+          if (!wrong) {
+            printf("derived: frame %d: %s over %llds is %.*s, %lld expected\n", n, what[kind], (long long)windows[w] / 1000,
+                   text ? (int)length - 1 : 7, text ? text : "missing", (long long)expected[kind]);
+          }
+          wrong++;
+        }
+        free(text);
+      }
+    }
+  }
+  teleinfuse_derived_destroy();
+  free(times);
+  free(values);
+  return wrong;
+}
+
+// Derived values: cost of a frame once the 15 minute windows are full
+static void bench_derived (const teleinfo_frame * frames, size_t frame_count)
+{
+  const size_t count = 200000;
+  int64_t now = 0;
+
+  teleinfuse_derived_init(1, 1, "SINSTS:IRMS1:URMS1");
+  for (size_t n=0; n<1000; n++, now += 1000) {
+    teleinfuse_derived_update(0, &(frames[n % frame_count]), now);
+  }
+  unsigned long allocations = bench_allocations;
+  double start = bench_now();
+  for (size_t n=0; n<count; n++, now += 1000) {
+    teleinfuse_derived_update(0, &(frames[n % frame_count]), now);
+  }
+  double seconds = bench_now() - start;
+  printf("derived: %.0f ns per frame of %zu messages, %.2f allocs/frame\n",
+         seconds * 1e9 / count, frames[0].datasetlen, (double)(bench_allocations - allocations) / count);
+  teleinfuse_derived_destroy();
+}
+
+// Rules: evaluation of a few thresholds which never fire
+static void bench_rules (const teleinfo_frame * frames, size_t frame_count)
+{
+  const size_t count = 200000;
+  char path[] = "/tmp/bench_rules.XXXXXX";
+  const char * names[] = { "bench" };
+  struct timespec time = { 0, 0 };
+  int fd = mkstemp(path);
+  FILE * file = fd != -1 ? fdopen(fd, "w") : NULL;
+
+  if (!file) {
+    perror("mkstemp");
+    return;
+  }
+  fputs("shed when SINSTS > PREF*100000 for 2s until SINSTS < PREF*800 for 30s write /dev/null\n"
+        "phase1 when IRMS1 > 1000 and URMS1 > 0 for 5s write /dev/null\n"
+        "voltage when URMS1 > 10000 exec true\n"
+        "injection when SINSTI > 1000000 and SINSTS == 0 write /dev/null\n", file);
+  fclose(file);
+  if (teleinfuse_rules_init(path, 1, names)) {
+    unlink(path);
+    return;
+  }
+  unsigned long allocations = bench_allocations;
+  double start = bench_now();
+  for (size_t n=0; n<count; n++) {
+    teleinfuse_rules_evaluate(0, &(frames[n % frame_count]), n * 1000, &time);
+  }
+  double seconds = bench_now() - start;
+  printf("rules: %.0f ns per frame of %zu messages for 4 rules, %.2f allocs/frame\n",
+         seconds * 1e9 / count, frames[0].datasetlen, (double)(bench_allocations - allocations) / count);
+  teleinfuse_rules_destroy();
+  unlink(path);
+}
+
+// Log: bytes and time per frame appended, then reading of the day
+static void bench_log (const teleinfo_frame * frames, size_t frame_count)
+{
+  const size_t count = 20000;
+  char dir[] = "/tmp/bench_log.XXXXXX";
+  const char * names[] = { "bench" };
+  struct timespec time;
+
+  if (!mkdtemp(dir)) {
+    perror("mkdtemp");
+    return;
+  }
+  teleinfuse_log_init(dir, 16 * 1024 * 1024, 1, names);
+  clock_gettime(CLOCK_REALTIME, &time);
+  // Frames of the current day, one every 1.5 s until now
+  time.tv_sec -= count * 3 / 2;
+  unsigned long allocations = bench_allocations;
+  double start = bench_now();
+  for (size_t n=0; n<count; n++) {
+    teleinfuse_log_add(0, &(frames[n % frame_count]), &time);
+    time.tv_nsec += 500000000;
+    time.tv_sec += 1 + time.tv_nsec / 1000000000;
+    time.tv_nsec %= 1000000000;
+  }
+  double seconds = bench_now() - start;
+  printf("log: %.0f ns and %.2f allocs per frame\n", seconds * 1e9 / count, (double)(bench_allocations - allocations) / count);
+
+  // Days read as a FUSE client would, 128 KB at a time through a cursor
+  static char buffer[128 * 1024];
+  int first, last;
+  size_t length = 0, read;
+  teleinfuse_log_days(0, &first, &last);
+  allocations = bench_allocations;
+  start = bench_now();
+  for (int day=first; day<=last; day++) {
+    teleinfuse_log_cursor * cursor = teleinfuse_log_open(0, day);
+    size_t offset = 0;
+    while ((read = teleinfuse_log_read(cursor, buffer, sizeof(buffer), offset))) {
+      offset += read;
+    }
+    length += offset;
+    teleinfuse_log_release(cursor);
+  }
+  seconds = bench_now() - start;
+  printf("log: %.1f ms to read %zu bytes of text from %d day(s), %.2f allocs per 128 KB read\n", seconds * 1e3, length, last - first + 1,
+         (double)(bench_allocations - allocations) * sizeof(buffer) / (length ? length : 1));
+  teleinfuse_log_destroy();
+
+  // Segment sizes, with their keyframe index, then the segments are removed
+  size_t bytes = 0;
+  DIR * entries = opendir(dir);
+  struct dirent * entry;
+  while (entries && (entry = readdir(entries))) {
+    char path[sizeof(dir) + 256];
+    struct stat st;
+    snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+    if ((entry->d_name[0] != '.') && (stat(path, &st) == 0)) {
+      bytes += st.st_size;
+      unlink(path);
+    }
+  }
+  if (entries) {
+    closedir(entries);
+  }
+  if (rmdir(dir)) {
+    perror(dir);
+  }
+  printf("log: %.1f bytes per frame of %zu messages on disk\n", (double)bytes / count, frames[0].datasetlen);
+}
+
+int main (int argc, char * argv[])
+{
+  static teleinfo_frame frames[16];
+  static teleinfo_decoder decoder;
+  const char * label_paths[TI_MESSAGE_COUNT_MAX];
+  const char * frame_path[] = { TELEINFUSE_FRAME_FILENAME };
+  size_t frame_count = 0;
+  bench_corpus corpus;
+
+  // Frames decoded from the typical corpus, values change from one to another
+  bench_corpus_build(&corpus, BENCH_CORPUS_TYPICAL, 16 * 1500);
+  teleinfo_decoder_init(&decoder, NULL, NULL);
+  for (size_t n=0; n<corpus.length && frame_count < 16; n++) {
+    if (teleinfo_decoder_feed(&decoder, corpus.data[n]) == TI_EVENT_FRAME) {
+      teleinfo_frame_copy(&(frames[frame_count++]), &(decoder.frame));
+    }
+  }
+  bench_corpus_free(&corpus);
+  for (size_t n=0; n<frames[0].datasetlen; n++) {
+    label_paths[n] = TI_LABEL(&(frames[0]), &(frames[0].dataset[n]));
+  }
+  teleinfuse_meters_init("/dev/null");
+  for (size_t n=0; n<TELEINFUSE_SNAPSHOT_COUNT; n++) {
+    teleinfuse_update(&(teleinfuse_meters[0]), &(frames[n % frame_count]), "online");
+  }
+  // Memory of a meter once every snapshot has been written
+  size_t frame_text = 0;
+  for (size_t n=0; n<TELEINFUSE_SNAPSHOT_COUNT; n++) {
+    frame_text += teleinfuse_meters[0].snapshots[n].frame_size;
+  }
+  printf("meter: %zu bytes (decoder %zu, %d snapshots of %zu) + %zu bytes of frame text\n",
+         sizeof(teleinfuse_meter), sizeof(teleinfo_decoder), TELEINFUSE_SNAPSHOT_COUNT, sizeof(teleinfuse_snapshot), frame_text);
+
+  unsigned long wrong = bench_derived_check();
+  printf("derived: %lu wrong windowed values against brute force\n", wrong);
+  if (wrong) {
+    return EXIT_FAILURE;
+  }
+  bench_derived(frames, frame_count);
+  bench_rules(frames, frame_count);
+  bench_log(frames, frame_count);
+
+  printf("%d readers against a live updater, latencies in ns\n", BENCH_READERS);
+  printf("%-10s %10s %8s %8s %8s %8s %8s %8s\n", "file", "ops/s", "p50", "p90", "p99", "p99.9", "max", "allocs/op");
+  bench_run("labels", label_paths, frames[0].datasetlen, frames, frame_count);
+  bench_run("frame", frame_path, 1, frames, frame_count);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,232 @@
+/*
+ * teleinfuse is a FUSE module to access to the Télé information of linky electric meter running in standard mode
+ * Télé info data are transmitted by french electric meters (EDF/ERDF)
+ * [FR] Permet de lire la téléinformation cliente (TIC) d'un compteur linky en mode standard.
+ * [FR] Pour le mode TIC historique, voir le projet original
+ *
+ * Based on https://github.com/neomilium/teleinfuse project by Romuald Conty
+ *
+ * Copyright (C) 2020 itineric
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// End to end latency: a pseudo-terminal stands for the meter, frames are
+// written at 9600 bauds and the time from the end (CR) of the SINSTS message
+// to the new value being read through the mount (open/read/close, like cat)
+// is measured. SINSTS is published without waiting for the ETX.
+//
+// usage: bench_latency [-n FRAMES] [-g MAX_P99_MS] [TELEINFUSE]
+// exits with failure when the 99th percentile is above MAX_P99_MS
+
+#define _GNU_SOURCE
+#include "bench.h"
+#include "../teleinfo.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+// 7E1 = 10 bits per char at 9600 bauds
+#define BENCH_BYTES_PER_SECOND 960
+#define BENCH_CHUNK 8
+
+typedef struct {
+  char value[99]; // SINSTS of the frame
+  double written; // time the CR of the SINSTS message has been written, 0 before
+} bench_frame_info;
+
+static int bench_master;
+static bench_frame_info * bench_frames;
+static unsigned int bench_frame_count = 30;
+static int bench_written = 0;
+
+static void* bench_meter (void * arg)
+{
+  char frame[2 * TI_FRAME_LENGTH_MAX];
+  double next = bench_now();
+
+  for (unsigned int n=0; n<bench_frame_count; n++) {
+    size_t lines = 0;
+    size_t length = bench_frame(frame, BENCH_CORPUS_TYPICAL, n, &lines) - frame;
+    const char * message = memmem(frame, length, "\nSINSTS\t", 8);
+    const char * cr = message ? memchr(message, '\r', frame + length - message) : NULL;
+    size_t end = cr ? cr - frame + 1 : length;
+    for (size_t sent=0; sent<length; ) {
+      size_t chunk = (length - sent < BENCH_CHUNK) ? length - sent : BENCH_CHUNK;
+      // Paced like the serial line
+      next += (double)chunk / BENCH_BYTES_PER_SECOND;
+      double wait = next - bench_now();
+      if (wait > 0) {
+        usleep(wait * 1e6);
+      }
+      if (write(bench_master, frame + sent, chunk) != chunk) {
+        perror("write to pseudo-terminal");
+        exit(EXIT_FAILURE);
+      }
+      if (sent < end && sent + chunk >= end) {
+        double written = bench_now();
+        __atomic_store(&bench_frames[n].written, &written, __ATOMIC_RELEASE);
+      }
+      sent += chunk;
+    }
+  }
+  __atomic_store_n(&bench_written, 1, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+// Expected value of SINSTS for each frame
+static void bench_expect (void)
+{
+  char frame[2 * TI_FRAME_LENGTH_MAX];
+  static teleinfo_frame decoded;
+
+  for (unsigned int n=0; n<bench_frame_count; n++) {
+    size_t lines = 0;
+    char * end = bench_frame(frame, BENCH_CORPUS_TYPICAL, n, &lines);
+    end[-1] = '\0'; // ETX
+    teleinfo_decode(frame + 1, &decoded);
+    for (size_t i=0; i<decoded.datasetlen; i++) {
+      if (!strcmp(TI_LABEL(&decoded, &(decoded.dataset[i])), "SINSTS")) {
+        strcpy(bench_frames[n].value, TI_VALUE(&decoded, &(decoded.dataset[i])));
+      }
+    }
+  }
+}
+
+static int bench_read (const char * path, char * buf, size_t size)
+{
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    return -1;
+  }
+  ssize_t n = read(fd, buf, size - 1);
+  close(fd);
+  buf[n > 0 ? n : 0] = '\0';
+  return n;
+}
+
+static int bench_compare (const void * a, const void * b)
+{
+  double x = *(const double*)a, y = *(const double*)b;
+  return (x > y) - (x < y);
+}
+
+int main (int argc, char * argv[])
+{
+  const char * teleinfuse = "./teleinfuse";
+  double gate = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:g:")) != -1) {
+    switch (opt) {
+      case 'n':
+        bench_frame_count = atoi(optarg);
+        break;
+      case 'g':
+        gate = atof(optarg);
+        break;
+      default:
+        fprintf(stderr, "usage: %s [-n FRAMES] [-g MAX_P99_MS] [TELEINFUSE]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+  }
+  if (optind < argc) {
+    teleinfuse = argv[optind];
+  }
+  bench_frames = calloc(bench_frame_count, sizeof(bench_frame_info));
+  bench_expect();
+
+  // Meter side of the pseudo-terminal
+  if ((bench_master = posix_openpt(O_RDWR | O_NOCTTY)) == -1 || grantpt(bench_master) || unlockpt(bench_master)) {
+    perror("unable to create pseudo-terminal");
+    return EXIT_FAILURE;
+  }
+  char * slave = ptsname(bench_master);
+  char mountpoint[] = "/tmp/teleinfuse-latency-XXXXXX";
+  if (!mkdtemp(mountpoint)) {
+    perror("unable to create mount point");
+    return EXIT_FAILURE;
+  }
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    execl(teleinfuse, teleinfuse, slave, mountpoint, "-f", "-o", "interval=0", (char*)NULL);
+    perror("unable to run teleinfuse");
+    _exit(EXIT_FAILURE);
+  }
+
+  char status_path[64], sinsts_path[64], value[128];
+  snprintf(status_path, sizeof(status_path), "%s/status", mountpoint);
+  snprintf(sinsts_path, sizeof(sinsts_path), "%s/SINSTS", mountpoint);
+  for (int n=0; n<100 && bench_read(status_path, value, sizeof(value)) < 0; n++) {
+    usleep(100000);
+  }
+
+  pthread_t meter;
+  pthread_create(&meter, NULL, bench_meter, NULL);
+
+  // Reader side: poll the file every 0.5ms, like a tight "cat" loop
+  double * latencies = calloc(bench_frame_count, sizeof(double));
+  unsigned int seen = 0, next = 0;
+  double deadline = 0;
+  while (next < bench_frame_count) {
+    if (__atomic_load_n(&bench_written, __ATOMIC_ACQUIRE) && !deadline) {
+      deadline = bench_now() + 5;
+    }
+    if (deadline && bench_now() > deadline) {
+      break;
+    }
+    if (bench_read(sinsts_path, value, sizeof(value)) > 0) {
+      double now = bench_now();
+      for (unsigned int n=next; n<bench_frame_count; n++) {
+        double written;
+        __atomic_load(&bench_frames[n].written, &written, __ATOMIC_ACQUIRE);
+        if (written && !strcmp(value, bench_frames[n].value)) {
+          latencies[seen++] = (now - written) * 1e3;
+          next = n + 1;
+          break;
+        }
+      }
+    }
+    usleep(500);
+  }
+  pthread_join(meter, NULL);
+
+  kill(pid, SIGTERM);
+  waitpid(pid, NULL, 0);
+  rmdir(mountpoint);
+  close(bench_master);
+
+  if (!seen) {
+    fprintf(stderr, "no value seen through the mount\n");
+    return EXIT_FAILURE;
+  }
+  qsort(latencies, seen, sizeof(double), bench_compare);
+  double p99 = latencies[seen * 99 / 100];
+  printf("%u/%u frames seen, SINSTS message to value latency (ms): p50 %.1f p90 %.1f p99 %.1f max %.1f\n",
+         seen, bench_frame_count, latencies[seen / 2], latencies[seen * 9 / 10], p99, latencies[seen - 1]);
+  if (gate > 0 && p99 > gate) {
+    printf("p99 above %.1f ms\n", gate);
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
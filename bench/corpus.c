@@ -0,0 +1,191 @@
+/*
+ * teleinfuse is a FUSE module to access to the Télé information of linky electric meter running in standard mode
+ * Télé info data are transmitted by french electric meters (EDF/ERDF)
+ * [FR] Permet de lire la téléinformation cliente (TIC) d'un compteur linky en mode standard.
+ * [FR] Pour le mode TIC historique, voir le projet original
+ *
+ * Based on https://github.com/neomilium/teleinfuse project by Romuald Conty
+ *
+ * Copyright (C) 2020 itineric
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "bench.h"
+#include "../teleinfo.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+unsigned long bench_allocations = 0;
+
+void * __real_malloc (size_t size);
+void * __real_calloc (size_t count, size_t size);
+void * __real_realloc (void * p, size_t size);
+
+void * __wrap_malloc (size_t size)
+{
+  __atomic_add_fetch(&bench_allocations, 1, __ATOMIC_RELAXED);
+  return __real_malloc(size);
+}
+
+void * __wrap_calloc (size_t count, size_t size)
+{
+  __atomic_add_fetch(&bench_allocations, 1, __ATOMIC_RELAXED);
+  return __real_calloc(count, size);
+}
+
+void * __wrap_realloc (void * p, size_t size)
+{
+  __atomic_add_fetch(&bench_allocations, 1, __ATOMIC_RELAXED);
+  return __real_realloc(p, size);
+}
+
+// Plausible value of a label, as long as the specification allows when longest is set
+static const char * bench_value (int id, int longest, unsigned int frame)
+{
+  static char value[99];
+  const teleinfo_label * label = &(teleinfo_labels[id]);
+
+  switch (label->type) {
+    case TI_TYPE_INDEX:
+      snprintf(value, sizeof(value), "%09u", 12345678 + frame);
+      break;
+    case TI_TYPE_POWER:
+      if (label->unit[0] == 'k') {
+        snprintf(value, sizeof(value), "%02u", 9);
+      } else {
+        snprintf(value, sizeof(value), "%05u", (1200 + frame * 7) % 12000);
+      }
+      break;
+    case TI_TYPE_VOLTAGE:
+      snprintf(value, sizeof(value), "%03u", 228 + frame % 5);
+      break;
+    case TI_TYPE_CURRENT:
+      snprintf(value, sizeof(value), "%03u", 5 + frame % 3);
+      break;
+    case TI_TYPE_REGISTER:
+      snprintf(value, sizeof(value), "003A0001");
+      break;
+    case TI_TYPE_BITFIELD:
+      snprintf(value, sizeof(value), "000");
+      break;
+    case TI_TYPE_NUMBER:
+      snprintf(value, sizeof(value), "%02u", 1 + frame % 2);
+      break;
+    case TI_TYPE_TEXT:
+      if (label->datetime) {
+        value[0] = '\0';
+      } else if (longest) {
+        // Free texts (PJOURF+1, PPOINTE, MSG1...) may be as long as a value can be
+        memset(value, 'A', sizeof(value) - 1);
+        value[sizeof(value) - 1] = '\0';
+        if (!strcmp(label->name, "ADSC")) value[12] = '\0';
+        else if (!strcmp(label->name, "PRM")) value[14] = '\0';
+        else if (!strcmp(label->name, "VTIC")) value[2] = '\0';
+        else if (!strcmp(label->name, "NGTF") || !strcmp(label->name, "LTARF") || !strcmp(label->name, "MSG2")) value[16] = '\0';
+        else if (!strcmp(label->name, "MSG1")) value[32] = '\0';
+      } else {
+        snprintf(value, sizeof(value), "%s", !strcmp(label->name, "ADSC") ? "041876097734" : "     BASE       ");
+      }
+      break;
+  }
+  return value;
+}
+
+static char * bench_line (char * p, const char * label, const char * datetime, const char * value, int corrupt)
+{
+  char * start;
+  unsigned char sum = 0;
+
+  *p++ = '\n';
+  start = p;
+  p += sprintf(p, "%s\t", label);
+  if (datetime) {
+    p += sprintf(p, "%s\t", datetime);
+  }
+  p += sprintf(p, "%s\t", value);
+  for (char * q = start; q < p; q++) {
+    sum += *q;
+  }
+  *p++ = ((sum & 0x3F) + 0x20) ^ (corrupt ? 1 : 0);
+  *p++ = '\r';
+  return p;
+}
+
+// Labels of a typical single phase meter
+static const char * bench_typical[] = {
+  "ADSC", "VTIC", "DATE", "NGTF", "LTARF", "EAST", "EASF01", "EASF02", "EASF03", "EASF04",
+  "EASF05", "EASF06", "EASF07", "EASF08", "EASF09", "EASF10", "EASD01", "EASD02", "EASD03", "EASD04",
+  "IRMS1", "URMS1", "PREF", "PCOUP", "SINSTS", "SMAXSN", "SMAXSN-1", "CCASN", "CCASN-1", "UMOY1",
+  "STGE", "MSG1", "PRM", "RELAIS", "NTARF", "NJOURF", "NJOURF+1", "PJOURF+1", NULL
+};
+
+char * bench_frame (char * p, int kind, unsigned int frame, size_t * lines)
+{
+  *p++ = '\x02';
+  for (int id=0; id<TI_LABEL_COUNT; id++) {
+    const teleinfo_label * label = &(teleinfo_labels[id]);
+    int wanted = 0;
+    switch (kind) {
+      case BENCH_CORPUS_MAX:
+        wanted = 1;
+        break;
+      case BENCH_CORPUS_DATETIME:
+        wanted = label->datetime;
+        break;
+      default:
+        for (const char ** name = bench_typical; *name; name++) {
+          if (!strcmp(*name, label->name)) {
+            wanted = 1;
+          }
+        }
+    }
+    if (!wanted) {
+      continue;
+    }
+    // Three bad lines reject the frame
+    int corrupt = (kind == BENCH_CORPUS_CHECKSUM) && (frame % 2) && (*lines % 10 == 3);
+    p = bench_line(p, label->name, label->datetime ? "E201016120000" : NULL,
+                   bench_value(id, kind == BENCH_CORPUS_MAX, frame), corrupt);
+    (*lines)++;
+  }
+  *p++ = '\x03';
+  return p;
+}
+
+void bench_corpus_build (bench_corpus * corpus, int kind, size_t size)
+{
+  static const char * names[] = { "typical", "max", "checksum", "datetime" };
+  // room for the frame overflowing size
+  size_t capacity = size + 2 * TI_FRAME_LENGTH_MAX;
+
+  corpus->name = names[kind];
+  corpus->data = malloc(capacity);
+  corpus->frames = 0;
+  corpus->lines = 0;
+  char * p = corpus->data;
+  while (p - corpus->data < size) {
+    p = bench_frame(p, kind, corpus->frames, &(corpus->lines));
+    corpus->frames++;
+  }
+  corpus->length = p - corpus->data;
+}
+
+void bench_corpus_free (bench_corpus * corpus)
+{
+  free(corpus->data);
+  corpus->data = NULL;
+}
@@ -32,8 +32,13 @@
 #include <sys/fcntl.h>
 #include <termios.h>
 #include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
 
-int teleinfo_open (const char* port)
+static int teleinfo_serial_open (const char* port)
     // Mode Non-Canonical Input Processing, Attend 1 caractère ou time-out(avec VMIN et VTIME).
 {
     // Déclaration pour le port série.
@@ -68,19 +73,239 @@ int teleinfo_open (const char* port)
 
     teleinfo_serial_attr.c_lflag &= ~(ICANON | ECHO | ECHOE | ISIG) ;    // Mode non-canonique (mode raw) sans echo.
 
-    teleinfo_serial_attr.c_cc[VTIME] = 80 ;                              // time-out à ~8s.
-    teleinfo_serial_attr.c_cc[VMIN]  = 0 ;                               // 1 car. attendu.
+    // Le time-out global (TI_READ_TIMEOUT_MS) est géré par poll(), read() rend la main
+    // dès que TI_READ_MIN_BYTES caractères (environ un message) sont arrivés ou après
+    // un silence de 0.1s : un message n'attend pas que le bloc de lecture soit plein.
+    teleinfo_serial_attr.c_cc[VTIME] = 1 ;                               // time-out inter-caractère à 0.1s.
+    teleinfo_serial_attr.c_cc[VMIN]  = TI_READ_MIN_BYTES ;               // caractères attendus par read().
 
     tcflush (fd, TCIFLUSH) ;                                     // Efface les données reçues mais non lues.
     tcsetattr (fd,TCSANOW,&teleinfo_serial_attr) ;                    // Sauvegarde des nouveaux parametres
     return fd ;
 }
 
+// Capture files are replayed through a pipe by a pump thread, paced like the
+// serial line: the reader sees the same byte stream as with a real meter.
+// 7E1 = 10 bits per char
+#define TI_BYTES_PER_SECOND (9600 / 10)
+// 0.1s of data at 9600 bauds
+#define TI_REPLAY_CHUNK_SIZE (TI_BYTES_PER_SECOND / 10)
+
+static unsigned int teleinfo_replay_speed = 1;
+
+void teleinfo_set_replay_speed (unsigned int speed)
+{
+  teleinfo_replay_speed = speed;
+}
+
+typedef struct {
+  int file;
+  int pipe;
+  unsigned int speed;
+} teleinfo_replay;
+
+static void* teleinfo_replay_pump (void * arg)
+{
+  teleinfo_replay * replay = arg;
+  char chunk[TI_REPLAY_CHUNK_SIZE];
+  struct timespec next;
+  ssize_t n;
+  sigset_t sigpipe;
+
+  // Reader end closed: get EPIPE instead of being killed
+  sigemptyset(&sigpipe);
+  sigaddset(&sigpipe, SIGPIPE);
+  pthread_sigmask(SIG_BLOCK, &sigpipe, NULL);
+
+  clock_gettime(CLOCK_MONOTONIC, &next);
+  while ((n = read(replay->file, chunk, sizeof(chunk))) > 0) {
+    char * p = chunk;
+    while (n > 0) {
+      ssize_t written = write(replay->pipe, p, n);
+      if (written < 0) {
+        if (errno == EINTR) continue;
+        goto end;
+      }
+      p += written;
+      n -= written;
+    }
+    if (replay->speed) {
+      long long ns = next.tv_nsec + (p - chunk) * 1000000000LL / (TI_BYTES_PER_SECOND * replay->speed);
+      next.tv_sec += ns / 1000000000LL;
+      next.tv_nsec = ns % 1000000000LL;
+      while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR);
+    } // else as fast as the reader goes
+  }
+end:
+  // End of capture: the reader gets end of file (and reopens, replaying it again)
+  close(replay->file);
+  close(replay->pipe);
+  free(replay);
+  return NULL;
+}
+
+static int teleinfo_replay_open (const char* path)
+{
+  int fds[2];
+  pthread_t thread;
+  teleinfo_replay * replay = malloc(sizeof(teleinfo_replay));
+
+  if (!replay) {
+    return 0;
+  }
+  if ( (replay->file = open (path, O_RDONLY)) == -1 ) {
+    syslog(LOG_ERR, "unable to open capture %s: %s", path, strerror(errno));
+    free(replay);
+    return 0;
+  }
+  if (pipe(fds) == -1) {
+    syslog(LOG_ERR, "unable to create replay pipe: %s", strerror(errno));
+    close(replay->file);
+    free(replay);
+    return 0;
+  }
+  replay->pipe = fds[1];
+  replay->speed = teleinfo_replay_speed;
+  if (pthread_create(&thread, NULL, teleinfo_replay_pump, replay)) {
+    close(fds[0]);
+    close(fds[1]);
+    close(replay->file);
+    free(replay);
+    return 0;
+  }
+  pthread_detach(thread);
+  return fds[0];
+}
+
+int teleinfo_open (const char* port)
+{
+  struct stat st;
+
+  if (stat (port, &st) == -1) {
+    syslog(LOG_ERR, "Erreur ouverture du port serie %s !", port);
+    return 0;
+  }
+  if (S_ISREG(st.st_mode)) {
+    return teleinfo_replay_open (port);
+  }
+  if (S_ISFIFO(st.st_mode)) {
+    // Opened for writing too: the fifo stays open when writers come and go
+    int fd = open (port, O_RDWR | O_NOCTTY);
+    if (fd == -1) {
+      syslog(LOG_ERR, "unable to open fifo %s: %s", port, strerror(errno));
+      return 0;
+    }
+    return fd;
+  }
+  // Serial port (or pseudo-terminal standing for a meter)
+  return teleinfo_serial_open (port);
+}
+
+int teleinfo_check (const char* port)
+{
+  struct stat st;
+
+  if (stat (port, &st) == -1) {
+    return errno;
+  }
+  if (S_ISREG(st.st_mode)) {
+    return access (port, R_OK) ? errno : 0;
+  }
+  if (S_ISFIFO(st.st_mode)) {
+    return access (port, R_OK | W_OK) ? errno : 0;
+  }
+  // Opened without being configured, nor waiting for a modem line
+  int fd = open (port, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+  if (fd == -1) {
+    return errno;
+  }
+  close (fd);
+  return 0;
+}
+
 void teleinfo_close (int fd)
 {
   close (fd);
 }
 
+int teleinfo_set_nonblocking (int fd)
+{
+  struct termios attr;
+  int flags = fcntl (fd, F_GETFL);
+
+  if (flags == -1 || fcntl (fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+    return -1;
+  }
+  if (tcgetattr (fd, &attr) == -1) {
+    // fifo or capture pipe
+    return 0;
+  }
+  // Without VTIME, poll waits for VMIN chars instead of the first one
+  attr.c_cc[VTIME] = 0;
+  attr.c_cc[VMIN] = TI_READ_MIN_BYTES;
+  return (tcsetattr (fd, TCSANOW, &attr) == -1) ? -1 : 1;
+}
+
+void teleinfo_reader_init (teleinfo_reader * reader, int fd)
+{
+  reader->fd = fd;
+  reader->start = 0;
+  reader->end = 0;
+  reader->syscalls = 0;
+  reader->frame_syscalls = 0;
+  reader->frame_errors = 0;
+  reader->init_bytes = 0;
+  reader->bytes = 0;
+}
+
+// Wait for data then pull a whole block from the port
+static int teleinfo_reader_fill (teleinfo_reader * reader)
+{
+  struct pollfd pfd = { .fd = reader->fd, .events = POLLIN };
+  int res;
+
+  do {
+    reader->syscalls++;
+    res = poll (&pfd, 1, TI_READ_TIMEOUT_MS);
+  } while (res < 0 && errno == EINTR);
+  if (res < 0) {
+    syslog(LOG_ERR, "unable to poll source: %s", strerror(errno)) ;
+    return EIO;
+  }
+  if (!res) {
+    // port is still there but the meter does not talk
+    syslog(LOG_INFO, "no data received from source") ;
+    return ETIMEDOUT;
+  }
+
+  ssize_t n;
+  do {
+    reader->syscalls++;
+    n = read (reader->fd, reader->chunk, sizeof(reader->chunk));
+  } while (n < 0 && errno == EINTR);
+  if (n <= 0) {
+    // readable but nothing to read: the device is gone
+    syslog(LOG_ERR, "unable to read from source: %s", n ? strerror(errno) : "end of file") ;
+    return EIO;
+  }
+  reader->start = 0;
+  reader->end = n;
+  reader->bytes += n;
+  return 0;
+}
+
+static inline int teleinfo_reader_getc (teleinfo_reader * reader, char * c)
+{
+  if (reader->start == reader->end) {
+    int err = teleinfo_reader_fill (reader);
+    if (err) {
+      return err;
+    }
+  }
+  *c = reader->chunk[reader->start++];
+  return 0;
+}
+
 #ifdef DEBUG
 #include "time.h"
 void dbg_dump(const char* buf, size_t n)
@@ -88,7 +313,7 @@ void dbg_dump(const char* buf, size_t n)
   time_t now = time(NULL);
   char filename[32];
   snprintf(filename, 31, "/tmp/teleinfo-dump-%d", (int)now);
-  syslog(LOG_INFO, "dumping buffer to %s (%d bytes)", filename, n);
+  syslog(LOG_INFO, "dumping buffer to %s (%zu bytes)", filename, n);
   FILE * file = fopen (filename, "wb");
   if (fwrite (buf, 1, n, file) != n)
     syslog(LOG_INFO, "unable to write dump file");
@@ -101,210 +326,441 @@ void dbg_dump(const char* buf, size_t n)
 // [ MESSAGE_0 ]
 // ... [ MESSAGE_N ]
 // ETX 1 char (0x03)
+//
+// Message (mode standard)
+// LF label HT [ datetime HT ] value HT checksum CR
 #define STX '\x02'
 #define ETX '\x03'
 #define EOT '\x04'
 #define LF  '\x0a'
 #define CR  '\x0d'
-int teleinfo_read_frame_ext (const int fd, char *const buffer, const size_t buflen, int *error_counter)
+#define HT  '\x09'
+
+// Checksum errors after which the whole frame is rejected (unless salvaging)
+#define TI_CHECKSUM_ERRORS_MAX 3
+
+#ifdef DEBUG
+#define TI_DEBUG_KEEP(D, C) do { if ((D)->raw_length < sizeof((D)->raw)) (D)->raw[(D)->raw_length++] = (C); } while (0)
+#define TI_DEBUG_DUMP(D, MSG) do { syslog(LOG_INFO, MSG); dbg_dump((D)->raw, (D)->raw_length); } while (0)
+#else
+#define TI_DEBUG_KEEP(D, C)
+#define TI_DEBUG_DUMP(D, MSG)
+#endif
+
+// Counters are only written by the thread feeding the decoder
+#define TI_COUNT(D, FIELD) do { \
+    if ((D)->counters) { \
+      unsigned long * counter = &((D)->counters->FIELD); \
+      __atomic_store_n(counter, *counter + 1, __ATOMIC_RELAXED); \
+    } \
+  } while (0)
+
+void teleinfo_decoder_init (teleinfo_decoder * decoder, teleinfo_line_handler on_line, void * userdata)
 {
-  char *p = buffer;
-  size_t s = 0;
-  char c;
-  enum state { INIT, FRAME_BEGIN, FRAME_END, MSG_BEGIN, MSG_END };
-  enum state current_state = INIT;
-  int error_count = 0;
-  int bytes_in_init_mode = 0;
+  memset (decoder, 0, sizeof(*decoder));
+  decoder->state = TI_STATE_INIT;
+  decoder->on_line = on_line;
+  decoder->userdata = userdata;
+}
 
-  do {
-    int res = read(fd, &c, 1) ;
-    if (!res) {
-      syslog(LOG_ERR, "unable to read from source\n") ;
-      return EIO;
+// Salvage mode only gives up the current message once a message has begun
+static int teleinfo_decoder_error (teleinfo_decoder * decoder, int reason)
+{
+  TI_COUNT(decoder, rejected[reason]);
+  if (decoder->salvage && decoder->state != TI_STATE_FRAME_BEGIN) {
+    decoder->skipped++;
+    decoder->state = TI_STATE_RESYNC;
+    return TI_EVENT_NONE;
+  }
+  decoder->state = TI_STATE_INIT;
+  return TI_EVENT_ERROR;
+}
+
+// End of frame, ETX or (salvage mode) a missing one
+static int teleinfo_decoder_end (teleinfo_decoder * decoder)
+{
+  decoder->state = TI_STATE_INIT;
+  if (decoder->salvage && !decoder->frame.datasetlen) {
+    return TI_EVENT_BADMSG;
+  }
+  TI_COUNT(decoder, frames);
+  if (decoder->skipped) {
+    TI_COUNT(decoder, salvaged);
+  }
+  return TI_EVENT_FRAME;
+}
+
+// Longest numbers that fit in an int64_t: 18 decimal digits, 15 hexadecimal ones
+#define TI_DECIMAL_DIGITS_MAX 18
+#define TI_HEXADECIMAL_DIGITS_MAX 15
+
+// Parses a value according to the type of its label
+// returns 1 if number has been set
+static int teleinfo_parse (teleinfo_type type, const char * value, size_t length, int64_t * number)
+{
+  uint64_t n = 0;
+
+  if (type == TI_TYPE_TEXT || !length
+      || length > (type == TI_TYPE_REGISTER ? TI_HEXADECIMAL_DIGITS_MAX : TI_DECIMAL_DIGITS_MAX)) {
+    return 0;
+  }
+  if (type == TI_TYPE_REGISTER) {
+    for (size_t i=0; i<length; i++) {
+      char c = value[i];
+      if (c >= '0' && c <= '9') {
+        n = (n << 4) | (c - '0');
+      } else if (c >= 'A' && c <= 'F') {
+        n = (n << 4) | (c - 'A' + 10);
+      } else {
+        return 0;
+      }
     }
-    switch(c) {
-      case STX:
-        if (current_state != INIT) {
-          #ifdef DEBUG
-          syslog(LOG_INFO, "new STX detected but not expected, resetting frame begin") ;
-          if (s<buflen) { *p++ = c; s++; } else { return EMSGSIZE; }
-          dbg_dump(buffer, s);
-          #endif
-          error_count++;
-        }
-        current_state = FRAME_BEGIN;
-        p = buffer;
-        s = 0;
-//         if (s<buflen) { *p++ = c; s++; } else { return EMSGSIZE; }
-        break;
-      case LF:
-        if (current_state != INIT) {
-          if ((current_state != FRAME_BEGIN) && (current_state != MSG_END)) {
-            #ifdef DEBUG
-            syslog(LOG_INFO, "LF detected but not expected, frame is invalid") ;
-            if (s<buflen) { *p++ = c; s++; } else { return EMSGSIZE; }
-            dbg_dump(buffer, s);
-            #endif
-            error_count++;
-            current_state = INIT;
-          } else {
-            current_state = MSG_BEGIN;
-            if (s<buflen) { *p++ = c; s++; } else { return EMSGSIZE; }
-          }
-        } // else do nothing: simply skip the char
-        break;
-      case CR:
-        if (current_state != INIT) {
-          if (current_state != MSG_BEGIN) {
-            #ifdef DEBUG
-            syslog(LOG_INFO, "CR detected but not expected, frame is invalid") ;
-            if (s<buflen) { *p++ = c; s++; } else { return EMSGSIZE; }
-            dbg_dump(buffer, s);
-            #endif
-            error_count++;
-            current_state = INIT;
-          } else {
-            current_state = MSG_END;
-            if (s<buflen) { *p++ = c; s++; } else { return EMSGSIZE; }
-          }
-        } // else do nothing: simply skip the char
-        break;
-      case ETX:
-        if (current_state != INIT) {
-          if (current_state != MSG_END) {
-            #ifdef DEBUG
-            syslog(LOG_INFO, "ETX detected but not expected, frame is invalid") ;
-            if (s<buflen) { *p++ = c; s++; } else { return EMSGSIZE; }
-            dbg_dump(buffer, s);
-            #endif
-            error_count++;
-            current_state = INIT;
-          } else {
-            current_state = FRAME_END;
-//             if (s<buflen) { *p++ = c; s++; } else { return EMSGSIZE; }
-          }
-        } // else do nothing: simply skip the char
-        break;
-      case EOT:
-        syslog(LOG_INFO, "frame have been interrupted by EOT, resetting frame");
-        current_state = INIT;
-        break;
-      default:
-        switch(current_state) {
-          case INIT:
-            // STX have not been detected yet, so we skip char
-            break;
-          case FRAME_BEGIN:
-            #ifdef DEBUG
-            syslog(LOG_INFO, "STX should be followed by LF, frame is invalid") ;
-            if (s<buflen) { *p++ = c; s++; } else { return EMSGSIZE; }
-            dbg_dump(buffer, s);
-            #endif
-            current_state = INIT;
-            error_count++;
-            break;
-          case FRAME_END:
-            // We should not be here !
-            break;
-          case MSG_BEGIN:
-            // Message content
-            if (s<buflen) { *p++ = c; s++; } else { return EMSGSIZE; }
-            break;
-          case MSG_END:
-            #ifdef DEBUG
-            syslog(LOG_INFO, "CR should be followed by ETX or LF, frame is invalid") ;
-            if (s<buflen) { *p++ = c; s++; } else { return EMSGSIZE; }
-            dbg_dump(buffer, s);
-            #endif
-            current_state = INIT;
-            error_count++;
-            break;
-        }
+  } else {
+    for (size_t i=0; i<length; i++) {
+      char c = value[i];
+      if (c < '0' || c > '9') {
+        return 0;
+      }
+      n = n * 10 + (c - '0');
     }
-    if (current_state == INIT) {
-      bytes_in_init_mode++;
+  }
+  *number = (int64_t)n;
+  return 1;
+}
+
+// "SAAMMJJhhmmss": season char, then BCD digits
+// returns 0 if the datetime is malformed
+static uint64_t teleinfo_datetime_pack (const char * datetime)
+{
+  uint64_t packed = (unsigned char)datetime[0];
+
+  for (size_t i=1; i<TI_DATETIME_LENGTH; i++) {
+    if (datetime[i] < '0' || datetime[i] > '9') {
+      return 0;
     }
-  } while ((current_state != FRAME_END) && (error_count<10) && (bytes_in_init_mode<TI_FRAME_LENGTH_MAX*2));
-  if (error_counter != NULL) {
-    *error_counter = error_count;
+    packed = (packed << 4) | (datetime[i] - '0');
   }
-  if (current_state == FRAME_END) {
-    return 0;
-  } else {
-    syslog(LOG_INFO, "too many error while reading, giving up");
-    return EBADMSG;
+  return packed;
+}
+
+void teleinfo_datetime_format (uint64_t datetime, char text[TI_DATETIME_LENGTH + 1])
+{
+  for (size_t i=TI_DATETIME_LENGTH-1; i>0; i--) {
+    text[i] = '0' + (datetime & 0xF);
+    datetime >>= 4;
   }
+  text[0] = datetime;
+  text[TI_DATETIME_LENGTH] = '\0';
 }
 
-int teleinfo_checksum (char *message, char *message_oel)
+// Called on CR: the line is complete, its sum has been computed while it was
+// received and its tabs are known, so it only has to be checked and split.
+static int teleinfo_decoder_line (teleinfo_decoder * decoder)
 {
-  unsigned char sum = 0 ;                 // Somme des codes ASCII du message
+  const char * line = decoder->line;
+  size_t length = decoder->line_length;
+  size_t tab_count = decoder->tab_count;
+  int reason = TI_REJECT_FRAMING;
 
-  message++;
-  while ( (*message != '\0') && (message != (message_oel-1) ) ) { // Tant qu'on est pas au checksum
-    sum += *message;
-    message++;
+  // Checksum is the last char and follows the last tab
+  if (tab_count < 2 || decoder->tabs[tab_count-1] + 2 != length) {
+    goto bad_line;
   }
+  unsigned char checksum = line[length-1];
+  unsigned char sum = decoder->sum - checksum;
   sum = (sum & 0x3F) + 0x20 ;
-  if ( sum == *message) {
-    return 1 ;        // Return 1 si checkum ok.*
-  }
+  if (sum != checksum) {
+    reason = TI_REJECT_CHECKSUM;
 #ifdef DEBUG
-  syslog(LOG_INFO, "wrong checksum: 0x%02x should be 0x%02x", *message, sum) ;
+    syslog(LOG_INFO, "wrong checksum: 0x%02x should be 0x%02x", checksum, sum) ;
 #endif
-  return 0;
-}
+    goto bad_line;
+  }
 
-int teleinfo_decode (const char * frame, teleinfo_data dataset[], size_t * datasetlen)
-{
-  char * message_oel;
-  char * message = (char*)frame;
-  int error_in_message = 0;
-  size_t data_count = 0;
-  *datasetlen = 0;
+  size_t label_length = decoder->tabs[0];
+  size_t datetime_length = 0;
+  size_t value_start = decoder->tabs[0] + 1;
+  size_t value_length = decoder->tabs[1] - value_start;
+  if (tab_count == 3) {
+    datetime_length = value_length;
+    value_start = decoder->tabs[1] + 1;
+    value_length = decoder->tabs[2] - value_start;
+  }
+  if (label_length > TI_LABEL_LENGTH_MAX || value_length > TI_VALUE_LENGTH_MAX
+      || (datetime_length && datetime_length != TI_DATETIME_LENGTH)) {
+    reason = TI_REJECT_OVERSIZE;
+    goto bad_line;
+  }
+  uint64_t datetime = datetime_length ? teleinfo_datetime_pack (line + label_length + 1) : 0;
+  if (datetime_length && !datetime) {
+    goto bad_line;
+  }
+  teleinfo_frame * frame = &(decoder->frame);
+  if (frame->datasetlen == TI_MESSAGE_COUNT_MAX
+      || frame->text_length + label_length + value_length + 2 > sizeof(frame->text)) {
+    // More lines than the specification allows
+    return teleinfo_decoder_error (decoder, TI_REJECT_OVERSIZE);
+  }
 
-  while ( (message_oel = strchr(message, 0x0d)) ) {
-    if (1 == teleinfo_checksum(message, message_oel)) {
-      message++; // On passe le LF de début de ligne
+  teleinfo_data * data = &(frame->dataset[frame->datasetlen++]);
+  char * text = frame->text + frame->text_length;
+  memcpy (text, line, label_length);
+  text[label_length] = '\0';
+  memcpy (text + label_length + 1, line + value_start, value_length);
+  text[label_length + 1 + value_length] = '\0';
+  data->label = frame->text_length;
+  data->value = frame->text_length + label_length + 1;
+  data->value_length = value_length;
+  frame->text_length += label_length + value_length + 2;
+  data->datetime = datetime;
+  data->id = teleinfo_label_id (decoder->label_hash, line, label_length);
+  data->numeric = (data->id != TI_LABEL_UNKNOWN)
+    && teleinfo_parse (teleinfo_labels[data->id].type, line + value_start, value_length, &(data->number));
 
-      char *tab_index = strchr(message, '\t');
-      int length = tab_index - message;
+  TI_COUNT(decoder, lines);
+  if (decoder->on_line) {
+    decoder->on_line (frame, data, decoder->userdata);
+  }
+  return TI_EVENT_LINE;
+
+bad_line:
+  TI_COUNT(decoder, rejected[reason]);
+  if (decoder->salvage) {
+    decoder->skipped++;
+    return TI_EVENT_NONE;
+  }
+  decoder->checksum_errors++;
+  if (decoder->checksum_errors >= TI_CHECKSUM_ERRORS_MAX) {
+    decoder->state = TI_STATE_INIT;
+    return TI_EVENT_BADMSG;
+  }
+  return TI_EVENT_NONE;
+}
 
-      strncpy(dataset[data_count].label, message, length);
-      dataset[data_count].label[length] = '\0';
-      char * previous_tab_index = message = tab_index + 1;
+int teleinfo_decoder_feed (teleinfo_decoder * decoder, const char c)
+{
+  if (decoder->state != TI_STATE_INIT) {
+    TI_DEBUG_KEEP(decoder, c);
+  }
+  switch(c) {
+    case STX: {
+      int event = TI_EVENT_NONE;
+      if (decoder->state != TI_STATE_INIT) {
+        TI_DEBUG_DUMP(decoder, "new STX detected but not expected, resetting frame begin");
+        if (decoder->salvage && decoder->state != TI_STATE_FRAME_BEGIN) {
+          // ETX lost: messages received so far are a frame, the dataset is
+          // reset by the first LF of the new one
+          TI_COUNT(decoder, rejected[TI_REJECT_FRAMING]);
+          decoder->skipped++;
+          event = teleinfo_decoder_end (decoder);
+        } else {
+          event = TI_EVENT_ERROR;
+        }
+      }
+      decoder->state = TI_STATE_FRAME_BEGIN;
+#ifdef DEBUG
+      decoder->raw_length = 0;
+#endif
+      return event;
+    }
+    case LF:
+      if (decoder->state == TI_STATE_INIT) {
+        // simply skip the char
+        return TI_EVENT_NONE;
+      }
+      if (decoder->state == TI_STATE_MSG_BEGIN && decoder->salvage) {
+        // CR lost: the message is skipped, this LF begins the next one
+        TI_COUNT(decoder, rejected[TI_REJECT_FRAMING]);
+        decoder->skipped++;
+      } else if ((decoder->state != TI_STATE_FRAME_BEGIN) && (decoder->state != TI_STATE_MSG_END) && (decoder->state != TI_STATE_RESYNC)) {
+        TI_DEBUG_DUMP(decoder, "LF detected but not expected, frame is invalid");
+        return teleinfo_decoder_error (decoder, TI_REJECT_FRAMING);
+      }
+      if (decoder->state == TI_STATE_FRAME_BEGIN) {
+        decoder->frame.datasetlen = 0;
+        decoder->frame.text_length = 0;
+        decoder->checksum_errors = 0;
+        decoder->skipped = 0;
+      }
+      decoder->state = TI_STATE_MSG_BEGIN;
+      decoder->line_length = 0;
+      decoder->tab_count = 0;
+      decoder->label_hash = TI_LABEL_HASH_SEED;
+      decoder->sum = 0;
+      return TI_EVENT_NONE;
+    case CR:
+      if (decoder->state == TI_STATE_INIT || decoder->state == TI_STATE_RESYNC) {
+        return TI_EVENT_NONE;
+      }
+      if (decoder->state != TI_STATE_MSG_BEGIN) {
+        TI_DEBUG_DUMP(decoder, "CR detected but not expected, frame is invalid");
+        return teleinfo_decoder_error (decoder, TI_REJECT_FRAMING);
+      }
+      decoder->state = TI_STATE_MSG_END;
+      return teleinfo_decoder_line (decoder);
+    case ETX:
+      if (decoder->state == TI_STATE_INIT) {
+        return TI_EVENT_NONE;
+      }
+      if (decoder->state == TI_STATE_MSG_BEGIN && decoder->salvage) {
+        // Last message cut short
+        TI_COUNT(decoder, rejected[TI_REJECT_FRAMING]);
+        decoder->skipped++;
+      } else if (decoder->state != TI_STATE_MSG_END && decoder->state != TI_STATE_RESYNC) {
+        TI_DEBUG_DUMP(decoder, "ETX detected but not expected, frame is invalid");
+        return teleinfo_decoder_error (decoder, TI_REJECT_FRAMING);
+      }
+      // Frame is complete, wait for the next STX
+      return teleinfo_decoder_end (decoder);
+    case EOT:
+      syslog(LOG_INFO, "frame have been interrupted by EOT, resetting frame");
+      decoder->state = TI_STATE_INIT;
+      return TI_EVENT_NONE;
+    default:
+      switch(decoder->state) {
+        case TI_STATE_INIT:
+          // STX have not been detected yet, so we skip char
+          return TI_EVENT_NONE;
+        case TI_STATE_RESYNC:
+          // rest of a damaged message
+          return TI_EVENT_NONE;
+        case TI_STATE_FRAME_BEGIN:
+          TI_DEBUG_DUMP(decoder, "STX should be followed by LF, frame is invalid");
+          return teleinfo_decoder_error (decoder, TI_REJECT_FRAMING);
+        case TI_STATE_MSG_BEGIN:
+          // Message content
+          if (decoder->line_length == sizeof(decoder->line)) {
+            TI_DEBUG_DUMP(decoder, "message is too long, frame is invalid");
+            return teleinfo_decoder_error (decoder, TI_REJECT_OVERSIZE);
+          }
+          if (c == HT) {
+            if (decoder->tab_count == sizeof(decoder->tabs)/sizeof(decoder->tabs[0])) {
+              TI_DEBUG_DUMP(decoder, "too many fields in message, frame is invalid");
+              return teleinfo_decoder_error (decoder, TI_REJECT_FRAMING);
+            }
+            decoder->tabs[decoder->tab_count++] = decoder->line_length;
+          } else if (!decoder->tab_count) {
+            decoder->label_hash = teleinfo_label_hash_step (decoder->label_hash, c);
+          }
+          decoder->line[decoder->line_length++] = c;
+          decoder->sum += c;
+          return TI_EVENT_NONE;
+        case TI_STATE_MSG_END:
+          TI_DEBUG_DUMP(decoder, "CR should be followed by ETX or LF, frame is invalid");
+          return teleinfo_decoder_error (decoder, TI_REJECT_FRAMING);
+      }
+  }
+  return TI_EVENT_NONE;
+}
 
-      tab_index = strchr(message, '\t');
-      length = tab_index - message;
-      message = tab_index + 1;
+int teleinfo_read_frame_ext (teleinfo_reader * reader, teleinfo_decoder * decoder, int *error_counter)
+{
+  char c;
+  int event;
+  int error_count = 0;
+  int bytes_in_init_mode = 0;
+  unsigned long syscalls = reader->syscalls;
 
-      tab_index = strchr(message, '\t');
-      if (tab_index && tab_index < message_oel) {
+  do {
+    int err = teleinfo_reader_getc (reader, &c);
+    if (err) {
+      return err;
+    }
+    event = teleinfo_decoder_feed (decoder, c);
+    if (event == TI_EVENT_ERROR) {
+      error_count++;
+    } else if (event == TI_EVENT_BADMSG) {
+      syslog(LOG_INFO, "too many checksum errors, frame rejected");
+      return EBADMSG;
+    }
+    if (decoder->state == TI_STATE_INIT) {
+      bytes_in_init_mode++;
+    }
+  } while ((event != TI_EVENT_FRAME) && (error_count<10) && (bytes_in_init_mode<TI_FRAME_LENGTH_MAX*2));
+  if (error_counter != NULL) {
+    *error_counter = error_count;
+  }
+  reader->frame_syscalls = reader->syscalls - syscalls;
+#ifdef DEBUG
+  syslog(LOG_INFO, "frame read with %lu syscalls", reader->frame_syscalls);
+#endif
+  if (event == TI_EVENT_FRAME) {
+    return 0;
+  } else {
+    syslog(LOG_INFO, "too many error while reading, giving up");
+    return EBADMSG;
+  }
+}
 
-        strncpy(dataset[data_count].datetime, previous_tab_index, length);
-        dataset[data_count].datetime[length] = '\0';
+int teleinfo_read_available (teleinfo_reader * reader, teleinfo_decoder * decoder)
+{
+  int err = 0;
 
-        length = tab_index - message;
-        strncpy(dataset[data_count].value, message, length);
-        dataset[data_count].value[length] = '\0';
+  for (;;) {
+    if (reader->start == reader->end) {
+      ssize_t n;
+      do {
+        reader->syscalls++;
+        n = read (reader->fd, reader->chunk, sizeof(reader->chunk));
+      } while (n < 0 && errno == EINTR);
+      if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return EAGAIN;
       }
-      else {
-
-        strncpy(dataset[data_count].value, previous_tab_index, length);
-        dataset[data_count].value[length] = '\0';
+      if (n <= 0) {
+        syslog(LOG_ERR, "unable to read from source: %s", n ? strerror(errno) : "end of file") ;
+        return EIO;
       }
-      data_count++;
+      reader->start = 0;
+      reader->end = n;
+      reader->bytes += n;
     }
-    else {
-      // Erreur de checksum
-      error_in_message++;
-      if (error_in_message>=3) {
-        return EBADMSG;
-      }
+    int event = teleinfo_decoder_feed (decoder, reader->chunk[reader->start++]);
+    if (event == TI_EVENT_ERROR) {
+      reader->frame_errors++;
+    } else if (event == TI_EVENT_BADMSG) {
+      syslog(LOG_INFO, "%s, frame rejected", decoder->salvage ? "no valid message" : "too many checksum errors");
+      err = EBADMSG;
+    }
+    if (decoder->state == TI_STATE_INIT) {
+      reader->init_bytes++;
     }
-    message = message_oel; // On se place sur la fin de ligne
-    message++; // On passe le CR de fin de ligne
+    if (!err && event != TI_EVENT_FRAME && (reader->frame_errors >= 10 || reader->init_bytes >= TI_FRAME_LENGTH_MAX*2)) {
+      syslog(LOG_INFO, "too many error while reading, giving up");
+      err = EBADMSG;
+    }
+    if (err || event == TI_EVENT_FRAME) {
+      reader->frame_errors = 0;
+      reader->init_bytes = 0;
+      return err;
+    }
+  }
+}
+
+int teleinfo_decode (const char * text, teleinfo_frame * frame)
+{
+  teleinfo_decoder decoder;
+  int event = TI_EVENT_NONE;
+
+  teleinfo_decoder_init (&decoder, NULL, NULL);
+  frame->datasetlen = 0;
+  frame->text_length = 0;
+  teleinfo_decoder_feed (&decoder, STX);
+  for (const char * p = text; *p && event != TI_EVENT_BADMSG && event != TI_EVENT_ERROR; p++) {
+    event = teleinfo_decoder_feed (&decoder, *p);
+  }
+  // After a framing error the decoder waits for the next STX: the messages
+  // left would be dropped and the frame cut short
+  if (event == TI_EVENT_BADMSG || event == TI_EVENT_ERROR) {
+    return EBADMSG;
   }
-  *datasetlen = data_count;
+  teleinfo_frame_copy (frame, &(decoder.frame));
   return 0;
 }
+
+void teleinfo_frame_copy (teleinfo_frame * to, const teleinfo_frame * from)
+{
+  memcpy (to->dataset, from->dataset, from->datasetlen * sizeof(teleinfo_data));
+  memcpy (to->text, from->text, from->text_length);
+  to->datasetlen = from->datasetlen;
+  to->text_length = from->text_length;
+}
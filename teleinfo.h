@@ -26,10 +26,22 @@
 #define _TELEINFO_H_
 
 #include <sys/types.h>
+#include <stdint.h>
+
+#define TI_LABEL_LENGTH_MAX 9
+#define TI_DATETIME_LENGTH 13 // season then YYMMDDhhmmss
+#define TI_VALUE_LENGTH_MAX 98
+
+// A message: label and value are NUL terminated strings of the frame text
+// (TI_LABEL, TI_VALUE), the datetime is packed into an integer
 typedef struct {
-  char label[9];
-  char datetime[14];
-  char value[99];
+  uint64_t datetime;           // season << 48 | BCD digits, 0 if none (teleinfo_datetime_format)
+  int64_t number;
+  uint16_t label;              // offsets in the frame text
+  uint16_t value;
+  unsigned char value_length;
+  char numeric;                // value has been parsed into number
+  short id;                    // index in teleinfo_labels or TI_LABEL_UNKNOWN
 } teleinfo_data;
 
 #define TI_MESSAGE_COUNT_MAX 71
@@ -43,17 +55,200 @@ typedef struct {
 // 1 checksum char per message
 #define TI_FRAME_LENGTH_MAX (2 + 395 + 312 + 639 + (TI_MESSAGE_COUNT_MAX * 2) + (47 * 2) + (24 * 3) + TI_MESSAGE_COUNT_MAX)
 
+// Longest message between LF and CR: label, datetime and value separated by tabs, then checksum
+#define TI_LINE_LENGTH_MAX (TI_LABEL_LENGTH_MAX + 1 + TI_DATETIME_LENGTH + 1 + TI_VALUE_LENGTH_MAX + 1 + 1)
+
 #define DATETIME_FILENAME_SUFFIX ".datetime"
 
+// Labels and values of a frame with their NULs: 395 + 639 + 2 * 71 = 1176
+// within the specification, some room for labels out of it
+#define TI_FRAME_TEXT_MAX 1536
+
+// Messages of a frame and the text they refer to
+typedef struct {
+  teleinfo_data dataset[TI_MESSAGE_COUNT_MAX];
+  size_t datasetlen;
+  size_t text_length;
+  char text[TI_FRAME_TEXT_MAX];
+} teleinfo_frame;
+
+#define TI_LABEL(F, D) ((F)->text + (D)->label)
+#define TI_VALUE(F, D) ((F)->text + (D)->value)
+
+// Known labels of the standard mode (teleinfo_labels.c)
+#define TI_LABEL_COUNT TI_MESSAGE_COUNT_MAX
+#define TI_LABEL_UNKNOWN (-1)
+
+// How a value is parsed (numeric types are parsed at decode time)
+typedef enum {
+  TI_TYPE_TEXT,     // kept as a string only
+  TI_TYPE_INDEX,    // energy counter (Wh, VArh)
+  TI_TYPE_POWER,    // VA, W or kVA
+  TI_TYPE_VOLTAGE,  // V
+  TI_TYPE_CURRENT,  // A
+  TI_TYPE_NUMBER,   // tariff index, day number...
+  TI_TYPE_BITFIELD, // decimal bit field (RELAIS)
+  TI_TYPE_REGISTER, // hexadecimal status register (STGE)
+} teleinfo_type;
+
+typedef struct {
+  const char * name;
+  unsigned char length;
+  unsigned char datetime; // message carries a datetime
+  teleinfo_type type;
+  const char * unit;
+} teleinfo_label;
+
+extern const teleinfo_label teleinfo_labels[TI_LABEL_COUNT];
+
+// Label hash, computed a char at a time while the label is received
+#define TI_LABEL_HASH_SEED 0x81b5u
+#define TI_LABEL_HASH_SLOTS 256
+#define TI_LABEL_HASH_SLOT(H) ((H) >> 24)
+static inline uint32_t teleinfo_label_hash_step (uint32_t hash, char c)
+{
+  return (hash ^ (unsigned char)c) * 0x01000193u;
+}
+
+// returns the label id or TI_LABEL_UNKNOWN
+int teleinfo_label_id (uint32_t hash, const char * label, size_t length);
+int teleinfo_label_find (const char * label, size_t length);
+
+// Size of the block read from the serial port at once
+#define TI_READ_CHUNK_SIZE 256
+// Bytes a read from the serial port waits for: about a message, 33 ms at 9600 bauds
+#define TI_READ_MIN_BYTES 32
+// Silence after which the bytes left below TI_READ_MIN_BYTES are read (teleinfo_set_nonblocking)
+#define TI_READ_FLUSH_MS 50
+// Time without any byte after which the meter is considered offline
+#define TI_READ_TIMEOUT_MS 8000
+
+// Buffered input: bytes left over after a frame are kept for the next one
+typedef struct {
+  int fd;
+  char chunk[TI_READ_CHUNK_SIZE];
+  size_t start;
+  size_t end;
+  unsigned long syscalls;       // poll/read calls since init
+  unsigned long frame_syscalls; // poll/read calls used by the last frame
+  unsigned long bytes;          // bytes read since init
+  int frame_errors;             // framing errors since the last frame (teleinfo_read_available)
+  int init_bytes;               // bytes out of any frame since the last frame (teleinfo_read_available)
+} teleinfo_reader;
+
+typedef enum {
+  TI_STATE_INIT,        // waiting for STX
+  TI_STATE_FRAME_BEGIN, // STX received
+  TI_STATE_MSG_BEGIN,   // LF received, reading message
+  TI_STATE_MSG_END,     // CR received
+  TI_STATE_RESYNC,      // damaged message skipped, waiting for next LF (salvage mode)
+} teleinfo_state;
+
+// Events returned by teleinfo_decoder_feed
+enum {
+  TI_EVENT_NONE,   // need more bytes
+  TI_EVENT_LINE,   // a valid message has been added to the dataset
+  TI_EVENT_FRAME,  // ETX received, dataset holds the whole frame (the valid messages in salvage mode)
+  TI_EVENT_ERROR,  // framing error, waiting for next STX
+  TI_EVENT_BADMSG, // too many checksum errors, frame rejected (no valid message in salvage mode)
+};
+
+typedef void (*teleinfo_line_handler) (const teleinfo_frame * frame, const teleinfo_data * data, void * userdata);
+
+// Why a message has been rejected
+enum {
+  TI_REJECT_CHECKSUM, // wrong checksum
+  TI_REJECT_FRAMING,  // unexpected control char, missing field
+  TI_REJECT_OVERSIZE, // message, field or frame too long
+  TI_REJECT_COUNT,
+};
+
+// Cumulative decoding counters, only written by the thread feeding the decoder
+// (relaxed atomic stores: they may be read from other threads)
+typedef struct {
+  unsigned long frames;
+  unsigned long lines;
+  unsigned long rejected[TI_REJECT_COUNT];
+  unsigned long salvaged; // frames kept with some messages skipped
+} teleinfo_counters;
+
+// Incremental decoder: framing, checksum and field splitting are done while
+// bytes are received, each message is available as soon as its CR arrives.
+// In salvage mode, a damaged message is skipped instead of rejecting the
+// frame: decoding resumes at the next LF, and a frame cut short by a lost
+// ETX or an early STX ends with the messages received so far.
+typedef struct {
+  teleinfo_state state;
+  char line[TI_LINE_LENGTH_MAX];
+  size_t line_length;
+  size_t tabs[3];
+  size_t tab_count;
+  uint32_t label_hash;
+  unsigned char sum;
+  int checksum_errors;
+  char salvage;        // set once the decoder is initialized
+  int skipped;         // messages skipped in the current frame (salvage mode)
+  teleinfo_frame frame;
+  teleinfo_line_handler on_line;
+  void * userdata;
+  teleinfo_counters * counters; // NULL if not counted
+#ifdef DEBUG
+  char raw[TI_FRAME_LENGTH_MAX];
+  size_t raw_length;
+#endif
+} teleinfo_decoder;
+
+// port may be a serial port, a pseudo-terminal, a fifo or a capture file
+// (raw bytes as received from the meter, replayed at teleinfo_set_replay_speed)
 // returns file descriptor if succeed otherwise 0
 int teleinfo_open (const char * port);
 
-// returns 0 if succeed otherwise negative
-#define teleinfo_read_frame(X, Y, Z) teleinfo_read_frame_ext(X, Y, Z, NULL)
-int teleinfo_read_frame_ext (const int fd, char *const buffer, const size_t buflen, int *error_counter);
+// Checks that teleinfo_open may open port, leaving nothing open: a capture
+// file is not replayed
+// returns 0 if succeed otherwise an errno value
+int teleinfo_check (const char * port);
+
+// Speed of capture replay: 1 for real time (9600 bauds), N for N times faster,
+// 0 for as fast as possible
+void teleinfo_set_replay_speed (unsigned int speed);
+
+// Makes fd non blocking for an event loop. read then ignores VMIN/VTIME but
+// poll does not: a serial port is reported readable once TI_READ_MIN_BYTES
+// are waiting, the caller reads the end of a frame after TI_READ_FLUSH_MS
+// returns 1 for a serial port, 0 for a fifo or a capture, -1 on error
+int teleinfo_set_nonblocking (int fd);
+
+void teleinfo_reader_init (teleinfo_reader * reader, int fd);
+
+// on_line (may be NULL) is called for each valid message
+// counters and salvage may be set once the decoder is initialized
+void teleinfo_decoder_init (teleinfo_decoder * decoder, teleinfo_line_handler on_line, void * userdata);
+
+// returns one of TI_EVENT_*
+int teleinfo_decoder_feed (teleinfo_decoder * decoder, const char c);
+
+// Reads until a whole frame is decoded into decoder->frame
+// returns 0 if succeed otherwise an errno value:
+// EIO when the port must be reopened, ETIMEDOUT when no data came in, EBADMSG on garbage
+#define teleinfo_read_frame(X, Y) teleinfo_read_frame_ext(X, Y, NULL)
+int teleinfo_read_frame_ext (teleinfo_reader * reader, teleinfo_decoder * decoder, int *error_counter);
+
+// Event loop flavour of teleinfo_read_frame for a non blocking fd: decodes the
+// bytes available, stops at the end of a frame (leftover bytes are kept)
+// returns 0 if a frame has been decoded, EAGAIN when no more bytes are available
+// otherwise EIO or EBADMSG as teleinfo_read_frame
+int teleinfo_read_available (teleinfo_reader * reader, teleinfo_decoder * decoder);
+
+// Decodes a captured frame (messages without STX/ETX)
+// returns 0 if succeed otherwise EBADMSG: too many checksum errors, or a
+// framing error (the messages after it would be lost)
+int teleinfo_decode (const char * text, teleinfo_frame * frame);
+
+// Copies the used part of a frame
+void teleinfo_frame_copy (teleinfo_frame * to, const teleinfo_frame * from);
 
-// returns 0 if succeed otherwise negative
-int teleinfo_decode (const char * frame, teleinfo_data dataset[], size_t * datasetlen);
+// Writes the TI_DATETIME_LENGTH chars of a packed datetime and a NUL
+void teleinfo_datetime_format (uint64_t datetime, char text[TI_DATETIME_LENGTH + 1]);
 
 void teleinfo_close (int fd);
 
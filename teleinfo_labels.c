@@ -0,0 +1,145 @@
+/*
+ * teleinfuse is a FUSE module to access to the Télé information of linky electric meter running in standard mode
+ * Télé info data are transmitted by french electric meters (EDF/ERDF)
+ * [FR] Permet de lire la téléinformation cliente (TIC) d'un compteur linky en mode standard.
+ * [FR] Pour le mode TIC historique, voir le projet original
+ *
+ * Based on https://github.com/neomilium/teleinfuse project by Romuald Conty
+ *
+ * Copyright (C) 2020 itineric
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "teleinfo.h"
+
+#include <string.h>
+
+// Labels of the standard mode (see doc/Enedis-NOI-CPT_54E.pdf, page 18)
+// The order gives the label id. Type and unit tell how a value is parsed.
+const teleinfo_label teleinfo_labels[TI_LABEL_COUNT] = {
+  { "ADSC",      4, 0, TI_TYPE_TEXT,     ""     },
+  { "VTIC",      4, 0, TI_TYPE_TEXT,     ""     },
+  { "DATE",      4, 1, TI_TYPE_TEXT,     ""     },
+  { "NGTF",      4, 0, TI_TYPE_TEXT,     ""     },
+  { "LTARF",     5, 0, TI_TYPE_TEXT,     ""     },
+  { "EAST",      4, 0, TI_TYPE_INDEX,    "Wh"   },
+  { "EASF01",    6, 0, TI_TYPE_INDEX,    "Wh"   },
+  { "EASF02",    6, 0, TI_TYPE_INDEX,    "Wh"   },
+  { "EASF03",    6, 0, TI_TYPE_INDEX,    "Wh"   },
+  { "EASF04",    6, 0, TI_TYPE_INDEX,    "Wh"   },
+  { "EASF05",    6, 0, TI_TYPE_INDEX,    "Wh"   },
+  { "EASF06",    6, 0, TI_TYPE_INDEX,    "Wh"   },
+  { "EASF07",    6, 0, TI_TYPE_INDEX,    "Wh"   },
+  { "EASF08",    6, 0, TI_TYPE_INDEX,    "Wh"   },
+  { "EASF09",    6, 0, TI_TYPE_INDEX,    "Wh"   },
+  { "EASF10",    6, 0, TI_TYPE_INDEX,    "Wh"   },
+  { "EASD01",    6, 0, TI_TYPE_INDEX,    "Wh"   },
+  { "EASD02",    6, 0, TI_TYPE_INDEX,    "Wh"   },
+  { "EASD03",    6, 0, TI_TYPE_INDEX,    "Wh"   },
+  { "EASD04",    6, 0, TI_TYPE_INDEX,    "Wh"   },
+  { "EAIT",      4, 0, TI_TYPE_INDEX,    "Wh"   },
+  { "ERQ1",      4, 0, TI_TYPE_INDEX,    "VArh" },
+  { "ERQ2",      4, 0, TI_TYPE_INDEX,    "VArh" },
+  { "ERQ3",      4, 0, TI_TYPE_INDEX,    "VArh" },
+  { "ERQ4",      4, 0, TI_TYPE_INDEX,    "VArh" },
+  { "IRMS1",     5, 0, TI_TYPE_CURRENT,  "A"    },
+  { "IRMS2",     5, 0, TI_TYPE_CURRENT,  "A"    },
+  { "IRMS3",     5, 0, TI_TYPE_CURRENT,  "A"    },
+  { "URMS1",     5, 0, TI_TYPE_VOLTAGE,  "V"    },
+  { "URMS2",     5, 0, TI_TYPE_VOLTAGE,  "V"    },
+  { "URMS3",     5, 0, TI_TYPE_VOLTAGE,  "V"    },
+  { "PREF",      4, 0, TI_TYPE_POWER,    "kVA"  },
+  { "PCOUP",     5, 0, TI_TYPE_POWER,    "kVA"  },
+  { "SINSTS",    6, 0, TI_TYPE_POWER,    "VA"   },
+  { "SINSTS1",   7, 0, TI_TYPE_POWER,    "VA"   },
+  { "SINSTS2",   7, 0, TI_TYPE_POWER,    "VA"   },
+  { "SINSTS3",   7, 0, TI_TYPE_POWER,    "VA"   },
+  { "SMAXSN",    6, 1, TI_TYPE_POWER,    "VA"   },
+  { "SMAXSN1",   7, 1, TI_TYPE_POWER,    "VA"   },
+  { "SMAXSN2",   7, 1, TI_TYPE_POWER,    "VA"   },
+  { "SMAXSN3",   7, 1, TI_TYPE_POWER,    "VA"   },
+  { "SMAXSN-1",  8, 1, TI_TYPE_POWER,    "VA"   },
+  { "SMAXSN1-1", 9, 1, TI_TYPE_POWER,    "VA"   },
+  { "SMAXSN2-1", 9, 1, TI_TYPE_POWER,    "VA"   },
+  { "SMAXSN3-1", 9, 1, TI_TYPE_POWER,    "VA"   },
+  { "SINSTI",    6, 0, TI_TYPE_POWER,    "VA"   },
+  { "SMAXIN",    6, 1, TI_TYPE_POWER,    "VA"   },
+  { "SMAXIN-1",  8, 1, TI_TYPE_POWER,    "VA"   },
+  { "CCASN",     5, 1, TI_TYPE_POWER,    "W"    },
+  { "CCASN-1",   7, 1, TI_TYPE_POWER,    "W"    },
+  { "CCAIN",     5, 1, TI_TYPE_POWER,    "W"    },
+  { "CCAIN-1",   7, 1, TI_TYPE_POWER,    "W"    },
+  { "UMOY1",     5, 1, TI_TYPE_VOLTAGE,  "V"    },
+  { "UMOY2",     5, 1, TI_TYPE_VOLTAGE,  "V"    },
+  { "UMOY3",     5, 1, TI_TYPE_VOLTAGE,  "V"    },
+  { "STGE",      4, 0, TI_TYPE_REGISTER, ""     },
+  { "DPM1",      4, 1, TI_TYPE_NUMBER,   ""     },
+  { "FPM1",      4, 1, TI_TYPE_NUMBER,   ""     },
+  { "DPM2",      4, 1, TI_TYPE_NUMBER,   ""     },
+  { "FPM2",      4, 1, TI_TYPE_NUMBER,   ""     },
+  { "DPM3",      4, 1, TI_TYPE_NUMBER,   ""     },
+  { "FPM3",      4, 1, TI_TYPE_NUMBER,   ""     },
+  { "MSG1",      4, 0, TI_TYPE_TEXT,     ""     },
+  { "MSG2",      4, 0, TI_TYPE_TEXT,     ""     },
+  { "PRM",       3, 0, TI_TYPE_TEXT,     ""     },
+  { "RELAIS",    6, 0, TI_TYPE_BITFIELD, ""     },
+  { "NTARF",     5, 0, TI_TYPE_NUMBER,   ""     },
+  { "NJOURF",    6, 0, TI_TYPE_NUMBER,   ""     },
+  { "NJOURF+1",  8, 0, TI_TYPE_NUMBER,   ""     },
+  { "PJOURF+1",  8, 0, TI_TYPE_TEXT,     ""     },
+  { "PPOINTE",   7, 0, TI_TYPE_TEXT,     ""     },
+};
+
+// Perfect hash: slot = top byte of FNV-1a (seeded with TI_LABEL_HASH_SEED) of the label
+// Each slot holds the label id + 1, 0 if no label lands there.
+// The seed is the smallest one for which the labels above do not collide: when
+// a label is added, make labels prints the new seed and table (teleinfo_labels_gen.c).
+static const unsigned char teleinfo_label_slots[TI_LABEL_HASH_SLOTS] = {
+   0,  0,  0,  0,  0,  0,  0,  0,  0,  0, 48, 66,  0,  0,  0,  0,
+   0, 69,  0, 52,  0,  0,  0,  0,  0,  0, 65,  0,  0,  0,  0,  0,
+  30, 31,  0, 29,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+  16,  0,  0, 64, 34, 42, 63, 55, 54, 53, 47,  0,  0,  0, 46,  0,
+  27, 28,  0, 26,  0,  0,  0,  0, 56,  0, 44,  0,  0,  0,  0,  0,
+   0,  0,  3,  0,  0,  0,  0,  0, 32,  0,  0,  0, 51, 25,  0,  0,
+  22,  0, 24, 23,  0,  0,  0,  0,  0,  0,  0,  5,  0,  0,  0,  0,
+   0,  0,  0,  0,  0,  0,  0,  0,  0,  0, 38, 49,  0,  0,  2,  0,
+   0,  0,  0, 33,  0,  0,  0,  1,  0,  0,  0,  0,  0,  0,  0,  0,
+   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  6, 39,  0, 41, 40,
+   0,  0,  0,  0, 12, 13, 10, 11,  8,  9,  0,  7,  0,  0,  0, 21,
+   0,  0, 14, 15,  0, 67,  0,  0,  0,  0,  0,  0,  0,  0, 60, 62,
+   0, 58, 70,  0,  0, 45,  0,  0, 20,  0,  0,  0,  0, 17, 18, 19,
+   0,  0,  0,  0,  0,  4,  0,  0,  0,  0,  0,  0, 68,  0,  0,  0,
+  37, 36, 35,  0,  0,  0,  0, 71,  0,  0,  0,  0, 57, 59, 61,  0,
+   0,  0,  0, 50,  0,  0,  0,  0, 43,  0,  0,  0,  0,  0,  0,  0
+};
+
+int teleinfo_label_id (uint32_t hash, const char * label, size_t length)
+{
+  int id = teleinfo_label_slots[TI_LABEL_HASH_SLOT(hash)] - 1;
+  // Only one candidate: unknown labels are rejected by a single compare
+  if (id < 0 || teleinfo_labels[id].length != length || memcmp (teleinfo_labels[id].name, label, length)) {
+    return TI_LABEL_UNKNOWN;
+  }
+  return id;
+}
+
+int teleinfo_label_find (const char * label, size_t length)
+{
+  uint32_t hash = TI_LABEL_HASH_SEED;
+  for (size_t n=0; n<length; n++) {
+    hash = teleinfo_label_hash_step (hash, label[n]);
+  }
+  return teleinfo_label_id (hash, label, length);
+}
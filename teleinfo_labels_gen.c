@@ -0,0 +1,90 @@
+/*
+ * teleinfuse is a FUSE module to access to the Télé information of linky electric meter running in standard mode
+ * Télé info data are transmitted by french electric meters (EDF/ERDF)
+ * [FR] Permet de lire la téléinformation cliente (TIC) d'un compteur linky en mode standard.
+ * [FR] Pour le mode TIC historique, voir le projet original
+ *
+ * Based on https://github.com/neomilium/teleinfuse project by Romuald Conty
+ *
+ * Copyright (C) 2020 itineric
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Perfect hash of the labels (make labels): the seed is the smallest one
+// for which no two labels of teleinfo_labels land in the same slot.
+// Checks TI_LABEL_HASH_SEED and the slot table of teleinfo_labels.c against
+// it, and prints the seed and table to paste there when they differ.
+
+#include "teleinfo.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// returns 0 if no two labels collide with seed, slots filled with id + 1
+static int teleinfo_labels_try (uint32_t seed, unsigned char slots[TI_LABEL_HASH_SLOTS])
+{
+  for (int n=0; n<TI_LABEL_HASH_SLOTS; n++) {
+    slots[n] = 0;
+  }
+  for (int id=0; id<TI_LABEL_COUNT; id++) {
+    uint32_t hash = seed;
+    for (size_t n=0; n<teleinfo_labels[id].length; n++) {
+      hash = teleinfo_label_hash_step (hash, teleinfo_labels[id].name[n]);
+    }
+    unsigned char * slot = &(slots[TI_LABEL_HASH_SLOT(hash)]);
+    if (*slot) {
+      return -1;
+    }
+    *slot = id + 1;
+  }
+  return 0;
+}
+
+int main (int argc, char * argv[])
+{
+  unsigned char slots[TI_LABEL_HASH_SLOTS];
+  uint32_t seed = 0;
+  int up_to_date = 1;
+
+  while (teleinfo_labels_try (seed, slots)) {
+    if (++seed == 0) {
+      fprintf(stderr, "no seed without collision\n");
+      return EXIT_FAILURE;
+    }
+  }
+  // The table in use is checked through the lookup
+  for (int id=0; id<TI_LABEL_COUNT; id++) {
+    if (teleinfo_label_find (teleinfo_labels[id].name, teleinfo_labels[id].length) != id) {
+      fprintf(stderr, "label %s is not found by the table of teleinfo_labels.c\n", teleinfo_labels[id].name);
+      up_to_date = 0;
+    }
+  }
+  if (seed != TI_LABEL_HASH_SEED) {
+    fprintf(stderr, "TI_LABEL_HASH_SEED is 0x%xu, the smallest seed is 0x%xu\n", TI_LABEL_HASH_SEED, seed);
+    up_to_date = 0;
+  }
+  if (up_to_date) {
+    printf("%d labels, seed 0x%xu: teleinfo_labels.c is up to date\n", TI_LABEL_COUNT, seed);
+    return EXIT_SUCCESS;
+  }
+
+  printf("// teleinfo.h\n#define TI_LABEL_HASH_SEED 0x%xu\n\n", seed);
+  printf("// teleinfo_labels.c\nstatic const unsigned char teleinfo_label_slots[TI_LABEL_HASH_SLOTS] = {\n");
+  for (int n=0; n<TI_LABEL_HASH_SLOTS; n++) {
+    printf("%s%2d%s", (n % 16) ? " " : "  ", slots[n], (n == TI_LABEL_HASH_SLOTS - 1) ? "\n" : (n % 16 == 15) ? ",\n" : ",");
+  }
+  printf("};\n");
+  return EXIT_FAILURE;
+}
@@ -25,282 +25,2208 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <stddef.h>
+#include <limits.h>
+#include <ctype.h>
 
 #include <pthread.h>
 
 #define FUSE_USE_VERSION 26
-#include <fuse.h>
+#include <fuse/fuse_lowlevel.h>
 #include <fuse/fuse_opt.h>
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
 
 #include <syslog.h>
 #include <unistd.h>
 #include <time.h>
 
 #include "teleinfo.h"
+#include "teleinfuse_history.h"
+#include "teleinfuse_derived.h"
+#include "teleinfuse_log.h"
+#include "teleinfuse_rules.h"
+#include "teleinfuse_stats.h"
+#include "teleinfuse_stream.h"
+#include "teleinfuse_socket.h"
 
 #include <time.h>
 
 typedef struct {
-  char filename[18];
-  char content[99];
   time_t time;
+  unsigned long generation;     // snapshot generation of the last change
+  int64_t number;
+  uint16_t content;             // offset of the content in the snapshot frame text
+  unsigned char content_length;
+  char used;                    // the slot holds a file (teleinfuse_filename)
+  char numeric;                 // content has been parsed into number
+  char stale;                   // loaded from the state file, not received yet
 } teleinfuse_file;
 
+// Longest file name: label and datetime suffix, NUL included
+#define TELEINFUSE_FILENAME_SIZE (TI_LABEL_LENGTH_MAX + sizeof(DATETIME_FILENAME_SUFFIX))
+
 typedef struct {
   uint interval;
   int with_datetime;
-  const char* port;
+  int salvage;         // keep the valid messages of damaged frames
+  const char * state;  // state file, NULL if none
+  uint state_frames;   // frames between two saves of the state file
+  const char * socket; // subscribers socket, NULL if none
 } teleinfuse_args;
 
-static pthread_mutex_t teleinfuse_files_mutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_t teleinfuse_thread;
 teleinfuse_args teleinfuse_thread_args;
 
-static teleinfuse_file teleinfuse_files[TI_MESSAGE_COUNT_MAX + 1]; // (+ 1 -> fake status file)
-static size_t teleinfuse_files_count = 0;
+// File table: a slot per known label (teleinfo_labels) for its value, another
+// one for its datetime, then the status file and a few slots for labels that
+// are not in the specification. A slot is used when its filename is set.
+#define TELEINFUSE_DATETIME_SLOT(ID) (TI_LABEL_COUNT + (ID))
+#define TELEINFUSE_STATUS_SLOT       (2 * TI_LABEL_COUNT)
+#define TELEINFUSE_UNKNOWN_SLOT      (TELEINFUSE_STATUS_SLOT + 1)
+#define TELEINFUSE_UNKNOWN_MAX       16
+#define TELEINFUSE_SLOT_COUNT        (TELEINFUSE_UNKNOWN_SLOT + TELEINFUSE_UNKNOWN_MAX)
+
+// Snapshot of the file table as of one frame. The updater thread fills a
+// snapshot nobody reads, then publishes it with a single pointer store.
+// Readers never wait: they pin the current snapshot with a reference count and
+// check it is still current (otherwise it may be rewritten and they retry).
+typedef struct {
+  teleinfuse_file files[TELEINFUSE_SLOT_COUNT];
+  char unknown_names[TELEINFUSE_UNKNOWN_MAX][TELEINFUSE_FILENAME_SIZE];
+  size_t unknown_count;
+  unsigned long generation;
+  time_t time;
+  // Whole dataset serialized once per frame (/frame file), "name=content"
+  // lines. File contents are slices of this text, which is only grown by the
+  // updater while nobody reads the snapshot.
+  size_t frame_length;
+  size_t frame_size;
+  char * frame;
+  int refs;
+} teleinfuse_snapshot;
+
+#define TELEINFUSE_CONTENT(S, F) ((S)->frame + (F)->content)
+
+#define TELEINFUSE_FRAME_FILENAME   "frame"
+#define TELEINFUSE_WAIT_FILENAME    "wait"
+#define TELEINFUSE_METRICS_FILENAME "metrics"
+
+// What a path designates
+typedef enum {
+  TELEINFUSE_NODE_NONE,
+  TELEINFUSE_NODE_ROOT,        // meter directories (several meters)
+  TELEINFUSE_NODE_METER,       // files of a meter (root with a single meter)
+  TELEINFUSE_NODE_FILE,        // index: file slot
+  TELEINFUSE_NODE_FRAME,
+  TELEINFUSE_NODE_WAIT,
+  TELEINFUSE_NODE_HISTORY_DIR,
+  TELEINFUSE_NODE_HISTORY,     // index: label id
+  TELEINFUSE_NODE_STATS_DIR,
+  TELEINFUSE_NODE_STATS,       // index: stats file
+  TELEINFUSE_NODE_METRICS,
+  TELEINFUSE_NODE_STREAM,
+  TELEINFUSE_NODE_DERIVED_DIR,
+  TELEINFUSE_NODE_DERIVED,     // index: derived file
+  TELEINFUSE_NODE_LOG_DIR,
+  TELEINFUSE_NODE_LOG,         // index: day (teleinfuse_log.h)
+} teleinfuse_node_kind;
+
+typedef struct {
+  teleinfuse_node_kind kind;
+  struct teleinfuse_meter * meter;
+  int index;
+} teleinfuse_node;
+
+// Inode numbers are computed from the node and stay the same from one frame
+// (and one mount) to another: FUSE_ROOT_ID for the root, kind, meter and index otherwise
+#define TELEINFUSE_INO(KIND, METER, INDEX) (((fuse_ino_t)(KIND) << 24) | ((fuse_ino_t)(METER) << 16) | (fuse_ino_t)(INDEX))
+#define TELEINFUSE_INO_KIND(INO)  ((int)((INO) >> 24))
+#define TELEINFUSE_INO_METER(INO) ((int)(((INO) >> 16) & 0xff))
+#define TELEINFUSE_INO_INDEX(INO) ((int)((INO) & 0xffff))
+
+// current + being written + some still read by other threads
+#define TELEINFUSE_SNAPSHOT_COUNT 4
+
+enum status { ONLINE, OFFLINE, DISCONNECTED, ERROR };
+
+// Every meter has its own port, decoder and snapshots. All the ports are read
+// by a single thread (epoll) and served by the same FUSE session.
+#define TELEINFUSE_METER_MAX 16
+
+// Delay before reopening a port, doubled after each failure
+#define TELEINFUSE_RETRY_MIN_MS 1000
+#define TELEINFUSE_RETRY_MAX_MS 64000
+
+typedef struct teleinfuse_meter {
+  char name[32];        // subdirectory of the meter
+  const char * port;
+  int fd;               // 0 while the port is closed
+  teleinfo_reader reader;
+  teleinfo_decoder decoder;
+  enum status status;   // last published status
+  int published;
+  int64_t last_publish; // ms, see teleinfuse_monotonic
+  int64_t last_data;    // ms
+  int timer_fd;         // no data timeout while the port is open, reopen delay otherwise
+  // Serial port woken up every TI_READ_MIN_BYTES: flush_fd reads the end of
+  // an incomplete frame after TI_READ_FLUSH_MS
+  int batched;
+  int flush_fd;
+  int flush_armed;
+  // Measures of the frame being decoded (see teleinfuse_stats.h)
+  uint64_t decode_ns;
+  unsigned long frame_bytes;    // reader bytes and syscalls when the frame began
+  unsigned long frame_syscalls;
+  uint64_t last_frame;          // ns
+  int64_t retry_delay;  // ms
+  // Frame received before 'interval' has elapsed, published by publish_fd
+  int publish_fd;
+  int pending;
+  enum status pending_status;
+  teleinfo_frame pending_frame;
+  teleinfuse_snapshot snapshots[TELEINFUSE_SNAPSHOT_COUNT];
+  teleinfuse_snapshot * current;
+} teleinfuse_meter;
+
+static teleinfuse_meter * teleinfuse_meters = NULL;
+static size_t teleinfuse_meter_count = 0;
+// A single meter given without name is served at the root of the mount point
+static int teleinfuse_flat = 0;
+
+#define TELEINFUSE_METER_INDEX(M) ((int)((M) - teleinfuse_meters))
+
+static fuse_ino_t teleinfuse_ino(const teleinfuse_node * node)
+{
+  if (node->kind == TELEINFUSE_NODE_ROOT || (node->kind == TELEINFUSE_NODE_METER && teleinfuse_flat)) {
+    return FUSE_ROOT_ID;
+  }
+  return TELEINFUSE_INO(node->kind, node->meter ? TELEINFUSE_METER_INDEX(node->meter) : 0, node->index);
+}
+
+static uint64_t teleinfuse_monotonic_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static teleinfuse_snapshot* teleinfuse_snapshot_acquire(teleinfuse_meter * meter)
+{
+  for (;;) {
+    teleinfuse_snapshot * snapshot = __atomic_load_n(&(meter->current), __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&(snapshot->refs), 1, __ATOMIC_SEQ_CST);
+    if (snapshot == __atomic_load_n(&(meter->current), __ATOMIC_SEQ_CST)) {
+      return snapshot;
+    }
+    // A new frame has been published meanwhile
+    __atomic_sub_fetch(&(snapshot->refs), 1, __ATOMIC_SEQ_CST);
+    teleinfuse_stats_count(TELEINFUSE_STAT_SNAPSHOT_RETRIES);
+  }
+}
+
+static void teleinfuse_snapshot_release(teleinfuse_snapshot * snapshot)
+{
+  __atomic_sub_fetch(&(snapshot->refs), 1, __ATOMIC_SEQ_CST);
+}
+
+// Updater side: returns a snapshot which is neither current nor pinned, NULL if all are busy
+static teleinfuse_snapshot* teleinfuse_snapshot_free(teleinfuse_meter * meter)
+{
+  teleinfuse_snapshot * current = __atomic_load_n(&(meter->current), __ATOMIC_SEQ_CST);
+  for (size_t n=0; n<TELEINFUSE_SNAPSHOT_COUNT; n++) {
+    teleinfuse_snapshot * snapshot = &(meter->snapshots[n]);
+    if (snapshot != current && !__atomic_load_n(&(snapshot->refs), __ATOMIC_SEQ_CST)) {
+      return snapshot;
+    }
+  }
+  return NULL;
+}
+
+// "LABEL.datetime" for every known label, set by teleinfuse_meters_init
+static char teleinfuse_datetime_names[TI_LABEL_COUNT][TELEINFUSE_FILENAME_SIZE];
+
+// Known files are named after their slot, only the names of the labels out
+// of the specification are kept in the snapshot
+static const char * teleinfuse_filename(const teleinfuse_snapshot * snapshot, int slot)
+{
+  if (slot < TI_LABEL_COUNT) {
+    return teleinfo_labels[slot].name;
+  }
+  if (slot < TELEINFUSE_STATUS_SLOT) {
+    return teleinfuse_datetime_names[slot - TI_LABEL_COUNT];
+  }
+  if (slot == TELEINFUSE_STATUS_SLOT) {
+    return "status";
+  }
+  return snapshot->unknown_names[slot - TELEINFUSE_UNKNOWN_SLOT];
+}
+
+// Fallback for labels out of the specification (linear search)
+static int teleinfuse_unknown_slot(const teleinfuse_snapshot * snapshot, const char* name)
+{
+  for (size_t n=0; n<snapshot->unknown_count; n++) {
+    if (0==strcmp(name, snapshot->unknown_names[n])) {
+      return TELEINFUSE_UNKNOWN_SLOT + n;
+    }
+  }
+  return -1;
+}
+
+// returns the slot of a file name (used or not), -1 if there is none
+static int teleinfuse_slot(const teleinfuse_snapshot * snapshot, const char* name)
+{
+  size_t length = strlen(name);
+  const size_t suffix_length = sizeof(DATETIME_FILENAME_SUFFIX) - 1;
+  int datetime = 0;
+
+  if (length > suffix_length && 0==memcmp(name + length - suffix_length, DATETIME_FILENAME_SUFFIX, suffix_length)) {
+    datetime = 1;
+    length -= suffix_length;
+  }
+  int id = teleinfo_label_find(name, length);
+  if (id != TI_LABEL_UNKNOWN) {
+    return datetime ? TELEINFUSE_DATETIME_SLOT(id) : id;
+  }
+  if (0==strcmp(name, "status")) {
+    return TELEINFUSE_STATUS_SLOT;
+  }
+  return teleinfuse_unknown_slot(snapshot, name);
+}
+
+const teleinfuse_file* teleinfuse_find_file(const teleinfuse_snapshot * snapshot, const char* name)
+{
+  int slot = teleinfuse_slot(snapshot, name);
+  if (slot < 0 || !snapshot->files[slot].used) {
+    return NULL;
+  }
+  return &(snapshot->files[slot]);
+}
+
+// Contents of the snapshot being built (frame, previous snapshot, state file),
+// laid out in its frame text by teleinfuse_serialize. Only used by the reader
+// thread, or before it starts.
+typedef struct {
+  const char * text;
+  size_t length;
+} teleinfuse_content;
+static teleinfuse_content teleinfuse_contents[TELEINFUSE_SLOT_COUNT];
+
+static void teleinfuse_contents_load(const teleinfuse_snapshot * snapshot)
+{
+  for (size_t n=0; n<TELEINFUSE_SLOT_COUNT; n++) {
+    const teleinfuse_file * file = &(snapshot->files[n]);
+    teleinfuse_contents[n].text = file->used ? TELEINFUSE_CONTENT(snapshot, file) : NULL;
+    teleinfuse_contents[n].length = file->used ? file->content_length : 0;
+  }
+}
+
+// numeric values are compared as integers, other ones as strings
+// content is referred to until teleinfuse_serialize
+void teleinfuse_update_file (teleinfuse_snapshot * snapshot, int slot, const char* name, const char* content, size_t length,
+                             int numeric, int64_t number, time_t now)
+{
+  teleinfuse_file * file;
+
+  if (slot < 0) {
+    // New label out of the specification
+    if (snapshot->unknown_count == TELEINFUSE_UNKNOWN_MAX) {
+      return;
+    }
+    slot = TELEINFUSE_UNKNOWN_SLOT + snapshot->unknown_count;
+    strcpy(snapshot->unknown_names[snapshot->unknown_count++], name);
+    syslog(LOG_INFO, "unknown label \"%s\"", name);
+  }
+  file = &(snapshot->files[slot]);
+  teleinfuse_content * previous = &(teleinfuse_contents[slot]);
+  if (file->used) {
+    int changed = (numeric && file->numeric) ? (number != file->number)
+      : (length != previous->length || memcmp(content, previous->text, length));
+    if (changed) {
+      previous->text = content;
+      previous->length = length;
+      file->time = now;
+      file->generation = snapshot->generation;
+      file->numeric = numeric;
+      file->number = number;
+    } // else do nothing: time of a loaded value is kept
+    file->stale = 0;
+  } else {
+    // New file
+    file->used = 1;
+    previous->text = content;
+    previous->length = length;
+    file->time = now;
+    file->generation = snapshot->generation;
+    file->numeric = numeric;
+    file->number = number;
+    file->stale = 0;
+  }
+}
+
+// Content is copied at open time: every read of an opened file comes from the
+// same frame and no snapshot stays pinned by an idle file handle.
+// A read at offset 0 takes the current content again (sysfs like) so that a
+// poll()ed file can be read again after a seek.
+typedef struct teleinfuse_handle {
+  teleinfuse_node node;
+  unsigned long generation; // generation of the copied content
+  uint64_t cursor;          // /stream: bytes of the stream already read
+  teleinfuse_log_cursor * log; // log/DAY: lines are decoded as they are read into content
+  size_t length;            // log/DAY: size of content
+  char * content;
+  struct fuse_pollhandle * ph;     // pending poll notification
+  struct teleinfuse_handle * next; // in teleinfuse_polled
+} teleinfuse_handle;
+
+// Change notification: /wait readers sleep on the condition, poll()ed handles
+// are listed and notified by the updater when their content changes.
+static pthread_mutex_t teleinfuse_notify_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t teleinfuse_notify_cond = PTHREAD_COND_INITIALIZER;
+static teleinfuse_handle * teleinfuse_polled = NULL;
+static int teleinfuse_stopping = 0;
+
+static unsigned long teleinfuse_metrics_generation(void);
+
+// generation of the content a handle would get from snapshot
+static unsigned long teleinfuse_handle_generation(const teleinfuse_handle * handle, const teleinfuse_snapshot * snapshot)
+{
+  switch (handle->node.kind) {
+    case TELEINFUSE_NODE_FILE:
+      return snapshot->files[handle->node.index].generation;
+    case TELEINFUSE_NODE_HISTORY:
+      return teleinfuse_history_generation(TELEINFUSE_METER_INDEX(handle->node.meter), handle->node.index);
+    case TELEINFUSE_NODE_DERIVED:
+      return teleinfuse_derived_generation(TELEINFUSE_METER_INDEX(handle->node.meter));
+    case TELEINFUSE_NODE_LOG:
+      return teleinfuse_log_generation(TELEINFUSE_METER_INDEX(handle->node.meter));
+    case TELEINFUSE_NODE_STATS:
+      return 0; // rendered again at each read
+    case TELEINFUSE_NODE_METRICS:
+      return teleinfuse_metrics_generation();
+    case TELEINFUSE_NODE_STREAM:
+      return teleinfuse_stream_head(TELEINFUSE_METER_INDEX(handle->node.meter));
+    default:
+      return snapshot->generation;
+  }
+}
+
+static void teleinfuse_notify (const teleinfuse_meter * meter, const teleinfuse_snapshot * snapshot)
+{
+  pthread_mutex_lock( &teleinfuse_notify_mutex );
+  pthread_cond_broadcast( &teleinfuse_notify_cond );
+  teleinfuse_handle ** p = &teleinfuse_polled;
+  while (*p) {
+    teleinfuse_handle * handle = *p;
+    if ((handle->node.meter == meter || handle->node.kind == TELEINFUSE_NODE_METRICS)
+        && teleinfuse_handle_generation(handle, snapshot) != handle->generation) {
+      fuse_lowlevel_notify_poll(handle->ph);
+      fuse_pollhandle_destroy(handle->ph);
+      handle->ph = NULL;
+      *p = handle->next;
+    } else {
+      p = &(handle->next);
+    }
+  }
+  pthread_mutex_unlock( &teleinfuse_notify_mutex );
+}
+
+// Lays teleinfuse_contents out in the frame text of snapshot
+// returns 0 if succeed otherwise -1 (no memory)
+static int teleinfuse_serialize (teleinfuse_snapshot * snapshot)
+{
+  size_t size = 0;
+  for (size_t n=0; n<TELEINFUSE_SLOT_COUNT; n++) {
+    if (snapshot->files[n].used) {
+      size += strlen(teleinfuse_filename(snapshot, n)) + teleinfuse_contents[n].length + 2;
+    }
+  }
+  if (size > snapshot->frame_size) {
+    char * frame = realloc(snapshot->frame, size);
+    if (!frame) {
+      return -1;
+    }
+    snapshot->frame = frame;
+    snapshot->frame_size = size;
+  }
+
+  char * p = snapshot->frame;
+  for (size_t n=0; n<TELEINFUSE_SLOT_COUNT; n++) {
+    teleinfuse_file * file = &(snapshot->files[n]);
+    if (file->used) {
+      const char * filename = teleinfuse_filename(snapshot, n);
+      size_t length = strlen(filename);
+      memcpy(p, filename, length);
+      p += length;
+      *p++ = '=';
+      file->content = p - snapshot->frame;
+      file->content_length = teleinfuse_contents[n].length;
+      memcpy(p, teleinfuse_contents[n].text, teleinfuse_contents[n].length);
+      p += teleinfuse_contents[n].length;
+      *p++ = '\n';
+    }
+  }
+  snapshot->frame_length = p - snapshot->frame;
+  return 0;
+}
+
+// Session channel once mounted, NULL before: the kernel caches nothing yet
+static struct fuse_chan * teleinfuse_chan = NULL;
+
+// Drops what the kernel caches about the files changed from previous to
+// snapshot: attributes and pages of a new value, directory entry of a removed file.
+// Files that did not exist in previous have never been looked up.
+static void teleinfuse_invalidate (teleinfuse_meter * meter, const teleinfuse_snapshot * previous, const teleinfuse_snapshot * snapshot)
+{
+  teleinfuse_node dir = { TELEINFUSE_NODE_METER, meter, 0 };
+  teleinfuse_node node = { TELEINFUSE_NODE_FRAME, meter, 0 };
+  unsigned long count = 1;
+
+  if (!teleinfuse_chan) {
+    return;
+  }
+  fuse_lowlevel_notify_inval_inode(teleinfuse_chan, teleinfuse_ino(&node), 0, 0);
+  node.kind = TELEINFUSE_NODE_FILE;
+  for (int n=0; n<TELEINFUSE_SLOT_COUNT; n++) {
+    if (!previous->files[n].used) {
+      continue;
+    }
+    if (!snapshot->files[n].used) {
+      const char * filename = teleinfuse_filename(previous, n);
+      fuse_lowlevel_notify_inval_entry(teleinfuse_chan, teleinfuse_ino(&dir), filename, strlen(filename));
+      count++;
+    } else if (snapshot->files[n].generation == snapshot->generation) {
+      node.index = n;
+      fuse_lowlevel_notify_inval_inode(teleinfuse_chan, teleinfuse_ino(&node), 0, 0);
+      count++;
+    }
+  }
+  teleinfuse_stats_add(TELEINFUSE_STAT_INVALIDATIONS, count);
+}
+
+// Starts a new snapshot of the meter as a copy of the current one
+// returns NULL if every other snapshot is still read
+static teleinfuse_snapshot* teleinfuse_snapshot_begin(teleinfuse_meter * meter)
+{
+  teleinfuse_snapshot * current = meter->current; // only this thread writes it
+  teleinfuse_snapshot * snapshot = teleinfuse_snapshot_free(meter);
+
+  if (!snapshot) {
+    // Values will be published with the next frame
+    syslog(LOG_INFO, "%s: no free snapshot, frame not published", meter->name);
+    teleinfuse_stats_count(TELEINFUSE_STAT_PUBLISH_SKIPPED);
+    return NULL;
+  }
+  memcpy(snapshot->files, current->files, sizeof(snapshot->files));
+  memcpy(snapshot->unknown_names, current->unknown_names, current->unknown_count * sizeof(current->unknown_names[0]));
+  snapshot->unknown_count = current->unknown_count;
+  snapshot->generation = current->generation + 1;
+  teleinfuse_contents_load(current);
+  return snapshot;
+}
+
+// Lays the new contents out, makes snapshot current and tells the kernel and
+// the waiters what changed
+static void teleinfuse_snapshot_publish(teleinfuse_meter * meter, teleinfuse_snapshot * snapshot, uint64_t start)
+{
+  teleinfuse_snapshot * current = meter->current;
+
+  if (teleinfuse_serialize(snapshot)) {
+    syslog(LOG_ERR, "%s: unable to allocate frame text, frame not published", meter->name);
+    teleinfuse_stats_count(TELEINFUSE_STAT_PUBLISH_SKIPPED);
+    return;
+  }
+  __atomic_store_n(&(meter->current), snapshot, __ATOMIC_SEQ_CST);
+  teleinfuse_invalidate(meter, current, snapshot);
+  teleinfuse_notify(meter, snapshot);
+  teleinfuse_stats_count(TELEINFUSE_STAT_PUBLISHED);
+  teleinfuse_stats_record(TELEINFUSE_HISTOGRAM_PUBLISH_NS, teleinfuse_monotonic_ns() - start);
+}
+
+// Builds a new snapshot of the meter from the current one and the frame, then publishes it
+void teleinfuse_update (teleinfuse_meter * meter, const teleinfo_frame * frame, const char* status)
+{
+  static char datetimes[TI_MESSAGE_COUNT_MAX][TI_DATETIME_LENGTH + 1]; // contents until teleinfuse_serialize
+  char datetime_name[TELEINFUSE_FILENAME_SIZE];
+  size_t datasetlen = frame ? frame->datasetlen : 0;
+  time_t now = time(NULL);
+  uint64_t start = teleinfuse_monotonic_ns();
+  teleinfuse_snapshot * snapshot = teleinfuse_snapshot_begin(meter);
+
+  if (!snapshot) {
+    return;
+  }
+  // Fake teleinfo file to show status
+  teleinfuse_update_file(snapshot, TELEINFUSE_STATUS_SLOT, "status", status, strlen(status), 0, 0, now);
+  for (int n=0; n<datasetlen; n++) {
+    const teleinfo_data * data = &(frame->dataset[n]);
+    const char * label = TI_LABEL(frame, data);
+    int id = data->id;
+    int slot = (id != TI_LABEL_UNKNOWN) ? id : teleinfuse_unknown_slot(snapshot, label);
+    teleinfuse_update_file(snapshot, slot, label, TI_VALUE(frame, data), data->value_length, data->numeric, data->number, now);
+    if (data->numeric) {
+      teleinfuse_history_add(TELEINFUSE_METER_INDEX(meter), id, data->number, now);
+    }
+
+    if (teleinfuse_thread_args.with_datetime && data->datetime) {
+      strcpy(datetime_name, label);
+      strcat(datetime_name, DATETIME_FILENAME_SUFFIX);
+      slot = (id != TI_LABEL_UNKNOWN) ? TELEINFUSE_DATETIME_SLOT(id) : teleinfuse_unknown_slot(snapshot, datetime_name);
+      teleinfo_datetime_format(data->datetime, datetimes[n]);
+      teleinfuse_update_file(snapshot, slot, datetime_name, datetimes[n], TI_DATETIME_LENGTH, 0, 0, now);
+    }
+  }
+  if (datasetlen) {
+    teleinfuse_derived_update(TELEINFUSE_METER_INDEX(meter), frame, start / 1000000);
+    // Loaded values the meter does not send anymore
+    for (size_t n=0; n<TELEINFUSE_SLOT_COUNT; n++) {
+      if (snapshot->files[n].stale) {
+        snapshot->files[n].used = 0;
+        snapshot->files[n].stale = 0;
+      }
+    }
+  }
+  snapshot->time = now;
+  teleinfuse_snapshot_publish(meter, snapshot, start);
+}
+
+// Publishes the value of a single message, the rest of the snapshot unchanged
+static void teleinfuse_update_line (teleinfuse_meter * meter, const teleinfo_frame * frame, const teleinfo_data * data)
+{
+  time_t now = time(NULL);
+  uint64_t start = teleinfuse_monotonic_ns();
+  teleinfuse_snapshot * snapshot = teleinfuse_snapshot_begin(meter);
+
+  if (!snapshot) {
+    return;
+  }
+  teleinfuse_update_file(snapshot, data->id, TI_LABEL(frame, data), TI_VALUE(frame, data), data->value_length,
+                         data->numeric, data->number, now);
+  snapshot->time = now;
+  teleinfuse_snapshot_publish(meter, snapshot, start);
+}
+
+// State file: the last values of every meter, "meter\tfile\ttime\tcontent" lines.
+// Loaded at start so that files exist (with their original time) before the
+// first frame, saved every state_frames frames and at exit.
+#define TELEINFUSE_STATE_HEADER "teleinfuse-state 1\n"
+#define TELEINFUSE_STATE_STATUS "stale"
+
+// Only called by the reader thread (or once it has stopped): current snapshots are not changed meanwhile
+// returns the text of the state file, to free, or NULL
+static char * teleinfuse_state_render(size_t * length)
+{
+  const size_t line_max = sizeof(((teleinfuse_meter*)NULL)->name) + TELEINFUSE_FILENAME_SIZE + TI_VALUE_LENGTH_MAX + 24;
+  char * text = malloc(sizeof(TELEINFUSE_STATE_HEADER) + teleinfuse_meter_count * TELEINFUSE_SLOT_COUNT * line_max);
+
+  if (!text) {
+    return NULL;
+  }
+  char * p = text + sprintf(text, TELEINFUSE_STATE_HEADER);
+  for (size_t m=0; m<teleinfuse_meter_count; m++) {
+    const teleinfuse_snapshot * snapshot = teleinfuse_meters[m].current;
+    for (size_t n=0; n<TELEINFUSE_SLOT_COUNT; n++) {
+      const teleinfuse_file * file = &(snapshot->files[n]);
+      if (n != TELEINFUSE_STATUS_SLOT && file->used) {
+        p += sprintf(p, "%s\t%s\t%lld\t%.*s\n", teleinfuse_meters[m].name, teleinfuse_filename(snapshot, n),
+                     (long long)file->time, (int)file->content_length, TELEINFUSE_CONTENT(snapshot, file));
+      }
+    }
+  }
+  *length = p - text;
+  return text;
+}
+
+// Written aside, synced then renamed: after a power cut the state file is
+// either the previous one or the new one, always complete
+static int teleinfuse_state_write(const char * path, const char * text, size_t length)
+{
+  char tmp_path[PATH_MAX];
+  int res = -1;
+
+  if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) >= sizeof(tmp_path)) {
+    syslog(LOG_ERR, "unable to save state to %s: path too long", path);
+    return -1;
+  }
+  int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd != -1) {
+    if (write(fd, text, length) == length && fsync(fd) == 0) {
+      res = 0;
+    }
+    close(fd);
+    if (!res && rename(tmp_path, path) == -1) {
+      res = -1;
+    }
+  }
+  if (res) {
+    syslog(LOG_ERR, "unable to save state to %s: %s", path, strerror(errno));
+    unlink(tmp_path);
+  }
+  return res;
+}
+
+// Periodic saves are written by the saver thread: fsync would stop the reader
+// thread for as long as an SD card takes. A state not written yet is
+// replaced by the next one.
+static pthread_t teleinfuse_saver;
+static int teleinfuse_saver_running = 0;
+static pthread_mutex_t teleinfuse_saver_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t teleinfuse_saver_cond = PTHREAD_COND_INITIALIZER;
+static char * teleinfuse_saver_text = NULL;
+static size_t teleinfuse_saver_length = 0;
+static int teleinfuse_saver_stopping = 0;
+
+static void* teleinfuse_saver_process(void * userdata)
+{
+  pthread_mutex_lock( &teleinfuse_saver_mutex );
+  while (!teleinfuse_saver_stopping) {
+    if (!teleinfuse_saver_text) {
+      pthread_cond_wait( &teleinfuse_saver_cond, &teleinfuse_saver_mutex );
+      continue;
+    }
+    char * text = teleinfuse_saver_text;
+    size_t length = teleinfuse_saver_length;
+    teleinfuse_saver_text = NULL;
+    pthread_mutex_unlock( &teleinfuse_saver_mutex );
+    teleinfuse_state_write(teleinfuse_thread_args.state, text, length);
+    free(text);
+    pthread_mutex_lock( &teleinfuse_saver_mutex );
+  }
+  pthread_mutex_unlock( &teleinfuse_saver_mutex );
+  return NULL;
+}
+
+// Reader thread: the state is handed to the saver thread
+static void teleinfuse_state_save(void)
+{
+  size_t length;
+  char * text = teleinfuse_state_render(&length);
+
+  if (!text) {
+    syslog(LOG_ERR, "unable to save state: %s", strerror(ENOMEM));
+    return;
+  }
+  if (!teleinfuse_saver_running) {
+    teleinfuse_state_write(teleinfuse_thread_args.state, text, length);
+    free(text);
+    return;
+  }
+  pthread_mutex_lock( &teleinfuse_saver_mutex );
+  free(teleinfuse_saver_text);
+  teleinfuse_saver_text = text;
+  teleinfuse_saver_length = length;
+  pthread_cond_signal( &teleinfuse_saver_cond );
+  pthread_mutex_unlock( &teleinfuse_saver_mutex );
+}
+
+// Once the reader thread has stopped: the last state is written here, the
+// one still waiting for the saver thread is dropped
+static void teleinfuse_state_save_last(void)
+{
+  size_t length;
+  char * text;
+
+  if (teleinfuse_saver_running) {
+    pthread_mutex_lock( &teleinfuse_saver_mutex );
+    teleinfuse_saver_stopping = 1;
+    pthread_cond_signal( &teleinfuse_saver_cond );
+    pthread_mutex_unlock( &teleinfuse_saver_mutex );
+    pthread_join (teleinfuse_saver, NULL);
+    teleinfuse_saver_running = 0;
+    free(teleinfuse_saver_text);
+    teleinfuse_saver_text = NULL;
+  }
+  if ((text = teleinfuse_state_render(&length))) {
+    teleinfuse_state_write(teleinfuse_thread_args.state, text, length);
+    free(text);
+  } else {
+    syslog(LOG_ERR, "unable to save state: %s", strerror(ENOMEM));
+  }
+}
+
+// Called before the reader thread starts: fills the first snapshot of each meter
+static void teleinfuse_state_load(const char * path)
+{
+  FILE * file = fopen(path, "r");
+  size_t count = 0;
+  long size;
+  char * text = NULL;
+
+  if (!file) {
+    syslog(LOG_INFO, "no state loaded from %s: %s", path, strerror(errno));
+    return;
+  }
+  // Read at once: loaded contents are slices of the text until each snapshot is serialized
+  if (fseek(file, 0, SEEK_END) || (size = ftell(file)) < 0 || fseek(file, 0, SEEK_SET)
+      || !(text = malloc(size + 1)) || fread(text, 1, size, file) != size) {
+    syslog(LOG_ERR, "unable to read state from %s", path);
+    free(text);
+    fclose(file);
+    return;
+  }
+  fclose(file);
+  text[size] = '\0';
+  if (strncmp(text, TELEINFUSE_STATE_HEADER, sizeof(TELEINFUSE_STATE_HEADER) - 1)) {
+    syslog(LOG_ERR, "%s is not a state file", path);
+    free(text);
+    return;
+  }
+
+  for (size_t m=0; m<teleinfuse_meter_count; m++) {
+    teleinfuse_meter * meter = &(teleinfuse_meters[m]);
+    teleinfuse_snapshot * snapshot = meter->current;
+    size_t name_length = strlen(meter->name);
+
+    teleinfuse_contents_load(snapshot);
+    for (char * line = text + sizeof(TELEINFUSE_STATE_HEADER) - 1; *line; ) {
+      size_t length = strcspn(line, "\n");
+      char * fields[4];
+      size_t n;
+
+      // "meter\tfile\ttime\tcontent": fields are not NUL terminated, but the last one by the line end
+      fields[0] = line;
+      for (n=1; n<4 && (fields[n] = memchr(fields[n-1], '\t', line + length - fields[n-1])); n++) {
+        fields[n]++;
+      }
+      line += length + (line[length] == '\n');
+      if (n < 4 || fields[1] - fields[0] != name_length + 1 || memcmp(fields[0], meter->name, name_length)) {
+        continue;
+      }
+      char filename[TELEINFUSE_FILENAME_SIZE];
+      size_t filename_length = fields[2] - fields[1] - 1;
+      size_t content_length = line - fields[3] - (line[-1] == '\n');
+      if (filename_length >= sizeof(filename) || content_length > TI_VALUE_LENGTH_MAX) {
+        continue;
+      }
+      memcpy(filename, fields[1], filename_length);
+      filename[filename_length] = '\0';
+      int slot = teleinfuse_slot(snapshot, filename);
+      if (slot == TELEINFUSE_STATUS_SLOT) {
+        continue;
+      }
+      teleinfuse_update_file(snapshot, slot, filename, fields[3], content_length, 0, 0, (time_t)strtoll(fields[2], NULL, 10));
+      slot = teleinfuse_slot(snapshot, filename);
+      if (slot >= 0) {
+        snapshot->files[slot].stale = 1;
+        if (snapshot->files[slot].time > snapshot->time) {
+          snapshot->time = snapshot->files[slot].time;
+        }
+        count++;
+      }
+    }
+    teleinfuse_update_file(snapshot, TELEINFUSE_STATUS_SLOT, "status", TELEINFUSE_STATE_STATUS,
+                           strlen(TELEINFUSE_STATE_STATUS), 0, 0, time(NULL));
+    if (teleinfuse_serialize(snapshot)) {
+      syslog(LOG_ERR, "%s: unable to allocate frame text, state not loaded", meter->name);
+      memset(snapshot->files, 0, sizeof(snapshot->files));
+      snapshot->unknown_count = 0;
+    }
+  }
+  free(text);
+  syslog(LOG_INFO, "%zu values loaded from %s", count, path);
+}
+
+const char * status_str(enum status s)
+{
+  switch (s) {
+    case ONLINE:
+      return "online";
+      break;
+    case OFFLINE:
+      return "offline";
+      break;
+    case DISCONNECTED:
+      return "disconnected";
+      break;
+    case ERROR:
+      return "error";
+      break;
+  }
+  return "";
+}
+
+// ms
+static int64_t teleinfuse_monotonic(void)
+{
+  return teleinfuse_monotonic_ns() / 1000000;
+}
+
+// Worker wake up sources: (meter index << 2) | TELEINFUSE_SOURCE_*
+enum { TELEINFUSE_SOURCE_PORT, TELEINFUSE_SOURCE_TIMER, TELEINFUSE_SOURCE_PUBLISH, TELEINFUSE_SOURCE_FLUSH };
+#define TELEINFUSE_SOURCE(M, S) (((uint64_t)TELEINFUSE_METER_INDEX(M) << 2) | (S))
+#define TELEINFUSE_SOURCE_STOP UINT64_MAX
+// Listening socket, then its subscribers (teleinfuse_socket_event)
+#define TELEINFUSE_SOURCE_SOCKET (1ULL << 32)
+#define TELEINFUSE_SOURCE_RULES (2ULL << 32)
+
+// Written by teleinfuse_destroy to stop the worker
+static int teleinfuse_stop_fd = -1;
+
+static void teleinfuse_timer_arm(int timer_fd, int64_t delay)
+{
+  struct itimerspec spec = { .it_value = { delay / 1000, (delay % 1000) * 1000000 } };
+  if (delay <= 0) {
+    // 0 would disarm the timer
+    spec.it_value.tv_sec = 0;
+    spec.it_value.tv_nsec = 1;
+  }
+  timerfd_settime(timer_fd, 0, &spec, NULL);
+}
+
+static void teleinfuse_timer_disarm(int timer_fd)
+{
+  struct itimerspec spec = { { 0, 0 }, { 0, 0 } };
+  timerfd_settime(timer_fd, 0, &spec, NULL);
+}
+
+static void teleinfuse_timer_clear(int timer_fd)
+{
+  uint64_t expirations;
+  if (read(timer_fd, &expirations, sizeof(expirations)) < 0) {
+    // spurious wake up, nothing to clear
+  }
+}
+
+// Frames published since the state file has been saved
+static uint teleinfuse_state_frames = 0;
+
+static void teleinfuse_publish_now(teleinfuse_meter * meter, enum status status, const teleinfo_frame * frame)
+{
+  if (status != meter->status) {
+    syslog(LOG_INFO, "%s: status changed: was \"%s\", now \"%s\"", meter->name, status_str(meter->status), status_str(status));
+    meter->status = status;
+  }
+  teleinfuse_update (meter, frame, status_str(status));
+  meter->published = 1;
+  meter->last_publish = teleinfuse_monotonic();
+  meter->pending = 0;
+  if (teleinfuse_thread_args.state && frame && frame->datasetlen && ++teleinfuse_state_frames >= teleinfuse_thread_args.state_frames) {
+    teleinfuse_state_save();
+    teleinfuse_state_frames = 0;
+  }
+}
+
+// 'interval' throttles the publication of new values: a frame received too
+// early is kept and published when the interval ends (a status change is
+// always published at once)
+// frame: NULL for a status change only
+static void teleinfuse_publish(teleinfuse_meter * meter, enum status status, const teleinfo_frame * frame)
+{
+  int64_t left = meter->last_publish + (int64_t)teleinfuse_thread_args.interval * 1000 - teleinfuse_monotonic();
+
+  if (!meter->published || status != meter->status || left <= 0) {
+    if (meter->pending && status != meter->status) {
+      // Last values received before the change are not lost
+      teleinfuse_publish_now(meter, meter->pending_status, &(meter->pending_frame));
+    }
+    teleinfuse_publish_now(meter, status, frame);
+    return;
+  }
+  if (!meter->pending) {
+    teleinfuse_timer_arm(meter->publish_fd, left);
+    meter->pending = 1;
+  }
+  // The decoder reuses its dataset for the next frame
+  meter->pending_status = status;
+  if (frame) {
+    teleinfo_frame_copy(&(meter->pending_frame), frame);
+  } else {
+    meter->pending_frame.datasetlen = 0;
+    meter->pending_frame.text_length = 0;
+  }
+}
+
+// Instantaneous powers (SINSTS, SINSTS1...) are published as soon as their
+// message is received, before the end of the frame, unless 'interval' holds
+// the values back. The frame then confirms them with the other values.
+static char teleinfuse_line_labels[TI_LABEL_COUNT];
+
+static void teleinfuse_meter_line(const teleinfo_frame * frame, const teleinfo_data * data, void * userdata)
+{
+  teleinfuse_meter * meter = userdata;
+
+  if (data->id == TI_LABEL_UNKNOWN || !teleinfuse_line_labels[data->id]
+      || !meter->published || meter->status != ONLINE || meter->pending
+      || meter->last_publish + (int64_t)teleinfuse_thread_args.interval * 1000 > teleinfuse_monotonic()) {
+    return;
+  }
+  teleinfuse_update_line(meter, frame, data);
+}
+
+static void teleinfuse_meter_open(teleinfuse_meter * meter, int epoll_fd)
+{
+  int fd = teleinfo_open(meter->port);
+
+  if (fd) {
+    struct epoll_event event = { .events = EPOLLIN, .data.u64 = TELEINFUSE_SOURCE(meter, TELEINFUSE_SOURCE_PORT) };
+    if ((meter->batched = teleinfo_set_nonblocking(fd)) == -1
+        || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+      syslog(LOG_ERR, "%s: unable to watch port: %s", meter->name, strerror(errno));
+      teleinfo_close(fd);
+      fd = 0;
+    }
+  }
+  meter->fd = fd;
+  teleinfuse_stats_count(fd ? TELEINFUSE_STAT_OPENS : TELEINFUSE_STAT_OPEN_ERRORS);
+  if (fd) {
+    teleinfo_reader_init(&(meter->reader), fd);
+    teleinfo_decoder_init(&(meter->decoder), teleinfuse_meter_line, meter);
+    meter->decoder.counters = teleinfuse_stats_decoder();
+    meter->decoder.salvage = teleinfuse_thread_args.salvage;
+    meter->decode_ns = 0;
+    meter->frame_bytes = 0;
+    meter->frame_syscalls = 0;
+    meter->last_data = teleinfuse_monotonic();
+    teleinfuse_timer_arm(meter->timer_fd, TI_READ_TIMEOUT_MS);
+  } else {
+    teleinfuse_timer_arm(meter->timer_fd, meter->retry_delay);
+    meter->retry_delay = (meter->retry_delay * 2 > TELEINFUSE_RETRY_MAX_MS) ? TELEINFUSE_RETRY_MAX_MS : meter->retry_delay * 2;
+    teleinfuse_publish(meter, DISCONNECTED, NULL);
+  }
+}
+
+static void teleinfuse_meter_close(teleinfuse_meter * meter, int epoll_fd)
+{
+  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, meter->fd, NULL);
+  teleinfo_close(meter->fd);
+  meter->fd = 0;
+  if (meter->flush_armed) {
+    teleinfuse_timer_disarm(meter->flush_fd);
+    meter->flush_armed = 0;
+  }
+}
+
+// A frame has been decoded
+static void teleinfuse_meter_frame(teleinfuse_meter * meter, uint64_t now)
+{
+  // Bytes still in the reader chunk belong to the next frame
+  unsigned long bytes = meter->reader.bytes - (meter->reader.end - meter->reader.start);
+
+  teleinfuse_stats_record(TELEINFUSE_HISTOGRAM_DECODE_NS, meter->decode_ns);
+  teleinfuse_stats_record(TELEINFUSE_HISTOGRAM_FRAME_BYTES, bytes - meter->frame_bytes);
+  teleinfuse_stats_record(TELEINFUSE_HISTOGRAM_FRAME_SYSCALLS, meter->reader.syscalls - meter->frame_syscalls);
+  if (meter->last_frame) {
+    teleinfuse_stats_record(TELEINFUSE_HISTOGRAM_INTERARRIVAL_MS, (now - meter->last_frame) / 1000000);
+  }
+  meter->last_frame = now;
+  meter->decode_ns = 0;
+  meter->frame_bytes = bytes;
+  meter->frame_syscalls = meter->reader.syscalls;
+
+  // Every frame goes to the rules and /stream, whatever the publication interval
+  struct timespec time;
+  clock_gettime(CLOCK_REALTIME, &time);
+  teleinfuse_rules_evaluate(TELEINFUSE_METER_INDEX(meter), &(meter->decoder.frame), now / 1000000, &time);
+  teleinfuse_stream_add(TELEINFUSE_METER_INDEX(meter), &(meter->decoder.frame), &time);
+  teleinfuse_socket_publish(TELEINFUSE_METER_INDEX(meter), meter->name, &(meter->decoder.frame), &time);
+  teleinfuse_log_add(TELEINFUSE_METER_INDEX(meter), &(meter->decoder.frame), &time);
+  teleinfuse_notify(meter, meter->current);
+}
+
+// Port readable: decodes every frame available
+static void teleinfuse_meter_input(teleinfuse_meter * meter, int epoll_fd)
+{
+  if (!meter->fd) {
+    return;
+  }
+  unsigned long bytes = meter->reader.bytes;
+  unsigned long syscalls = meter->reader.syscalls;
+  uint64_t start = teleinfuse_monotonic_ns();
+  int err;
+
+  while ((err = teleinfo_read_available(&(meter->reader), &(meter->decoder))) != EAGAIN && err != EIO) {
+    uint64_t now = teleinfuse_monotonic_ns();
+    meter->decode_ns += now - start;
+    if (!err) {
+      meter->retry_delay = TELEINFUSE_RETRY_MIN_MS;
+      teleinfuse_meter_frame(meter, now);
+      teleinfuse_publish(meter, ONLINE, &(meter->decoder.frame));
+    } else {
+      teleinfuse_stats_count(TELEINFUSE_STAT_FRAMES_REJECTED);
+      teleinfuse_publish(meter, ERROR, NULL);
+    }
+    start = teleinfuse_monotonic_ns();
+  }
+  meter->decode_ns += teleinfuse_monotonic_ns() - start;
+  teleinfuse_stats_add(TELEINFUSE_STAT_BYTES, meter->reader.bytes - bytes);
+  teleinfuse_stats_add(TELEINFUSE_STAT_SYSCALLS, meter->reader.syscalls - syscalls);
+
+  if (err == EIO) {
+    teleinfuse_meter_close(meter, epoll_fd);
+    teleinfuse_timer_arm(meter->timer_fd, meter->retry_delay);
+    teleinfuse_publish(meter, DISCONNECTED, NULL);
+    return;
+  }
+  // The no data timer is not rearmed for each read, but checked when it expires
+  meter->last_data = teleinfuse_monotonic();
+  // Fewer than TI_READ_MIN_BYTES may be left to end the frame
+  if (meter->batched && meter->reader.bytes != bytes) {
+    if (meter->decoder.state != TI_STATE_INIT) {
+      teleinfuse_timer_arm(meter->flush_fd, TI_READ_FLUSH_MS);
+      meter->flush_armed = 1;
+    } else if (meter->flush_armed) {
+      teleinfuse_timer_disarm(meter->flush_fd);
+      meter->flush_armed = 0;
+    }
+  }
+}
+
+static void teleinfuse_meter_flush(teleinfuse_meter * meter, int epoll_fd)
+{
+  teleinfuse_timer_clear(meter->flush_fd);
+  meter->flush_armed = 0;
+  teleinfuse_meter_input(meter, epoll_fd);
+}
+
+static void teleinfuse_meter_timer(teleinfuse_meter * meter, int epoll_fd)
+{
+  teleinfuse_timer_clear(meter->timer_fd);
+  if (!meter->fd) {
+    teleinfuse_meter_open(meter, epoll_fd);
+    return;
+  }
+  int64_t left = meter->last_data + TI_READ_TIMEOUT_MS - teleinfuse_monotonic();
+  if (left > 0) {
+    teleinfuse_timer_arm(meter->timer_fd, left);
+    return;
+  }
+  // port is still there but the meter does not talk
+  syslog(LOG_INFO, "%s: no data received from source", meter->name);
+  teleinfuse_stats_count(TELEINFUSE_STAT_TIMEOUTS);
+  teleinfuse_timer_arm(meter->timer_fd, TI_READ_TIMEOUT_MS);
+  meter->last_data = teleinfuse_monotonic();
+  teleinfuse_publish(meter, OFFLINE, NULL);
+}
+
+static void teleinfuse_meter_pending(teleinfuse_meter * meter)
+{
+  teleinfuse_timer_clear(meter->publish_fd);
+  if (meter->pending) {
+    teleinfuse_publish_now(meter, meter->pending_status, &(meter->pending_frame));
+  }
+}
+
+static int teleinfuse_watch(int epoll_fd, int fd, uint64_t source)
+{
+  struct epoll_event event = { .events = EPOLLIN, .data.u64 = source };
+  return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+}
+
+// Reactor: ports stay open and frames are decoded as soon as bytes come in,
+// each meter with its own decoder state. Timers reopen a port after an I/O
+// error, detect a silent meter and publish frames held back by 'interval'.
+void* teleinfuse_process(void * userdata)
+{
+  struct epoll_event events[4 * TELEINFUSE_METER_MAX + TELEINFUSE_SOCKET_SUBSCRIBERS_MAX + TELEINFUSE_RULES_CHILDREN_MAX + 2];
+  int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  int running = 1;
+
+  if (epoll_fd == -1 || teleinfuse_watch(epoll_fd, teleinfuse_stop_fd, TELEINFUSE_SOURCE_STOP) == -1) {
+    syslog(LOG_ERR, "unable to create epoll instance: %s", strerror(errno));
+    running = 0;
+  }
+  // Subscribers are optional: the files are served without them
+  if (running && teleinfuse_thread_args.socket) {
+    teleinfuse_socket_init(teleinfuse_thread_args.socket, teleinfuse_meter_count, epoll_fd, TELEINFUSE_SOURCE_SOCKET);
+  }
+  if (running) {
+    teleinfuse_rules_watch(epoll_fd, TELEINFUSE_SOURCE_RULES);
+  }
+  for (size_t n=0; running && n<teleinfuse_meter_count; n++) {
+    teleinfuse_meter * meter = &(teleinfuse_meters[n]);
+    meter->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    meter->publish_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    meter->flush_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    meter->retry_delay = TELEINFUSE_RETRY_MIN_MS;
+    if (meter->timer_fd == -1 || meter->publish_fd == -1 || meter->flush_fd == -1
+        || teleinfuse_watch(epoll_fd, meter->timer_fd, TELEINFUSE_SOURCE(meter, TELEINFUSE_SOURCE_TIMER)) == -1
+        || teleinfuse_watch(epoll_fd, meter->publish_fd, TELEINFUSE_SOURCE(meter, TELEINFUSE_SOURCE_PUBLISH)) == -1
+        || teleinfuse_watch(epoll_fd, meter->flush_fd, TELEINFUSE_SOURCE(meter, TELEINFUSE_SOURCE_FLUSH)) == -1) {
+      syslog(LOG_ERR, "%s: unable to create timers: %s", meter->name, strerror(errno));
+      running = 0;
+      break;
+    }
+    teleinfuse_meter_open(meter, epoll_fd);
+  }
+
+  while (running) {
+    int count = epoll_wait(epoll_fd, events, sizeof(events) / sizeof(events[0]), -1);
+    if (count < 0) {
+      if (errno != EINTR) {
+        syslog(LOG_ERR, "unable to wait for events: %s", strerror(errno));
+        break;
+      }
+      continue;
+    }
+    for (int n=0; n<count; n++) {
+      uint64_t source = events[n].data.u64;
+      if (source == TELEINFUSE_SOURCE_STOP) {
+        running = 0;
+        break;
+      }
+      if (source >= TELEINFUSE_SOURCE_RULES) {
+        teleinfuse_rules_event(source - TELEINFUSE_SOURCE_RULES);
+        continue;
+      }
+      if (source >= TELEINFUSE_SOURCE_SOCKET) {
+        teleinfuse_socket_event(source - TELEINFUSE_SOURCE_SOCKET);
+        continue;
+      }
+      teleinfuse_meter * meter = &(teleinfuse_meters[source >> 2]);
+      switch (source & 3) {
+        case TELEINFUSE_SOURCE_PORT:
+          teleinfuse_meter_input(meter, epoll_fd);
+          break;
+        case TELEINFUSE_SOURCE_TIMER:
+          teleinfuse_meter_timer(meter, epoll_fd);
+          break;
+        case TELEINFUSE_SOURCE_PUBLISH:
+          teleinfuse_meter_pending(meter);
+          break;
+        case TELEINFUSE_SOURCE_FLUSH:
+          teleinfuse_meter_flush(meter, epoll_fd);
+          break;
+      }
+    }
+  }
+
+  for (size_t n=0; n<teleinfuse_meter_count; n++) {
+    teleinfuse_meter * meter = &(teleinfuse_meters[n]);
+    if (meter->fd) {
+      teleinfuse_meter_close(meter, epoll_fd);
+    }
+    if (meter->timer_fd > 0) {
+      close(meter->timer_fd);
+    }
+    if (meter->publish_fd > 0) {
+      close(meter->publish_fd);
+    }
+    if (meter->flush_fd > 0) {
+      close(meter->flush_fd);
+    }
+  }
+  teleinfuse_socket_destroy();
+  teleinfuse_rules_watch(-1, 0);
+  if (epoll_fd != -1) {
+    close(epoll_fd);
+  }
+  return NULL;
+}
+
+static void teleinfuse_init(void *userdata, struct fuse_conn_info *conn)
+{
+  teleinfuse_stop_fd = eventfd(0, EFD_CLOEXEC);
+  // Without saver thread, the reader thread writes the state itself
+  if (teleinfuse_thread_args.state) {
+    teleinfuse_saver_running = !pthread_create( &teleinfuse_saver, NULL, teleinfuse_saver_process, NULL);
+  }
+  pthread_create( &teleinfuse_thread, NULL, teleinfuse_process, NULL);
+}
+
+// /metrics: Prometheus text format of the numeric values of every meter, their
+// status and the decoding counters. The text is rendered by the first read
+// after a new frame and copied as is by the next reads.
+static pthread_mutex_t teleinfuse_metrics_mutex = PTHREAD_MUTEX_INITIALIZER;
+static char * teleinfuse_metrics_text = NULL;
+static size_t teleinfuse_metrics_length = 0;
+static unsigned long teleinfuse_metrics_text_generation = 0;
+// "teleinfo_east_wh_total", empty for text labels
+static char teleinfuse_metrics_names[TI_LABEL_COUNT][48];
+static pthread_once_t teleinfuse_metrics_names_once = PTHREAD_ONCE_INIT;
+
+// Changes with every frame published by any meter
+static unsigned long teleinfuse_metrics_generation(void)
+{
+  unsigned long generation = 0;
+  for (size_t n=0; n<teleinfuse_meter_count; n++) {
+    generation += __atomic_load_n(&(teleinfuse_meters[n].current), __ATOMIC_SEQ_CST)->generation;
+  }
+  return generation;
+}
+
+static void teleinfuse_metrics_names_init(void)
+{
+  for (int id=0; id<TI_LABEL_COUNT; id++) {
+    const teleinfo_label * label = &(teleinfo_labels[id]);
+    char * p = teleinfuse_metrics_names[id];
+    if (label->type == TI_TYPE_TEXT) {
+      continue;
+    }
+    p += sprintf(p, "teleinfo_");
+    // SMAXSN-1, NJOURF+1
+    for (const char * c = label->name; *c; c++) {
+      *p++ = isalnum((unsigned char)*c) ? tolower((unsigned char)*c) : '_';
+    }
+    if (label->unit[0]) {
+      *p++ = '_';
+      for (const char * c = label->unit; *c; c++) {
+        *p++ = tolower((unsigned char)*c);
+      }
+    }
+    strcpy(p, (label->type == TI_TYPE_INDEX) ? "_total" : "");
+  }
+}
+
+// Text growing as lines are appended, freed and set to NULL when it cannot grow
+typedef struct {
+  char * text;
+  size_t length;
+  size_t size;
+} teleinfuse_metrics_buffer;
+
+static void teleinfuse_metrics_printf(teleinfuse_metrics_buffer * buffer, const char * format, ...)
+{
+  va_list args;
+
+  while (buffer->text) {
+    va_start(args, format);
+    int n = vsnprintf(buffer->text + buffer->length, buffer->size - buffer->length, format, args);
+    va_end(args);
+    if (n >= 0 && n < buffer->size - buffer->length) {
+      buffer->length += n;
+      return;
+    }
+    char * text = (n >= 0) ? realloc(buffer->text, buffer->size * 2 + n) : NULL;
+    if (!text) {
+      free(buffer->text);
+      buffer->text = NULL;
+      return;
+    }
+    buffer->text = text;
+    buffer->size = buffer->size * 2 + n;
+  }
+}
+
+static char * teleinfuse_metrics_render(teleinfuse_snapshot * snapshots[], size_t * length)
+{
+  unsigned long counters[TELEINFUSE_STAT_COUNT];
+  teleinfo_counters decoder;
+  teleinfuse_metrics_buffer buffer = { malloc(4096), 0, 4096 };
+
+  pthread_once(&teleinfuse_metrics_names_once, teleinfuse_metrics_names_init);
+  for (int id=0; id<TI_LABEL_COUNT; id++) {
+    const teleinfo_label * label = &(teleinfo_labels[id]);
+    const char * name = teleinfuse_metrics_names[id];
+    int described = 0;
+    for (size_t m=0; name[0] && m<teleinfuse_meter_count; m++) {
+      const teleinfuse_file * file = &(snapshots[m]->files[id]);
+      if (!file->used || !file->numeric) {
+        continue;
+      }
+      if (!described) {
+        teleinfuse_metrics_printf(&buffer, "# HELP %s %s%s%s%s\n# TYPE %s %s\n", name, label->name,
+                                  label->unit[0] ? " (" : "", label->unit, label->unit[0] ? ")" : "",
+                                  name, (label->type == TI_TYPE_INDEX) ? "counter" : "gauge");
+        described = 1;
+      }
+      teleinfuse_metrics_printf(&buffer, "%s{meter=\"%s\"} %lld\n", name, teleinfuse_meters[m].name, (long long)file->number);
+    }
+  }
+
+  teleinfuse_metrics_printf(&buffer, "# HELP teleinfo_up 1 when the meter sends valid frames\n# TYPE teleinfo_up gauge\n");
+  for (size_t m=0; m<teleinfuse_meter_count; m++) {
+    const teleinfuse_file * status = &(snapshots[m]->files[TELEINFUSE_STATUS_SLOT]);
+    teleinfuse_metrics_printf(&buffer, "teleinfo_up{meter=\"%s\"} %d\n", teleinfuse_meters[m].name,
+                              status->content_length == strlen(status_str(ONLINE))
+                              && !memcmp(TELEINFUSE_CONTENT(snapshots[m], status), status_str(ONLINE), status->content_length));
+  }
+  teleinfuse_metrics_printf(&buffer, "# HELP teleinfo_status Content of the status file\n# TYPE teleinfo_status gauge\n");
+  for (size_t m=0; m<teleinfuse_meter_count; m++) {
+    const teleinfuse_file * status = &(snapshots[m]->files[TELEINFUSE_STATUS_SLOT]);
+    teleinfuse_metrics_printf(&buffer, "teleinfo_status{meter=\"%s\",status=\"%.*s\"} 1\n", teleinfuse_meters[m].name,
+                              (int)status->content_length, TELEINFUSE_CONTENT(snapshots[m], status));
+  }
+
+  teleinfuse_stats_totals(counters, &decoder);
+  teleinfuse_metrics_printf(&buffer, "# HELP teleinfuse_frames_total Frames decoded\n# TYPE teleinfuse_frames_total counter\n"
+                            "teleinfuse_frames_total %lu\n", decoder.frames);
+  teleinfuse_metrics_printf(&buffer, "# HELP teleinfuse_lines_total Messages decoded\n# TYPE teleinfuse_lines_total counter\n"
+                            "teleinfuse_lines_total %lu\n", decoder.lines);
+  teleinfuse_metrics_printf(&buffer, "# HELP teleinfuse_frames_salvaged_total Frames kept with damaged messages skipped\n# TYPE teleinfuse_frames_salvaged_total counter\n"
+                            "teleinfuse_frames_salvaged_total %lu\n", decoder.salvaged);
+  teleinfuse_metrics_printf(&buffer, "# HELP teleinfuse_lines_rejected_total Messages rejected\n# TYPE teleinfuse_lines_rejected_total counter\n");
+  for (int n=0; n<TI_REJECT_COUNT; n++) {
+    teleinfuse_metrics_printf(&buffer, "teleinfuse_lines_rejected_total{reason=\"%s\"} %lu\n", teleinfuse_stats_reject_name(n), decoder.rejected[n]);
+  }
+  static const struct {
+    teleinfuse_stat stat;
+    const char * help;
+  } errors[] = {
+    { TELEINFUSE_STAT_FRAMES_REJECTED, "Frames rejected" },
+    { TELEINFUSE_STAT_TIMEOUTS, "Meters silent for the read timeout" },
+    { TELEINFUSE_STAT_OPEN_ERRORS, "Ports that could not be opened" },
+    { TELEINFUSE_STAT_PUBLISH_SKIPPED, "Frames not published, no snapshot free" },
+  };
+  for (size_t n=0; n<sizeof(errors)/sizeof(errors[0]); n++) {
+    const char * name = teleinfuse_stats_name(errors[n].stat);
+    teleinfuse_metrics_printf(&buffer, "# HELP teleinfuse_%s_total %s\n# TYPE teleinfuse_%s_total counter\nteleinfuse_%s_total %lu\n",
+                              name, errors[n].help, name, name, counters[errors[n].stat]);
+  }
+  *length = buffer.length;
+  return buffer.text;
+}
 
-teleinfuse_file* teleinfuse_find_file(const char* label)
+// Copies the text of the current frames into the handle, rendered if needed
+static int teleinfuse_metrics_fill(teleinfuse_handle * handle)
 {
-  teleinfuse_file * file = NULL;
-  for (size_t n=0; n<teleinfuse_files_count; n++) {
-    if (0==strcmp(label, teleinfuse_files[n].filename)) {
-      file = &(teleinfuse_files[n]);
-      break;
+  teleinfuse_snapshot * snapshots[TELEINFUSE_METER_MAX];
+  unsigned long generation = 0;
+  int res = 0;
+
+  pthread_mutex_lock( &teleinfuse_metrics_mutex );
+  for (size_t n=0; n<teleinfuse_meter_count; n++) {
+    snapshots[n] = teleinfuse_snapshot_acquire(&(teleinfuse_meters[n]));
+    generation += snapshots[n]->generation;
+  }
+  if (!teleinfuse_metrics_text || generation != teleinfuse_metrics_text_generation) {
+    size_t length;
+    char * text = teleinfuse_metrics_render(snapshots, &length);
+    if (text) {
+      free(teleinfuse_metrics_text);
+      teleinfuse_metrics_text = text;
+      teleinfuse_metrics_length = length;
+      teleinfuse_metrics_text_generation = generation;
     }
   }
-  return file;
+  for (size_t n=0; n<teleinfuse_meter_count; n++) {
+    teleinfuse_snapshot_release(snapshots[n]);
+  }
+
+  char * copy = teleinfuse_metrics_text ? realloc(handle->content, teleinfuse_metrics_length) : NULL;
+  if (copy) {
+    memcpy(copy, teleinfuse_metrics_text, teleinfuse_metrics_length);
+    handle->content = copy;
+    handle->length = teleinfuse_metrics_length;
+    handle->generation = teleinfuse_metrics_text_generation;
+  } else {
+    res = -ENOMEM;
+  }
+  pthread_mutex_unlock( &teleinfuse_metrics_mutex );
+  return res;
 }
 
-void teleinfuse_update_file (const char* name, const char* content)
+// Names are cached by the kernel until they are removed, attributes of values
+// and /frame until they change (see teleinfuse_invalidate)
+#define TELEINFUSE_CACHE_TIMEOUT 86400.0
+
+static int teleinfuse_node_is_dir(const teleinfuse_node * node)
 {
-  time_t now = time(NULL);
-  teleinfuse_file * file;
+  return node->kind == TELEINFUSE_NODE_ROOT || node->kind == TELEINFUSE_NODE_METER
+         || node->kind == TELEINFUSE_NODE_HISTORY_DIR || node->kind == TELEINFUSE_NODE_DERIVED_DIR
+         || node->kind == TELEINFUSE_NODE_LOG_DIR || node->kind == TELEINFUSE_NODE_STATS_DIR;
+}
 
-  if ( (file=teleinfuse_find_file (name)) ) {
-    if (0!=strcmp(content, file->content)) {
-      strcpy (file->content, content);
-      file->time = now;
-    } // else do nothing
+// Values and /frame are served from the kernel page cache until they change,
+// other files are generated at each read (direct_io)
+static int teleinfuse_node_is_cached(const teleinfuse_node * node)
+{
+  return node->kind == TELEINFUSE_NODE_FILE || node->kind == TELEINFUSE_NODE_FRAME;
+}
+
+static double teleinfuse_attr_timeout(const teleinfuse_node * node)
+{
+  return (teleinfuse_node_is_dir(node) || teleinfuse_node_is_cached(node)) ? TELEINFUSE_CACHE_TIMEOUT : 0;
+}
+
+// Finds the node of an inode number. The current snapshot of its meter is
+// acquired into *snapshot_ptr (NULL out of any meter)
+static teleinfuse_node teleinfuse_node_of(fuse_ino_t ino, teleinfuse_snapshot ** snapshot_ptr)
+{
+  teleinfuse_node node = { TELEINFUSE_NODE_NONE, NULL, 0 };
+  int kind = TELEINFUSE_INO_KIND(ino);
+  int index = TELEINFUSE_INO_INDEX(ino);
+
+  *snapshot_ptr = NULL;
+  if (ino == FUSE_ROOT_ID) {
+    if (!teleinfuse_flat) {
+      node.kind = TELEINFUSE_NODE_ROOT;
+      return node;
+    }
+    node.kind = TELEINFUSE_NODE_METER;
+    node.meter = &(teleinfuse_meters[0]);
+  } else if (TELEINFUSE_INO_METER(ino) >= teleinfuse_meter_count) {
+    return node;
   } else {
-    // New file
-    file = &(teleinfuse_files[teleinfuse_files_count]);
-    strcpy(file->filename, name);
-    strcpy(file->content,  content);
-    teleinfuse_files[teleinfuse_files_count].time = now;
-    teleinfuse_files_count++;
+    switch (kind) {
+      case TELEINFUSE_NODE_STATS:
+        if (index >= TELEINFUSE_STATS_FILE_COUNT) {
+          return node;
+        }
+        // fall through
+      case TELEINFUSE_NODE_STATS_DIR:
+      case TELEINFUSE_NODE_METRICS:
+        node.kind = kind;
+        node.index = index;
+        return node;
+      case TELEINFUSE_NODE_METER:
+        if (teleinfuse_flat) {
+          return node;
+        }
+        // fall through
+      case TELEINFUSE_NODE_FILE:
+      case TELEINFUSE_NODE_FRAME:
+      case TELEINFUSE_NODE_WAIT:
+      case TELEINFUSE_NODE_STREAM:
+      case TELEINFUSE_NODE_HISTORY_DIR:
+      case TELEINFUSE_NODE_HISTORY:
+      case TELEINFUSE_NODE_DERIVED_DIR:
+      case TELEINFUSE_NODE_DERIVED:
+      case TELEINFUSE_NODE_LOG_DIR:
+      case TELEINFUSE_NODE_LOG:
+        node.kind = kind;
+        node.meter = &(teleinfuse_meters[TELEINFUSE_INO_METER(ino)]);
+        node.index = index;
+        break;
+      default:
+        return node;
+    }
+  }
+
+  teleinfuse_snapshot * snapshot = teleinfuse_snapshot_acquire(node.meter);
+  *snapshot_ptr = snapshot;
+  // Files may have disappeared since the lookup
+  if ((node.kind == TELEINFUSE_NODE_FILE && (node.index >= TELEINFUSE_SLOT_COUNT || !snapshot->files[node.index].used))
+      || (node.kind == TELEINFUSE_NODE_STREAM && !teleinfuse_stream_enabled())
+      || (node.kind == TELEINFUSE_NODE_HISTORY_DIR && !teleinfuse_history_enabled())
+      || (node.kind == TELEINFUSE_NODE_HISTORY
+          && (node.index >= TI_LABEL_COUNT || !teleinfuse_history_exists(TELEINFUSE_METER_INDEX(node.meter), node.index)))
+      || (node.kind == TELEINFUSE_NODE_DERIVED_DIR && !teleinfuse_derived_enabled())
+      || (node.kind == TELEINFUSE_NODE_DERIVED && !teleinfuse_derived_exists(TELEINFUSE_METER_INDEX(node.meter), node.index))
+      || (node.kind == TELEINFUSE_NODE_LOG_DIR && !teleinfuse_log_enabled())
+      || (node.kind == TELEINFUSE_NODE_LOG && !teleinfuse_log_day_exists(TELEINFUSE_METER_INDEX(node.meter), node.index))) {
+    node.kind = TELEINFUSE_NODE_NONE;
   }
+  return node;
 }
 
-void teleinfuse_update (const teleinfo_data dataset[], size_t datasetlen)
+// Finds the entry name of directory parent. snapshot is the one of the parent
+// meter, it holds the child files.
+static teleinfuse_node teleinfuse_child(const teleinfuse_node * parent, const teleinfuse_snapshot * snapshot, const char * name)
 {
-  char datetime_name[20];
+  teleinfuse_node node = { TELEINFUSE_NODE_NONE, parent->meter, 0 };
 
-  pthread_mutex_lock( &teleinfuse_files_mutex );
-  for (int n=0; n<datasetlen; n++) {
-    teleinfuse_update_file(dataset[n].label, dataset[n].value);
-
-    if (teleinfuse_thread_args.with_datetime && strlen(dataset[n].datetime) > 0) {
-      strcpy(datetime_name, dataset[n].label);
-      strcat(datetime_name, DATETIME_FILENAME_SUFFIX);
-      teleinfuse_update_file(datetime_name, dataset[n].datetime);
+  switch (parent->kind) {
+    case TELEINFUSE_NODE_ROOT:
+    case TELEINFUSE_NODE_METER:
+      // Whole daemon, not a meter
+      if (parent->kind == TELEINFUSE_NODE_ROOT || teleinfuse_flat) {
+        if (0==strcmp(name, TELEINFUSE_STATS_DIRNAME)) {
+          node.kind = TELEINFUSE_NODE_STATS_DIR;
+          node.meter = NULL;
+          return node;
+        }
+        if (0==strcmp(name, TELEINFUSE_METRICS_FILENAME)) {
+          node.kind = TELEINFUSE_NODE_METRICS;
+          node.meter = NULL;
+          return node;
+        }
+      }
+      if (parent->kind == TELEINFUSE_NODE_ROOT) {
+        for (size_t n=0; n<teleinfuse_meter_count; n++) {
+          if (0==strcmp(teleinfuse_meters[n].name, name)) {
+            node.kind = TELEINFUSE_NODE_METER;
+            node.meter = &(teleinfuse_meters[n]);
+          }
+        }
+      } else if (strcmp(name, TELEINFUSE_FRAME_FILENAME) == 0) {
+        node.kind = TELEINFUSE_NODE_FRAME;
+      } else if (strcmp(name, TELEINFUSE_WAIT_FILENAME) == 0) {
+        node.kind = TELEINFUSE_NODE_WAIT;
+      } else if (teleinfuse_stream_enabled() && strcmp(name, TELEINFUSE_STREAM_FILENAME) == 0) {
+        node.kind = TELEINFUSE_NODE_STREAM;
+      } else if (teleinfuse_history_enabled() && strcmp(name, TELEINFUSE_HISTORY_DIRNAME) == 0) {
+        node.kind = TELEINFUSE_NODE_HISTORY_DIR;
+      } else if (teleinfuse_derived_enabled() && strcmp(name, TELEINFUSE_DERIVED_DIRNAME) == 0) {
+        node.kind = TELEINFUSE_NODE_DERIVED_DIR;
+      } else if (teleinfuse_log_enabled() && strcmp(name, TELEINFUSE_LOG_DIRNAME) == 0) {
+        node.kind = TELEINFUSE_NODE_LOG_DIR;
+      } else {
+        int slot = teleinfuse_slot(snapshot, name);
+        if (slot >= 0 && snapshot->files[slot].used) {
+          node.kind = TELEINFUSE_NODE_FILE;
+          node.index = slot;
+        }
+      }
+      break;
+    case TELEINFUSE_NODE_HISTORY_DIR: {
+      int id = teleinfo_label_find(name, strlen(name));
+      if (id != TI_LABEL_UNKNOWN && teleinfuse_history_exists(TELEINFUSE_METER_INDEX(parent->meter), id)) {
+        node.kind = TELEINFUSE_NODE_HISTORY;
+        node.index = id;
+      }
+      break;
     }
+    case TELEINFUSE_NODE_DERIVED_DIR:
+      if ((node.index = teleinfuse_derived_find(name)) >= 0
+          && teleinfuse_derived_exists(TELEINFUSE_METER_INDEX(parent->meter), node.index)) {
+        node.kind = TELEINFUSE_NODE_DERIVED;
+      }
+      break;
+    case TELEINFUSE_NODE_LOG_DIR:
+      if ((node.index = teleinfuse_log_day_find(name)) >= 0
+          && teleinfuse_log_day_exists(TELEINFUSE_METER_INDEX(parent->meter), node.index)) {
+        node.kind = TELEINFUSE_NODE_LOG;
+      }
+      break;
+    case TELEINFUSE_NODE_STATS_DIR:
+      if ((node.index = teleinfuse_stats_find(name)) >= 0) {
+        node.kind = TELEINFUSE_NODE_STATS;
+      }
+      break;
+    default:
+      break;
   }
-  pthread_mutex_unlock( &teleinfuse_files_mutex );
+  return node;
 }
 
-enum status { ONLINE, OFFLINE, DISCONNECTED, ERROR };
-const char * status_str(enum status s)
+// Attributes of node, snapshot is the one of its meter
+static void teleinfuse_node_stat(const teleinfuse_node * node, const teleinfuse_snapshot * snapshot, struct stat *stbuf)
 {
-  switch (s) {
-    case ONLINE:
-      return "online";
+  memset(stbuf, 0, sizeof(struct stat));
+  stbuf->st_ino = teleinfuse_ino(node);
+  switch (node->kind) {
+    case TELEINFUSE_NODE_NONE:
       break;
-    case OFFLINE:
-      return "offline";
+    case TELEINFUSE_NODE_ROOT:
+    case TELEINFUSE_NODE_METER:
+    case TELEINFUSE_NODE_HISTORY_DIR:
+    case TELEINFUSE_NODE_DERIVED_DIR:
+    case TELEINFUSE_NODE_LOG_DIR:
+    case TELEINFUSE_NODE_STATS_DIR:
+      stbuf->st_mode = S_IFDIR | 0755;
+      stbuf->st_nlink = 2;
       break;
-    case DISCONNECTED:
-      return "disconnected";
+    case TELEINFUSE_NODE_STATS:
+    case TELEINFUSE_NODE_METRICS:
+      stbuf->st_mode = S_IFREG | 0444;
+      stbuf->st_nlink = 1;
+      stbuf->st_mtime = time(NULL);
       break;
-    case ERROR:
-      return "error";
+    case TELEINFUSE_NODE_FILE:
+      stbuf->st_mode = S_IFREG | 0444;
+      stbuf->st_nlink = 1;
+      stbuf->st_size = snapshot->files[node->index].content_length;
+      stbuf->st_mtime = snapshot->files[node->index].time;
+      break;
+    case TELEINFUSE_NODE_FRAME:
+    case TELEINFUSE_NODE_WAIT:
+    case TELEINFUSE_NODE_STREAM:
+    case TELEINFUSE_NODE_HISTORY:
+    case TELEINFUSE_NODE_DERIVED:
+    case TELEINFUSE_NODE_LOG:
+      // Size is not known before open: files are read with direct_io
+      stbuf->st_mode = S_IFREG | 0444;
+      stbuf->st_nlink = 1;
+      stbuf->st_size = (node->kind == TELEINFUSE_NODE_FRAME) ? snapshot->frame_length : 0;
+      stbuf->st_mtime = snapshot->time;
       break;
   }
-  return "";
 }
 
-void* teleinfuse_process(void * userdata)
+// Entry of name in directory parent
+// returns 0 if succeed otherwise -ENOENT
+static int teleinfuse_entry(fuse_ino_t parent, const char * name, struct fuse_entry_param * entry)
 {
-  int     err ;
-  int teleinfo_serial_fd ;
-  char teleinfo_buffer[TI_FRAME_LENGTH_MAX];
-  enum status current_status = DISCONNECTED;
-  enum status previous_status = DISCONNECTED;
-
-  for(;;) {
-    teleinfo_data teleinfo_dataset[TI_MESSAGE_COUNT_MAX];
-    size_t teleinfo_data_count = 0;
-
-    teleinfo_serial_fd = teleinfo_open(teleinfuse_thread_args.port);
-    if (teleinfo_serial_fd) {
-      err = teleinfo_read_frame ( teleinfo_serial_fd, teleinfo_buffer, sizeof(teleinfo_buffer));
-      teleinfo_close (teleinfo_serial_fd);
-      if (!err) {
-        err = teleinfo_decode (teleinfo_buffer, teleinfo_dataset, &teleinfo_data_count);
-      }
-      if (!err) {
-        current_status = ONLINE;
-      } else if (err==EBADMSG){
-        current_status = ERROR;
-      } else {
-        current_status = OFFLINE;
-      }
-    } else {
-      current_status = DISCONNECTED;
-    }
-    // Add a fake teleinfo file to show status
-    strcpy(teleinfo_dataset[teleinfo_data_count].label, "status");
-    strcpy(teleinfo_dataset[teleinfo_data_count].value, status_str(current_status));
-    if (current_status != previous_status) {
-      syslog(LOG_INFO, "status changed: was \"%s\", now \"%s\"", status_str(previous_status), status_str(current_status));
-      previous_status = current_status;
-    }
-    teleinfo_data_count++;
+  teleinfuse_snapshot * snapshot;
+  teleinfuse_node node = teleinfuse_node_of(parent, &snapshot);
+  int res = 0;
 
-    teleinfuse_update (teleinfo_dataset, teleinfo_data_count);
-    pthread_testcancel();
-    sleep (teleinfuse_thread_args.interval);
-    pthread_testcancel();
+  node = teleinfuse_child(&node, snapshot, name);
+  if (node.kind == TELEINFUSE_NODE_NONE) {
+    res = -ENOENT;
+  } else {
+    memset(entry, 0, sizeof(struct fuse_entry_param));
+    entry->ino = teleinfuse_ino(&node);
+    entry->attr_timeout = teleinfuse_attr_timeout(&node);
+    entry->entry_timeout = TELEINFUSE_CACHE_TIMEOUT;
+    teleinfuse_node_stat(&node, snapshot, &(entry->attr));
+  }
+  if (snapshot) {
+    teleinfuse_snapshot_release(snapshot);
   }
+  return res;
 }
-static void *teleinfuse_init(struct fuse_conn_info *conn)
+
+static void teleinfuse_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
 {
-  pthread_create( &teleinfuse_thread, NULL, teleinfuse_process, NULL);
-  return NULL;
+  struct fuse_entry_param entry;
+
+  teleinfuse_stats_count(TELEINFUSE_STAT_FUSE_LOOKUP);
+  // Missing names are not cached: a label may come with the next frame
+  int res = teleinfuse_entry(parent, name, &entry);
+  if (res) {
+    fuse_reply_err(req, -res);
+  } else {
+    fuse_reply_entry(req, &entry);
+  }
 }
 
-static int teleinfuse_getattr(const char *path, struct stat *stbuf)
+static void teleinfuse_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-  int res = -ENOENT;
+  struct stat stbuf;
 
-  memset(stbuf, 0, sizeof(struct stat));
-  if(strcmp(path, "/") == 0) {
-    stbuf->st_mode = S_IFDIR | 0755;
-    stbuf->st_nlink = 2;
-    res = 0;
+  teleinfuse_stats_count(TELEINFUSE_STAT_FUSE_GETATTR);
+  teleinfuse_snapshot * snapshot;
+  teleinfuse_node node = teleinfuse_node_of(ino, &snapshot);
+  if (node.kind == TELEINFUSE_NODE_NONE) {
+    fuse_reply_err(req, ENOENT);
   } else {
-    pthread_mutex_lock( &teleinfuse_files_mutex );
-    for (size_t n=0; n<teleinfuse_files_count; n++) {
-      if(strcmp(path+1, teleinfuse_files[n].filename) == 0) {
-        stbuf->st_mode = S_IFREG | 0444;
-        stbuf->st_nlink = 1;
-        stbuf->st_size = strlen(teleinfuse_files[n].content);
-        stbuf->st_mtime = teleinfuse_files[n].time;
-        res = 0;
-        break;
-      }
+    teleinfuse_node_stat(&node, snapshot, &stbuf);
+    fuse_reply_attr(req, &stbuf, teleinfuse_attr_timeout(&node));
+  }
+  if (snapshot) {
+    teleinfuse_snapshot_release(snapshot);
+  }
+}
+
+// Directory listing, built at each readdir call
+typedef struct {
+  fuse_req_t req;
+  char * buf;
+  size_t size;
+  size_t capacity;
+  int error;
+} teleinfuse_dir;
+
+static void teleinfuse_dir_add(teleinfuse_dir * dir, const char * name, const teleinfuse_node * node)
+{
+  struct stat stbuf;
+  size_t length = fuse_add_direntry(dir->req, NULL, 0, name, NULL, 0);
+
+  if (dir->size + length > dir->capacity) {
+    size_t capacity = dir->capacity ? dir->capacity * 2 : 4096;
+    char * buf = realloc(dir->buf, capacity);
+    if (!buf) {
+      dir->error = ENOMEM;
+      return;
     }
-    pthread_mutex_unlock( &teleinfuse_files_mutex );
+    dir->buf = buf;
+    dir->capacity = capacity;
   }
-  return res;
+  memset(&stbuf, 0, sizeof(stbuf));
+  stbuf.st_ino = teleinfuse_ino(node);
+  stbuf.st_mode = teleinfuse_node_is_dir(node) ? S_IFDIR : S_IFREG;
+  // Offset of an entry is the one of the next entry
+  fuse_add_direntry(dir->req, dir->buf + dir->size, length, name, &stbuf, dir->size + length);
+  dir->size += length;
 }
 
-static int teleinfuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-                              off_t offset, struct fuse_file_info *fi)
+static void teleinfuse_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi)
 {
-  (void) offset;
-  (void) fi;
+  teleinfuse_dir dir = { req, NULL, 0, 0, 0 };
+
+  teleinfuse_stats_count(TELEINFUSE_STAT_FUSE_READDIR);
+  teleinfuse_snapshot * snapshot;
+  teleinfuse_node node = teleinfuse_node_of(ino, &snapshot);
+  if (!teleinfuse_node_is_dir(&node)) {
+    if (snapshot) {
+      teleinfuse_snapshot_release(snapshot);
+    }
+    fuse_reply_err(req, (node.kind == TELEINFUSE_NODE_NONE) ? ENOENT : ENOTDIR);
+    return;
+  }
+
+  teleinfuse_node child = node;
+  teleinfuse_dir_add(&dir, ".", &node);
+  teleinfuse_dir_add(&dir, "..", &node); // not looked at by the kernel
+
+  if (node.kind == TELEINFUSE_NODE_ROOT || (node.kind == TELEINFUSE_NODE_METER && teleinfuse_flat)) {
+    child = (teleinfuse_node){ TELEINFUSE_NODE_STATS_DIR, NULL, 0 };
+    teleinfuse_dir_add(&dir, TELEINFUSE_STATS_DIRNAME, &child);
+    child.kind = TELEINFUSE_NODE_METRICS;
+    teleinfuse_dir_add(&dir, TELEINFUSE_METRICS_FILENAME, &child);
+  }
+  child.meter = node.meter;
+  switch (node.kind) {
+    case TELEINFUSE_NODE_ROOT:
+      child.kind = TELEINFUSE_NODE_METER;
+      for (size_t n=0; n<teleinfuse_meter_count; n++) {
+        child.meter = &(teleinfuse_meters[n]);
+        teleinfuse_dir_add(&dir, teleinfuse_meters[n].name, &child);
+      }
+      break;
+    case TELEINFUSE_NODE_STATS_DIR:
+      child.kind = TELEINFUSE_NODE_STATS;
+      for (child.index=0; child.index<TELEINFUSE_STATS_FILE_COUNT; child.index++) {
+        teleinfuse_dir_add(&dir, teleinfuse_stats_filename(child.index), &child);
+      }
+      break;
+    case TELEINFUSE_NODE_METER:
+      child.kind = TELEINFUSE_NODE_FRAME;
+      teleinfuse_dir_add(&dir, TELEINFUSE_FRAME_FILENAME, &child);
+      child.kind = TELEINFUSE_NODE_WAIT;
+      teleinfuse_dir_add(&dir, TELEINFUSE_WAIT_FILENAME, &child);
+      if (teleinfuse_stream_enabled()) {
+        child.kind = TELEINFUSE_NODE_STREAM;
+        teleinfuse_dir_add(&dir, TELEINFUSE_STREAM_FILENAME, &child);
+      }
+      if (teleinfuse_history_enabled()) {
+        child.kind = TELEINFUSE_NODE_HISTORY_DIR;
+        teleinfuse_dir_add(&dir, TELEINFUSE_HISTORY_DIRNAME, &child);
+      }
+      if (teleinfuse_derived_enabled()) {
+        child.kind = TELEINFUSE_NODE_DERIVED_DIR;
+        teleinfuse_dir_add(&dir, TELEINFUSE_DERIVED_DIRNAME, &child);
+      }
+      if (teleinfuse_log_enabled()) {
+        child.kind = TELEINFUSE_NODE_LOG_DIR;
+        teleinfuse_dir_add(&dir, TELEINFUSE_LOG_DIRNAME, &child);
+      }
+      child.kind = TELEINFUSE_NODE_FILE;
+      for (child.index=0; child.index<TELEINFUSE_SLOT_COUNT; child.index++) {
+        if (snapshot->files[child.index].used) {
+          teleinfuse_dir_add(&dir, teleinfuse_filename(snapshot, child.index), &child);
+        }
+      }
+      break;
+    case TELEINFUSE_NODE_DERIVED_DIR: {
+      char name[TELEINFUSE_DERIVED_FILENAME_SIZE];
+      child.kind = TELEINFUSE_NODE_DERIVED;
+      for (child.index=0; child.index<TELEINFUSE_DERIVED_FILE_COUNT; child.index++) {
+        if (teleinfuse_derived_exists(TELEINFUSE_METER_INDEX(node.meter), child.index)) {
+          teleinfuse_derived_filename(child.index, name);
+          teleinfuse_dir_add(&dir, name, &child);
+        }
+      }
+      break;
+    }
+    case TELEINFUSE_NODE_LOG_DIR: {
+      char name[TELEINFUSE_LOG_DAYNAME_SIZE];
+      int first, last;
+      child.kind = TELEINFUSE_NODE_LOG;
+      if (teleinfuse_log_days(TELEINFUSE_METER_INDEX(node.meter), &first, &last)) {
+        for (child.index=first; child.index<=last; child.index++) {
+          if (teleinfuse_log_day_exists(TELEINFUSE_METER_INDEX(node.meter), child.index)) {
+            teleinfuse_log_dayname(child.index, name);
+            teleinfuse_dir_add(&dir, name, &child);
+          }
+        }
+      }
+      break;
+    }
+    default: // history
+      child.kind = TELEINFUSE_NODE_HISTORY;
+      for (child.index=0; child.index<TI_LABEL_COUNT; child.index++) {
+        if (teleinfuse_history_exists(TELEINFUSE_METER_INDEX(node.meter), child.index)) {
+          teleinfuse_dir_add(&dir, teleinfo_labels[child.index].name, &child);
+        }
+      }
+      break;
+  }
+  if (snapshot) {
+    teleinfuse_snapshot_release(snapshot);
+  }
 
-  if(strcmp(path, "/") != 0)
-    return -ENOENT;
+  if (dir.error) {
+    fuse_reply_err(req, dir.error);
+  } else if (off < dir.size) {
+    fuse_reply_buf(req, dir.buf + off, (off + size > dir.size) ? dir.size - off : size);
+  } else {
+    fuse_reply_buf(req, NULL, 0);
+  }
+  free(dir.buf);
+}
 
-  filler(buf, ".", NULL, 0);
-  filler(buf, "..", NULL, 0);
+// Copies the content of the handle file from snapshot (NULL out of any meter)
+static int teleinfuse_handle_fill(teleinfuse_handle * handle, const teleinfuse_snapshot * snapshot)
+{
+  const char * content;
+  size_t length;
 
-  pthread_mutex_lock( &teleinfuse_files_mutex );
-  for (size_t n=0; n<teleinfuse_files_count; n++) {
-    filler(buf, teleinfuse_files[n].filename, NULL, 0);
+  if (handle->node.kind == TELEINFUSE_NODE_METRICS) {
+    return teleinfuse_metrics_fill(handle);
+  }
+  // generation first: a sample added meanwhile will be seen as a change
+  handle->generation = teleinfuse_handle_generation(handle, snapshot);
+  if (handle->node.kind == TELEINFUSE_NODE_LOG) {
+    // The segments written since the previous open are seen from offset 0
+    teleinfuse_log_cursor * cursor = teleinfuse_log_open(TELEINFUSE_METER_INDEX(handle->node.meter), handle->node.index);
+    if (!cursor) {
+      return -ENOMEM;
+    }
+    teleinfuse_log_release(handle->log);
+    handle->log = cursor;
+    return 0;
+  }
+  if (handle->node.kind == TELEINFUSE_NODE_HISTORY || handle->node.kind == TELEINFUSE_NODE_DERIVED
+      || handle->node.kind == TELEINFUSE_NODE_STATS) {
+    char * text;
+    if (handle->node.kind == TELEINFUSE_NODE_HISTORY) {
+      text = teleinfuse_history_render(TELEINFUSE_METER_INDEX(handle->node.meter), handle->node.index, &length);
+    } else if (handle->node.kind == TELEINFUSE_NODE_DERIVED) {
+      text = teleinfuse_derived_render(TELEINFUSE_METER_INDEX(handle->node.meter), handle->node.index, &length);
+    } else {
+      text = teleinfuse_stats_render(handle->node.index, &length);
+    }
+    if (!text) {
+      return -ENOMEM;
+    }
+    free(handle->content);
+    handle->content = text;
+    handle->length = length;
+    return 0;
   }
-  pthread_mutex_unlock( &teleinfuse_files_mutex );
 
+  if (handle->node.kind == TELEINFUSE_NODE_FILE) {
+    const teleinfuse_file * file = &(snapshot->files[handle->node.index]);
+    content = TELEINFUSE_CONTENT(snapshot, file);
+    length = file->content_length;
+  } else {
+    content = snapshot->frame;
+    length = snapshot->frame_length;
+  }
+  char * copy = realloc(handle->content, length ? length : 1);
+  if (!copy) {
+    return -ENOMEM;
+  }
+  if (length) {
+    memcpy(copy, content, length);
+  }
+  handle->content = copy;
+  handle->length = length;
   return 0;
 }
 
-static int teleinfuse_open(const char *path, struct fuse_file_info *fi)
+// Takes the current content again when it has changed
+static int teleinfuse_handle_refresh(teleinfuse_handle * handle)
 {
-  int res = -ENOENT;
-  pthread_mutex_lock( &teleinfuse_files_mutex );
-  for (size_t n=0; n<teleinfuse_files_count; n++) {
-    if(strcmp(path+1, teleinfuse_files[n].filename) == 0) {
-      res = 0;
+  int res = 0;
+  if (handle->node.kind == TELEINFUSE_NODE_STATS) {
+    return teleinfuse_handle_fill(handle, NULL);
+  }
+  if (handle->node.kind == TELEINFUSE_NODE_METRICS) {
+    return (teleinfuse_metrics_generation() != handle->generation) ? teleinfuse_handle_fill(handle, NULL) : 0;
+  }
+  teleinfuse_snapshot * snapshot = teleinfuse_snapshot_acquire(handle->node.meter);
+  if (teleinfuse_handle_generation(handle, snapshot) != handle->generation) {
+    res = teleinfuse_handle_fill(handle, snapshot);
+  }
+  teleinfuse_snapshot_release(snapshot);
+  return res;
+}
+
+// returns 1 while there is nothing newer than what the handle got (/wait, /stream)
+static int teleinfuse_handle_idle(const teleinfuse_handle * handle)
+{
+  if (handle->node.kind == TELEINFUSE_NODE_STREAM) {
+    return teleinfuse_stream_head(TELEINFUSE_METER_INDEX(handle->node.meter)) == handle->cursor;
+  }
+  return __atomic_load_n(&(handle->node.meter->current), __ATOMIC_SEQ_CST)->generation == handle->generation;
+}
+
+// Blocks until a frame newer than the handle content is published (decoded for /stream)
+// req (may be NULL) is checked for interruption
+static int teleinfuse_handle_wait(teleinfuse_handle * handle, fuse_req_t req)
+{
+  int res = 0;
+
+  pthread_mutex_lock( &teleinfuse_notify_mutex );
+  while (teleinfuse_handle_idle(handle)) {
+    if (teleinfuse_stopping || (req && fuse_req_interrupted(req))) {
+      res = -EINTR;
       break;
     }
+    // Wake up from time to time to see if the request has been interrupted
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec++;
+    pthread_cond_timedwait( &teleinfuse_notify_cond, &teleinfuse_notify_mutex, &deadline );
   }
-  pthread_mutex_unlock( &teleinfuse_files_mutex );
-
-  if (res== -ENOENT) return res;
+  pthread_mutex_unlock( &teleinfuse_notify_mutex );
+  if (res || handle->node.kind == TELEINFUSE_NODE_STREAM) {
+    return res;
+  }
+  return teleinfuse_handle_refresh(handle);
+}
 
-  if((fi->flags & 3) != O_RDONLY)
-    res = -EACCES;
+// Next bytes of the stream, offset is not used
+static int teleinfuse_handle_stream(teleinfuse_handle * handle, fuse_req_t req, size_t size, const char ** data)
+{
+  int res = teleinfuse_handle_wait(handle, req);
+  if (res) {
+    return res;
+  }
+  size = teleinfuse_stream_read(TELEINFUSE_METER_INDEX(handle->node.meter), &(handle->cursor), handle->content,
+                                (size < TELEINFUSE_STREAM_SIZE) ? size : TELEINFUSE_STREAM_SIZE);
+  handle->generation = handle->cursor;
+  *data = handle->content;
+  return size;
+}
 
-  return res;
+// Text of the day from offset, decoded into a buffer of the size of the largest read
+static int teleinfuse_handle_log(teleinfuse_handle * handle, size_t size, off_t offset, const char ** data)
+{
+  if (size > handle->length) {
+    char * content = realloc(handle->content, size);
+    if (!content) {
+      return -ENOMEM;
+    }
+    handle->content = content;
+    handle->length = size;
+  }
+  *data = handle->content;
+  return teleinfuse_log_read(handle->log, handle->content, size, offset);
 }
 
-static int teleinfuse_read(const char *path, char *buf, size_t size, off_t offset,
-                           struct fuse_file_info *fi)
+// returns 0 and the handle of the opened file into *handle_ptr if succeed otherwise -errno
+static int teleinfuse_handle_open(fuse_ino_t ino, teleinfuse_handle ** handle_ptr)
 {
-  size_t len;
-  (void) fi;
+  teleinfuse_handle * handle;
   int res = -ENOENT;
-  size_t n;
 
-  pthread_mutex_lock( &teleinfuse_files_mutex );
-  for (n=0; n<teleinfuse_files_count; n++) {
-    if(strcmp(path+1, teleinfuse_files[n].filename) == 0) {
+  if ( !(handle = calloc(1, sizeof(teleinfuse_handle))) )
+    return -ENOMEM;
+
+  teleinfuse_snapshot * snapshot;
+  handle->node = teleinfuse_node_of(ino, &snapshot);
+  switch (handle->node.kind) {
+    case TELEINFUSE_NODE_WAIT:
+      // Nothing to read before the next frame
+      handle->generation = snapshot->generation;
       res = 0;
       break;
+    case TELEINFUSE_NODE_STREAM:
+      handle->cursor = teleinfuse_stream_head(TELEINFUSE_METER_INDEX(handle->node.meter));
+      handle->generation = handle->cursor;
+      res = (handle->content = malloc(TELEINFUSE_STREAM_SIZE)) ? 0 : -ENOMEM;
+      break;
+    case TELEINFUSE_NODE_FILE:
+    case TELEINFUSE_NODE_FRAME:
+    case TELEINFUSE_NODE_HISTORY:
+    case TELEINFUSE_NODE_DERIVED:
+    case TELEINFUSE_NODE_LOG:
+    case TELEINFUSE_NODE_STATS:
+    case TELEINFUSE_NODE_METRICS:
+      res = teleinfuse_handle_fill(handle, snapshot);
+      break;
+    case TELEINFUSE_NODE_ROOT:
+    case TELEINFUSE_NODE_METER:
+    case TELEINFUSE_NODE_HISTORY_DIR:
+    case TELEINFUSE_NODE_DERIVED_DIR:
+    case TELEINFUSE_NODE_LOG_DIR:
+    case TELEINFUSE_NODE_STATS_DIR:
+      res = -EISDIR;
+      break;
+    case TELEINFUSE_NODE_NONE:
+      break;
+  }
+  if (snapshot) {
+    teleinfuse_snapshot_release(snapshot);
+  }
+
+  if (res) {
+    teleinfuse_log_release(handle->log);
+    free(handle->content);
+    free(handle);
+    return res;
+  }
+  *handle_ptr = handle;
+  return 0;
+}
+
+static void teleinfuse_handle_close(teleinfuse_handle * handle)
+{
+  pthread_mutex_lock( &teleinfuse_notify_mutex );
+  if (handle->ph) {
+    teleinfuse_handle ** p = &teleinfuse_polled;
+    while (*p != handle) {
+      p = &((*p)->next);
     }
+    *p = handle->next;
+    fuse_pollhandle_destroy(handle->ph);
   }
-  pthread_mutex_unlock( &teleinfuse_files_mutex );
-  if (res== -ENOENT) return res;
+  pthread_mutex_unlock( &teleinfuse_notify_mutex );
 
-  pthread_mutex_lock( &teleinfuse_files_mutex );
-  len = strlen(teleinfuse_files[n].content);
+  teleinfuse_log_release(handle->log);
+  free(handle->content);
+  free(handle);
+}
+
+// returns the number of bytes of the handle content at offset put into *data, otherwise -errno
+// req (may be NULL) is checked for interruption while waiting
+static int teleinfuse_handle_read(teleinfuse_handle * handle, fuse_req_t req, size_t size, off_t offset, const char ** data)
+{
+  if (handle->node.kind == TELEINFUSE_NODE_STREAM) {
+    return teleinfuse_handle_stream(handle, req, size, data);
+  }
+  if (offset == 0) {
+    int res = (handle->node.kind == TELEINFUSE_NODE_WAIT) ? teleinfuse_handle_wait(handle, req) : teleinfuse_handle_refresh(handle);
+    if (res) {
+      return res;
+    }
+  }
+  if (handle->node.kind == TELEINFUSE_NODE_LOG) {
+    return teleinfuse_handle_log(handle, size, offset, data);
+  }
 
+  size_t len = handle->length;
   if (offset < len) {
     if (offset + size > len)
       size = len - offset;
-    memcpy(buf, teleinfuse_files[n].content + offset, size);
+    *data = handle->content + offset;
   } else
     size = 0;
 
-  pthread_mutex_unlock( &teleinfuse_files_mutex );
-
   return size;
 }
 
-static void teleinfuse_destroy(void * p)
+static void teleinfuse_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+  teleinfuse_handle * handle;
+  int res;
+
+  teleinfuse_stats_count(TELEINFUSE_STAT_FUSE_OPEN);
+  if((fi->flags & 3) != O_RDONLY) {
+    fuse_reply_err(req, EACCES);
+    return;
+  }
+  if ((res = teleinfuse_handle_open(ino, &handle))) {
+    fuse_reply_err(req, -res);
+    return;
+  }
+  if (teleinfuse_node_is_cached(&(handle->node))) {
+    // Pages are kept from one open to another until teleinfuse_invalidate drops them
+    fi->keep_cache = 1;
+  } else {
+    // Every read comes to us: content may change between two reads
+    fi->direct_io = 1;
+    fi->nonseekable = (handle->node.kind == TELEINFUSE_NODE_STREAM);
+  }
+  fi->fh = (uintptr_t)handle;
+  if (fuse_reply_open(req, fi)) {
+    // Interrupted: release will not come
+    teleinfuse_handle_close(handle);
+  }
+}
+
+static void teleinfuse_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+  teleinfuse_stats_count(TELEINFUSE_STAT_FUSE_RELEASE);
+  teleinfuse_handle_close((teleinfuse_handle*)(uintptr_t)fi->fh);
+  fuse_reply_err(req, 0);
+}
+
+static void teleinfuse_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+  const char * data = NULL;
+
+  teleinfuse_stats_count(TELEINFUSE_STAT_FUSE_READ);
+  int res = teleinfuse_handle_read((teleinfuse_handle*)(uintptr_t)fi->fh, req, size, offset, &data);
+  if (res < 0) {
+    fuse_reply_err(req, -res);
+  } else {
+    fuse_reply_buf(req, data, res);
+  }
+}
+
+// Readable when the content has changed since it was last read
+static void teleinfuse_poll(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi, struct fuse_pollhandle *ph)
+{
+  teleinfuse_handle * handle = (teleinfuse_handle*)(uintptr_t)fi->fh;
+  unsigned revents = 0;
+
+  teleinfuse_stats_count(TELEINFUSE_STAT_FUSE_POLL);
+  if (handle->node.kind == TELEINFUSE_NODE_STATS) {
+    // Counters change all the time
+    if (ph) {
+      fuse_pollhandle_destroy(ph);
+    }
+    fuse_reply_poll(req, POLLIN);
+    return;
+  }
+  pthread_mutex_lock( &teleinfuse_notify_mutex );
+  if (ph) {
+    // Registered before checking: a frame published meanwhile will notify it
+    if (handle->ph) {
+      fuse_pollhandle_destroy(handle->ph);
+    } else {
+      handle->next = teleinfuse_polled;
+      teleinfuse_polled = handle;
+    }
+    handle->ph = ph;
+  }
+  // /metrics belongs to no meter
+  teleinfuse_snapshot * snapshot = handle->node.meter ? teleinfuse_snapshot_acquire(handle->node.meter) : NULL;
+  if (teleinfuse_handle_generation(handle, snapshot) != handle->generation) {
+    revents |= POLLIN;
+    // Reads of a cached file may not come to us: the change is reported once
+    if (teleinfuse_node_is_cached(&(handle->node))) {
+      teleinfuse_handle_fill(handle, snapshot);
+    }
+  }
+  if (snapshot) {
+    teleinfuse_snapshot_release(snapshot);
+  }
+  pthread_mutex_unlock( &teleinfuse_notify_mutex );
+  fuse_reply_poll(req, revents);
+}
+
+// Stops the reader thread, nothing is published afterwards
+static void teleinfuse_stop(void)
 {
-  pthread_cancel (teleinfuse_thread);
+  if (teleinfuse_stop_fd == -1) {
+    return; // not started or already stopped
+  }
+  pthread_mutex_lock( &teleinfuse_notify_mutex );
+  teleinfuse_stopping = 1;
+  pthread_cond_broadcast( &teleinfuse_notify_cond );
+  pthread_mutex_unlock( &teleinfuse_notify_mutex );
+  uint64_t stop = 1;
+  if (write(teleinfuse_stop_fd, &stop, sizeof(stop)) != sizeof(stop)) {
+    syslog(LOG_ERR, "unable to stop reader thread: %s", strerror(errno));
+  }
   pthread_join (teleinfuse_thread, NULL);
+  close(teleinfuse_stop_fd);
+  teleinfuse_stop_fd = -1;
 }
 
-static struct fuse_operations teleinfuse_oper = {
+static void teleinfuse_destroy(void * userdata)
+{
+  teleinfuse_stop();
+  if (teleinfuse_thread_args.state) {
+    teleinfuse_state_save_last();
+  }
+  teleinfuse_history_destroy();
+  teleinfuse_derived_destroy();
+  teleinfuse_log_destroy();
+  teleinfuse_rules_destroy();
+  teleinfuse_stream_destroy();
+}
+
+static struct fuse_lowlevel_ops teleinfuse_oper = {
   .init       = teleinfuse_init,
+  .lookup     = teleinfuse_lookup,
   .getattr    = teleinfuse_getattr,
   .readdir    = teleinfuse_readdir,
   .open       = teleinfuse_open,
   .read       = teleinfuse_read,
+  .release    = teleinfuse_release,
+  .poll       = teleinfuse_poll,
   .destroy    = teleinfuse_destroy,
 };
 /** options for fuse_opt.h */
 struct options {
    int interval;
    int with_datetime;
+   int salvage;
+   int history;
+   char * history_labels;
+   int derived;
+   char * derived_labels;
+   char * log;
+   int log_segment_kb;
+   char * rules;
+   int replay_speed;
+   char * state;
+   int state_frames;
+   char * socket;
 }options;
 
 /** macro to define options */
@@ -317,14 +2243,143 @@ static struct fuse_opt teleinfuse_opts[] =
 {
   TELEINFUSE_OPT_KEY("interval=%d", interval, 10),
   TELEINFUSE_OPT_KEY("with_datetime", with_datetime, 1),
+  TELEINFUSE_OPT_KEY("salvage", salvage, 1),
+  TELEINFUSE_OPT_KEY("history=%d", history, 0),
+  TELEINFUSE_OPT_KEY("history_labels=%s", history_labels, 0),
+  TELEINFUSE_OPT_KEY("derived", derived, 1),
+  TELEINFUSE_OPT_KEY("derived_labels=%s", derived_labels, 0),
+  TELEINFUSE_OPT_KEY("log=%s", log, 0),
+  TELEINFUSE_OPT_KEY("log_segment_kb=%d", log_segment_kb, 0),
+  TELEINFUSE_OPT_KEY("rules=%s", rules, 0),
+  TELEINFUSE_OPT_KEY("replay_speed=%d", replay_speed, 1),
+  TELEINFUSE_OPT_KEY("state=%s", state, 0),
+  TELEINFUSE_OPT_KEY("state_frames=%d", state_frames, 0),
+  TELEINFUSE_OPT_KEY("socket=%s", socket, 0),
   FUSE_OPT_END
 };
 
+// FUSE goes to / when it runs in background: relative paths are made absolute
+// returns a malloc'ed path, or path itself if it is already absolute
+static char * teleinfuse_absolute(char * path)
+{
+  char cwd[PATH_MAX];
+  char * absolute;
+
+  if (path[0] == '/' || !getcwd(cwd, sizeof(cwd)) || !(absolute = malloc(strlen(cwd) + strlen(path) + 2))) {
+    return path;
+  }
+  sprintf(absolute, "%s/%s", cwd, path);
+  return absolute;
+}
+
+// devices: "[NAME:]DEV[,[NAME:]DEV...]", NAME is the subdirectory of the meter
+// (DEV file name by default)
+// returns 0 if succeed otherwise -1
+static int teleinfuse_meters_init(const char * devices)
+{
+  char * list = strdup(devices); // ports point into it until exit
+  size_t count = 1;
+  int named = 0;
+  char * save;
+
+  for (const char * p = devices; *p; p++) {
+    if (*p == ',') {
+      count++;
+    }
+  }
+  if (count > TELEINFUSE_METER_MAX) {
+    fprintf(stderr, "At most %d meters can be read.\n", TELEINFUSE_METER_MAX);
+    return -1;
+  }
+  if (!list || !(teleinfuse_meters = calloc(count, sizeof(teleinfuse_meter)))) {
+    fprintf(stderr, "Unable to allocate meters.\n");
+    return -1;
+  }
+  for (char * device = strtok_r(list, ",", &save); device; device = strtok_r(NULL, ",", &save)) {
+    teleinfuse_meter * meter = &(teleinfuse_meters[teleinfuse_meter_count]);
+    const char * name;
+    char * colon = strchr(device, ':');
+    // A device path may hold ':' (/dev/serial/by-path), a name holds no '/'
+    if (colon && !memchr(device, '/', colon - device)) {
+      *colon = '\0';
+      name = device;
+      device = colon + 1;
+      named = 1;
+    } else {
+      name = strrchr(device, '/') ? strrchr(device, '/') + 1 : device;
+    }
+    // Names beginning with '.' and "metrics" are kept for the daemon, quotes would break /metrics
+    if (!*name || !*device || strlen(name) >= sizeof(meter->name) || name[0] == '.'
+        || !strcmp(name, TELEINFUSE_METRICS_FILENAME) || strpbrk(name, "\"\\")) {
+      fprintf(stderr, "Invalid meter \"%s\".\n", name);
+      return -1;
+    }
+    for (size_t n=0; n<teleinfuse_meter_count; n++) {
+      if (!strcmp(teleinfuse_meters[n].name, name)) {
+        fprintf(stderr, "Meter \"%s\" is given twice.\n", name);
+        return -1;
+      }
+    }
+    strcpy(meter->name, name);
+    meter->port = teleinfuse_absolute(device);
+    meter->status = DISCONNECTED;
+    meter->current = &(meter->snapshots[0]);
+    teleinfuse_meter_count++;
+  }
+  for (int id=0; id<TI_LABEL_COUNT; id++) {
+    strcpy(teleinfuse_datetime_names[id], teleinfo_labels[id].name);
+    strcat(teleinfuse_datetime_names[id], DATETIME_FILENAME_SUFFIX);
+    teleinfuse_line_labels[id] = !strncmp(teleinfo_labels[id].name, "SINST", 5);
+  }
+  if (!teleinfuse_meter_count) {
+    fprintf(stderr, "No meter given.\n");
+    return -1;
+  }
+  teleinfuse_flat = (teleinfuse_meter_count == 1 && !named);
+  return 0;
+}
+
+// fuse_main for the low level API: mounts, goes to background and serves requests
+// returns 0 if succeed otherwise -1
+static int teleinfuse_serve(struct fuse_args * args)
+{
+  char * mountpoint = NULL;
+  int multithreaded, foreground;
+  int res = -1;
+
+  if (fuse_parse_cmdline(args, &mountpoint, &multithreaded, &foreground) == -1 || !mountpoint) {
+    return -1;
+  }
+  struct fuse_chan * ch = fuse_mount(mountpoint, args);
+  if (ch) {
+    struct fuse_session * se = fuse_lowlevel_new(args, &teleinfuse_oper, sizeof(teleinfuse_oper), NULL);
+    if (se) {
+      if (fuse_set_signal_handlers(se) != -1) {
+        fuse_session_add_chan(se, ch);
+        teleinfuse_chan = ch;
+        if (fuse_daemonize(foreground) != -1) {
+          res = multithreaded ? fuse_session_loop_mt(se) : fuse_session_loop(se);
+        }
+        // The reader thread must not notify a channel being removed
+        teleinfuse_stop();
+        teleinfuse_chan = NULL;
+        fuse_remove_signal_handlers(se);
+        fuse_session_remove_chan(ch);
+      }
+      fuse_session_destroy(se);
+    }
+    fuse_unmount(mountpoint, ch);
+  }
+  free(mountpoint);
+  return res ? -1 : 0;
+}
+
 int main(int argc, char *argv[])
 {
   // Args parssing
   if (argc<3) {
-    printf ("Usage: %s DEV MOUNTPOINT\nExample: %s /dev/ttyUSB0 /house/electric_meter\n", argv[0], argv[0]);
+    printf ("Usage: %s [NAME:]DEV[,[NAME:]DEV...] MOUNTPOINT\nExample: %s /dev/ttyUSB0 /house/electric_meter\n"
+            "         %s main:/dev/ttyUSB0,pv:/dev/ttyUSB1 /house/electric_meters\n", argv[0], argv[0], argv[0]);
     exit(EXIT_FAILURE);
   }
 
@@ -336,22 +2391,55 @@ int main(int argc, char *argv[])
       fuse_opt_add_arg(&args, argv[i]);
     }
   }
+  options.replay_speed = 1;
+  options.state_frames = 60;
+  options.log_segment_kb = 16 * 1024;
   if (fuse_opt_parse(&args, &options, teleinfuse_opts, NULL) == -1)
     /** error parsing options */
     return -1;
 
+  if (teleinfuse_meters_init(argv[1]))
+    return -1;
+
+  const char * names[TELEINFUSE_METER_MAX];
+  for (size_t n=0; n<teleinfuse_meter_count; n++) {
+    names[n] = teleinfuse_meters[n].name;
+  }
+
   openlog("teleinfuse", LOG_PID, LOG_USER) ;
-  syslog(LOG_INFO, "starting teleinfuse with %ds intervals (with_datetime: %d)", options.interval, options.with_datetime);
-  teleinfuse_thread_args.port = argv[1];
+  // Read before going to background: a wrong rule stops here
+  if (options.rules && teleinfuse_rules_init(options.rules, teleinfuse_meter_count, names))
+    return -1;
+  syslog(LOG_INFO, "starting teleinfuse for %zu meter(s) with %ds intervals (with_datetime: %d)", teleinfuse_meter_count, options.interval, options.with_datetime);
   teleinfuse_thread_args.interval = options.interval;
   teleinfuse_thread_args.with_datetime = options.with_datetime;
+  teleinfuse_thread_args.salvage = options.salvage;
+  teleinfuse_thread_args.state = options.state ? teleinfuse_absolute(options.state) : NULL;
+  teleinfuse_thread_args.state_frames = options.state_frames > 0 ? options.state_frames : 1;
+  teleinfuse_thread_args.socket = options.socket ? teleinfuse_absolute(options.socket) : NULL;
+  teleinfuse_history_init(teleinfuse_meter_count, options.history > 0 ? options.history : 0, options.history_labels);
+  teleinfuse_derived_init(teleinfuse_meter_count, options.derived, options.derived_labels);
+  if (options.log) {
+    teleinfuse_log_init(teleinfuse_absolute(options.log), (options.log_segment_kb > 0 ? options.log_segment_kb : 1) * (size_t)1024,
+                        teleinfuse_meter_count, names);
+  }
+  teleinfuse_stream_init(teleinfuse_meter_count);
+  teleinfo_set_replay_speed(options.replay_speed > 0 ? options.replay_speed : 0);
 
-  int fd;
-  if ( (fd = teleinfo_open(teleinfuse_thread_args.port)) ) { // Be sure the port is reacheable
-    teleinfo_close(fd);
-    fuse_main (args.argc, args.argv, &teleinfuse_oper, NULL);
-  } else {
-    fprintf(stderr, "Unable to reach \"%s\" as serial port.\n", teleinfuse_thread_args.port);
+  int reachable = 1;
+  for (size_t n=0; n<teleinfuse_meter_count; n++) {
+    // Be sure the port is reacheable, before fuse_daemonize forks
+    int err = teleinfo_check(teleinfuse_meters[n].port);
+    if (err) {
+      fprintf(stderr, "Unable to reach \"%s\" as serial port: %s.\n", teleinfuse_meters[n].port, strerror(err));
+      reachable = 0;
+    }
+  }
+  if (reachable) {
+    if (teleinfuse_thread_args.state) {
+      teleinfuse_state_load(teleinfuse_thread_args.state);
+    }
+    teleinfuse_serve(&args);
   }
 
   closelog() ;
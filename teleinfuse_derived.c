@@ -0,0 +1,356 @@
+/*
+ * teleinfuse is a FUSE module to access to the Télé information of linky electric meter running in standard mode
+ * Télé info data are transmitted by french electric meters (EDF/ERDF)
+ * [FR] Permet de lire la téléinformation cliente (TIC) d'un compteur linky en mode standard.
+ * [FR] Pour le mode TIC historique, voir le projet original
+ *
+ * Based on https://github.com/neomilium/teleinfuse project by Romuald Conty
+ *
+ * Copyright (C) 2020 itineric
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "teleinfuse_derived.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <syslog.h>
+
+// 15 minutes of frames sent less than 0.44 s apart, older samples are dropped
+// before their time if frames come faster
+#define TELEINFUSE_DERIVED_SAMPLES 2048
+#define TELEINFUSE_DERIVED_WINDOWS 3
+
+static const uint32_t teleinfuse_derived_windows[TELEINFUSE_DERIVED_WINDOWS] = { 60000, 300000, 900000 }; // ms
+
+static const char * const teleinfuse_derived_suffixes[TELEINFUSE_DERIVED_KIND_COUNT] = {
+  "rate", "load",
+  "avg_1m", "avg_5m", "avg_15m",
+  "min_1m", "min_5m", "min_15m",
+  "max_1m", "max_5m", "max_15m",
+};
+
+typedef struct {
+  uint32_t time; // ms, only differences are used (wraps after 49 days)
+  int32_t value;
+} teleinfuse_derived_sample;
+
+// Samples start to end of the series are in the window. The deques hold ring
+// positions of samples of the window, values increasing (min) or decreasing
+// (max) from head to tail: their heads are the min and max of the window.
+typedef struct {
+  size_t start;
+  int64_t sum;
+  size_t min_head, min_tail; // counters, positions in min are counter % TELEINFUSE_DERIVED_SAMPLES
+  size_t max_head, max_tail;
+  uint16_t min[TELEINFUSE_DERIVED_SAMPLES];
+  uint16_t max[TELEINFUSE_DERIVED_SAMPLES];
+} teleinfuse_window;
+
+// 40 KB per windowed label
+typedef struct {
+  size_t end; // samples ever added, next position is end % TELEINFUSE_DERIVED_SAMPLES
+  teleinfuse_derived_sample samples[TELEINFUSE_DERIVED_SAMPLES];
+  teleinfuse_window windows[TELEINFUSE_DERIVED_WINDOWS];
+} teleinfuse_series;
+
+// An index only tells whole Wh: the rate is measured between two changes
+enum {
+  TELEINFUSE_RATE_NONE,
+  TELEINFUSE_RATE_SEEN,    // index known, not when it changed
+  TELEINFUSE_RATE_CHANGED, // index and time of its last change known
+  TELEINFUSE_RATE_VALID,
+};
+
+typedef struct {
+  int64_t index; // at the last change
+  int64_t rate;  // W or VAr
+  uint32_t time; // ms of the last change
+  char state;
+} teleinfuse_rate;
+
+typedef struct {
+  teleinfuse_rate rates[TI_LABEL_COUNT];
+  teleinfuse_series * series[TI_LABEL_COUNT]; // NULL until a windowed label gets a numeric value
+  int64_t pref;  // kVA, 0 until received
+  int64_t load;  // per mille
+  char has_load;
+  unsigned long generation;
+} teleinfuse_derived_meter;
+
+static pthread_mutex_t teleinfuse_derived_mutex = PTHREAD_MUTEX_INITIALIZER;
+static teleinfuse_derived_meter * teleinfuse_derived_meters = NULL;
+static size_t teleinfuse_derived_meter_count = 0;
+static unsigned char teleinfuse_derived_wanted[TI_LABEL_COUNT];
+static int teleinfuse_derived_sinsts = TI_LABEL_UNKNOWN;
+static int teleinfuse_derived_pref = TI_LABEL_UNKNOWN;
+
+void teleinfuse_derived_init (size_t meters, int enabled, const char * labels)
+{
+  if (enabled && !(teleinfuse_derived_meters = calloc(meters, sizeof(teleinfuse_derived_meter)))) {
+    syslog(LOG_ERR, "derived: unable to allocate meters, derived values disabled");
+  }
+  teleinfuse_derived_meter_count = teleinfuse_derived_meters ? meters : 0;
+  teleinfuse_derived_sinsts = teleinfo_label_find("SINSTS", 6);
+  teleinfuse_derived_pref = teleinfo_label_find("PREF", 4);
+  memset(teleinfuse_derived_wanted, 0, sizeof(teleinfuse_derived_wanted));
+  if (!labels) {
+    teleinfuse_derived_wanted[teleinfuse_derived_sinsts] = 1;
+  }
+  while (labels && *labels) {
+    const char * end = strchr(labels, ':');
+    size_t length = end ? (size_t)(end - labels) : strlen(labels);
+    int id = teleinfo_label_find(labels, length);
+    if (id != TI_LABEL_UNKNOWN) {
+      teleinfuse_derived_wanted[id] = 1;
+    } else {
+      syslog(LOG_ERR, "derived: unknown label \"%.*s\"", (int)length, labels);
+    }
+    labels += length;
+    if (*labels) {
+      labels++;
+    }
+  }
+}
+
+void teleinfuse_derived_destroy (void)
+{
+  for (size_t n=0; n<teleinfuse_derived_meter_count; n++) {
+    for (int id=0; id<TI_LABEL_COUNT; id++) {
+      free(teleinfuse_derived_meters[n].series[id]);
+    }
+  }
+  free(teleinfuse_derived_meters);
+  teleinfuse_derived_meters = NULL;
+  teleinfuse_derived_meter_count = 0;
+}
+
+int teleinfuse_derived_enabled (void)
+{
+  return teleinfuse_derived_meters != NULL;
+}
+
+static void teleinfuse_rate_add (teleinfuse_rate * rate, int64_t value, uint32_t now)
+{
+  uint32_t elapsed = now - rate->time;
+
+  if (rate->state == TELEINFUSE_RATE_NONE || value < rate->index) {
+    // First value, or the meter has been reset
+    rate->index = value;
+    rate->state = TELEINFUSE_RATE_SEEN;
+  } else if (value > rate->index) {
+    if (rate->state != TELEINFUSE_RATE_SEEN && elapsed) {
+      rate->rate = (value - rate->index) * 3600000 / elapsed;
+      rate->state = TELEINFUSE_RATE_VALID;
+    } else {
+      rate->state = TELEINFUSE_RATE_CHANGED;
+    }
+    rate->index = value;
+    rate->time = now;
+  } else if (rate->state == TELEINFUSE_RATE_VALID && elapsed) {
+    // Less than a unit since the last change: the rate can only have fallen
+    int64_t bound = 3600000 / elapsed;
+    if (rate->rate > bound) {
+      rate->rate = bound;
+    }
+  }
+}
+
+static void teleinfuse_series_add (teleinfuse_series * series, int32_t value, uint32_t now)
+{
+  teleinfuse_derived_sample * samples = series->samples;
+  uint16_t position = series->end % TELEINFUSE_DERIVED_SAMPLES;
+
+  for (int w=0; w<TELEINFUSE_DERIVED_WINDOWS; w++) {
+    teleinfuse_window * window = &(series->windows[w]);
+    // Samples out of the window, or about to be overwritten
+    while (window->start < series->end
+           && (series->end - window->start >= TELEINFUSE_DERIVED_SAMPLES
+               || now - samples[window->start % TELEINFUSE_DERIVED_SAMPLES].time >= teleinfuse_derived_windows[w])) {
+      uint16_t first = window->start % TELEINFUSE_DERIVED_SAMPLES;
+      window->sum -= samples[first].value;
+      if (window->min_head != window->min_tail && window->min[window->min_head % TELEINFUSE_DERIVED_SAMPLES] == first) {
+        window->min_head++;
+      }
+      if (window->max_head != window->max_tail && window->max[window->max_head % TELEINFUSE_DERIVED_SAMPLES] == first) {
+        window->max_head++;
+      }
+      window->start++;
+    }
+  }
+
+  samples[position].time = now;
+  samples[position].value = value;
+  for (int w=0; w<TELEINFUSE_DERIVED_WINDOWS; w++) {
+    teleinfuse_window * window = &(series->windows[w]);
+    window->sum += value;
+    // Samples that can no longer be the min (max) of the window
+    while (window->min_head != window->min_tail
+           && samples[window->min[(window->min_tail - 1) % TELEINFUSE_DERIVED_SAMPLES]].value >= value) {
+      window->min_tail--;
+    }
+    window->min[window->min_tail++ % TELEINFUSE_DERIVED_SAMPLES] = position;
+    while (window->max_head != window->max_tail
+           && samples[window->max[(window->max_tail - 1) % TELEINFUSE_DERIVED_SAMPLES]].value <= value) {
+      window->max_tail--;
+    }
+    window->max[window->max_tail++ % TELEINFUSE_DERIVED_SAMPLES] = position;
+  }
+  series->end++;
+}
+
+void teleinfuse_derived_update (int meter, const teleinfo_frame * frame, int64_t now)
+{
+  if (!teleinfuse_derived_meters) {
+    return;
+  }
+  teleinfuse_derived_meter * derived = &(teleinfuse_derived_meters[meter]);
+
+  // Series are allocated before taking the lock
+  for (size_t n=0; n<frame->datasetlen; n++) {
+    const teleinfo_data * data = &(frame->dataset[n]);
+    if (data->numeric && data->id != TI_LABEL_UNKNOWN && teleinfuse_derived_wanted[data->id] && !derived->series[data->id]) {
+      teleinfuse_series * series = calloc(1, sizeof(teleinfuse_series));
+      if (!series) {
+        syslog(LOG_ERR, "derived: unable to allocate the windows of %s", teleinfo_labels[data->id].name);
+        teleinfuse_derived_wanted[data->id] = 0;
+        continue;
+      }
+      pthread_mutex_lock( &teleinfuse_derived_mutex );
+      derived->series[data->id] = series;
+      pthread_mutex_unlock( &teleinfuse_derived_mutex );
+    }
+  }
+
+  pthread_mutex_lock( &teleinfuse_derived_mutex );
+  for (size_t n=0; n<frame->datasetlen; n++) {
+    const teleinfo_data * data = &(frame->dataset[n]);
+    int id = data->id;
+    if (!data->numeric || id == TI_LABEL_UNKNOWN) {
+      continue;
+    }
+    if (teleinfo_labels[id].type == TI_TYPE_INDEX) {
+      teleinfuse_rate_add(&(derived->rates[id]), data->number, now);
+    }
+    if (derived->series[id] && data->number >= INT32_MIN && data->number <= INT32_MAX) {
+      teleinfuse_series_add(derived->series[id], data->number, now);
+    }
+    if (id == teleinfuse_derived_pref) {
+      derived->pref = data->number;
+    } else if (id == teleinfuse_derived_sinsts && derived->pref > 0) {
+      // VA over kVA
+      derived->load = data->number / derived->pref;
+      derived->has_load = 1;
+    }
+  }
+  derived->generation++;
+  pthread_mutex_unlock( &teleinfuse_derived_mutex );
+}
+
+// Called with the lock held
+static int teleinfuse_derived_has (const teleinfuse_derived_meter * derived, int id, int kind)
+{
+  switch (kind) {
+    case TELEINFUSE_DERIVED_RATE:
+      return derived->rates[id].state == TELEINFUSE_RATE_VALID;
+    case TELEINFUSE_DERIVED_LOAD:
+      return id == teleinfuse_derived_sinsts && derived->has_load;
+    default:
+      return derived->series[id] != NULL;
+  }
+}
+
+int teleinfuse_derived_exists (int meter, int file)
+{
+  if (!teleinfuse_derived_meters || file < 0 || file >= TELEINFUSE_DERIVED_FILE_COUNT) {
+    return 0;
+  }
+  pthread_mutex_lock( &teleinfuse_derived_mutex );
+  int exists = teleinfuse_derived_has(&(teleinfuse_derived_meters[meter]),
+                                      file / TELEINFUSE_DERIVED_KIND_COUNT, file % TELEINFUSE_DERIVED_KIND_COUNT);
+  pthread_mutex_unlock( &teleinfuse_derived_mutex );
+  return exists;
+}
+
+unsigned long teleinfuse_derived_generation (int meter)
+{
+  pthread_mutex_lock( &teleinfuse_derived_mutex );
+  unsigned long generation = teleinfuse_derived_meters[meter].generation;
+  pthread_mutex_unlock( &teleinfuse_derived_mutex );
+  return generation;
+}
+
+void teleinfuse_derived_filename (int file, char name[TELEINFUSE_DERIVED_FILENAME_SIZE])
+{
+  snprintf(name, TELEINFUSE_DERIVED_FILENAME_SIZE, "%s.%s", teleinfo_labels[file / TELEINFUSE_DERIVED_KIND_COUNT].name,
+           teleinfuse_derived_suffixes[file % TELEINFUSE_DERIVED_KIND_COUNT]);
+}
+
+int teleinfuse_derived_find (const char * name)
+{
+  const char * dot = strchr(name, '.');
+  int id;
+
+  if (!dot || (id = teleinfo_label_find(name, dot - name)) == TI_LABEL_UNKNOWN) {
+    return -1;
+  }
+  for (int kind=0; kind<TELEINFUSE_DERIVED_KIND_COUNT; kind++) {
+    if (0==strcmp(dot + 1, teleinfuse_derived_suffixes[kind])) {
+      return TELEINFUSE_DERIVED_FILE(id, kind);
+    }
+  }
+  return -1;
+}
+
+// "-9223372036854775.808\n"
+#define TELEINFUSE_DERIVED_LENGTH_MAX 23
+
+char * teleinfuse_derived_render (int meter, int file, size_t * length)
+{
+  int id = file / TELEINFUSE_DERIVED_KIND_COUNT;
+  int kind = file % TELEINFUSE_DERIVED_KIND_COUNT;
+  char * text = malloc(TELEINFUSE_DERIVED_LENGTH_MAX + 1);
+
+  if (!text) {
+    return NULL;
+  }
+  pthread_mutex_lock( &teleinfuse_derived_mutex );
+  const teleinfuse_derived_meter * derived = &(teleinfuse_derived_meters[meter]);
+  if (!teleinfuse_derived_has(derived, id, kind)) {
+    *length = 0; // gone since the lookup
+  } else if (kind == TELEINFUSE_DERIVED_RATE) {
+    *length = sprintf(text, "%lld\n", (long long)derived->rates[id].rate);
+  } else if (kind == TELEINFUSE_DERIVED_LOAD) {
+    *length = sprintf(text, "%lld.%03lld\n", (long long)(derived->load / 1000), (long long)(derived->load % 1000));
+  } else {
+    const teleinfuse_series * series = derived->series[id];
+    const teleinfuse_window * window = &(series->windows[(kind - TELEINFUSE_DERIVED_AVG_1M) % TELEINFUSE_DERIVED_WINDOWS]);
+    int64_t value;
+    if (kind <= TELEINFUSE_DERIVED_AVG_15M) {
+      int64_t count = series->end - window->start;
+      value = (window->sum + (window->sum < 0 ? -count : count) / 2) / count;
+    } else if (kind <= TELEINFUSE_DERIVED_MIN_15M) {
+      value = series->samples[window->min[window->min_head % TELEINFUSE_DERIVED_SAMPLES]].value;
+    } else {
+      value = series->samples[window->max[window->max_head % TELEINFUSE_DERIVED_SAMPLES]].value;
+    }
+    *length = sprintf(text, "%lld\n", (long long)value);
+  }
+  pthread_mutex_unlock( &teleinfuse_derived_mutex );
+  return text;
+}
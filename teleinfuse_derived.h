@@ -0,0 +1,84 @@
+/*
+ * teleinfuse is a FUSE module to access to the Télé information of linky electric meter running in standard mode
+ * Télé info data are transmitted by french electric meters (EDF/ERDF)
+ * [FR] Permet de lire la téléinformation cliente (TIC) d'un compteur linky en mode standard.
+ * [FR] Pour le mode TIC historique, voir le projet original
+ *
+ * Based on https://github.com/neomilium/teleinfuse project by Romuald Conty
+ *
+ * Copyright (C) 2020 itineric
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _TELEINFUSE_DERIVED_H_
+#define _TELEINFUSE_DERIVED_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "teleinfo.h"
+
+#define TELEINFUSE_DERIVED_DIRNAME "derived"
+
+// What is derived from a label, file "LABEL.<suffix>"
+enum {
+  TELEINFUSE_DERIVED_RATE,    // energy index: power from the last two changes (W, VAr)
+  TELEINFUSE_DERIVED_LOAD,    // SINSTS: ratio to PREF
+  TELEINFUSE_DERIVED_AVG_1M,  // windowed labels: average, min and max
+  TELEINFUSE_DERIVED_AVG_5M,  // over the last 1, 5 and 15 minutes
+  TELEINFUSE_DERIVED_AVG_15M,
+  TELEINFUSE_DERIVED_MIN_1M,
+  TELEINFUSE_DERIVED_MIN_5M,
+  TELEINFUSE_DERIVED_MIN_15M,
+  TELEINFUSE_DERIVED_MAX_1M,
+  TELEINFUSE_DERIVED_MAX_5M,
+  TELEINFUSE_DERIVED_MAX_15M,
+  TELEINFUSE_DERIVED_KIND_COUNT,
+};
+
+// A derived file is a label id and a kind
+#define TELEINFUSE_DERIVED_FILE(ID, KIND) ((ID) * TELEINFUSE_DERIVED_KIND_COUNT + (KIND))
+#define TELEINFUSE_DERIVED_FILE_COUNT (TI_LABEL_COUNT * TELEINFUSE_DERIVED_KIND_COUNT)
+// "LABEL.avg_15m" and a NUL
+#define TELEINFUSE_DERIVED_FILENAME_SIZE (TI_LABEL_LENGTH_MAX + 9)
+
+// Values derived from each published frame, with a constant work per frame:
+// running sums and monotonic deques over a ring of samples per windowed label.
+// meters: number of meters (meter arguments below are 0 to meters - 1)
+// enabled: 0 disables derived values
+// labels: labels with windowed values, separated by ':' (NULL for SINSTS)
+void teleinfuse_derived_init (size_t meters, int enabled, const char * labels);
+void teleinfuse_derived_destroy (void);
+
+int teleinfuse_derived_enabled (void);
+
+// Adds the values of a frame received at now (monotonic ms)
+void teleinfuse_derived_update (int meter, const teleinfo_frame * frame, int64_t now);
+
+// returns 1 if the file has a value
+int teleinfuse_derived_exists (int meter, int file);
+
+// Number of frames added to the meter (changes with each frame)
+unsigned long teleinfuse_derived_generation (int meter);
+
+void teleinfuse_derived_filename (int file, char name[TELEINFUSE_DERIVED_FILENAME_SIZE]);
+
+// returns the file of a name or -1
+int teleinfuse_derived_find (const char * name);
+
+// Renders the value followed by a LF, returns a malloc'ed buffer or NULL
+char * teleinfuse_derived_render (int meter, int file, size_t * length);
+
+#endif
@@ -0,0 +1,177 @@
+/*
+ * teleinfuse is a FUSE module to access to the Télé information of linky electric meter running in standard mode
+ * Télé info data are transmitted by french electric meters (EDF/ERDF)
+ * [FR] Permet de lire la téléinformation cliente (TIC) d'un compteur linky en mode standard.
+ * [FR] Pour le mode TIC historique, voir le projet original
+ *
+ * Based on https://github.com/neomilium/teleinfuse project by Romuald Conty
+ *
+ * Copyright (C) 2020 itineric
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "teleinfuse_history.h"
+#include "teleinfo.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <syslog.h>
+
+// 8 bytes per sample: an hour of one second samples takes 28 KB per label
+typedef struct {
+  uint32_t time;
+  int32_t value;
+} teleinfuse_sample;
+
+typedef struct {
+  teleinfuse_sample * samples; // NULL until the label gets a numeric value
+  size_t head;                 // next sample to write
+  size_t count;
+  unsigned long generation;
+} teleinfuse_ring;
+
+static pthread_mutex_t teleinfuse_history_mutex = PTHREAD_MUTEX_INITIALIZER;
+static teleinfuse_ring * teleinfuse_rings = NULL; // TI_LABEL_COUNT per meter
+static size_t teleinfuse_history_meters = 0;
+static unsigned char teleinfuse_history_wanted[TI_LABEL_COUNT];
+static size_t teleinfuse_history_capacity = 0;
+
+void teleinfuse_history_init (size_t meters, size_t capacity, const char * labels)
+{
+  if (capacity && !(teleinfuse_rings = calloc(meters * TI_LABEL_COUNT, sizeof(teleinfuse_ring)))) {
+    syslog(LOG_ERR, "history: unable to allocate rings, history disabled");
+    capacity = 0;
+  }
+  teleinfuse_history_meters = meters;
+  teleinfuse_history_capacity = capacity;
+  memset(teleinfuse_history_wanted, labels ? 0 : 1, sizeof(teleinfuse_history_wanted));
+  while (labels && *labels) {
+    const char * end = strchr(labels, ':');
+    size_t length = end ? (size_t)(end - labels) : strlen(labels);
+    int id = teleinfo_label_find(labels, length);
+    if (id != TI_LABEL_UNKNOWN) {
+      teleinfuse_history_wanted[id] = 1;
+    } else {
+      syslog(LOG_ERR, "history: unknown label \"%.*s\"", (int)length, labels);
+    }
+    labels += length;
+    if (*labels) {
+      labels++;
+    }
+  }
+}
+
+void teleinfuse_history_destroy (void)
+{
+  if (!teleinfuse_rings) {
+    return;
+  }
+  for (size_t n=0; n<teleinfuse_history_meters * TI_LABEL_COUNT; n++) {
+    free(teleinfuse_rings[n].samples);
+  }
+  free(teleinfuse_rings);
+  teleinfuse_rings = NULL;
+}
+
+int teleinfuse_history_enabled (void)
+{
+  return teleinfuse_history_capacity > 0;
+}
+
+void teleinfuse_history_add (int meter, int id, int64_t value, time_t time)
+{
+  if (!teleinfuse_history_capacity || id == TI_LABEL_UNKNOWN || !teleinfuse_history_wanted[id]) {
+    return;
+  }
+  if (value < INT32_MIN || value > INT32_MAX) {
+    return;
+  }
+
+  teleinfuse_ring * ring = &(teleinfuse_rings[meter * TI_LABEL_COUNT + id]);
+  if (!ring->samples) {
+    teleinfuse_sample * samples = malloc(teleinfuse_history_capacity * sizeof(teleinfuse_sample));
+    if (!samples) {
+      syslog(LOG_ERR, "history: unable to allocate %zu samples for %s", teleinfuse_history_capacity, teleinfo_labels[id].name);
+      teleinfuse_history_wanted[id] = 0;
+      return;
+    }
+    pthread_mutex_lock( &teleinfuse_history_mutex );
+    ring->samples = samples;
+    pthread_mutex_unlock( &teleinfuse_history_mutex );
+  }
+
+  pthread_mutex_lock( &teleinfuse_history_mutex );
+  ring->samples[ring->head].time = time;
+  ring->samples[ring->head].value = value;
+  ring->head = (ring->head + 1) % teleinfuse_history_capacity;
+  if (ring->count < teleinfuse_history_capacity) {
+    ring->count++;
+  }
+  ring->generation++;
+  pthread_mutex_unlock( &teleinfuse_history_mutex );
+}
+
+int teleinfuse_history_exists (int meter, int id)
+{
+  if (!teleinfuse_history_capacity) {
+    return 0;
+  }
+  pthread_mutex_lock( &teleinfuse_history_mutex );
+  int exists = (teleinfuse_rings[meter * TI_LABEL_COUNT + id].samples != NULL);
+  pthread_mutex_unlock( &teleinfuse_history_mutex );
+  return exists;
+}
+
+unsigned long teleinfuse_history_generation (int meter, int id)
+{
+  pthread_mutex_lock( &teleinfuse_history_mutex );
+  unsigned long generation = teleinfuse_rings[meter * TI_LABEL_COUNT + id].generation;
+  pthread_mutex_unlock( &teleinfuse_history_mutex );
+  return generation;
+}
+
+// "4294967295 -2147483648\n"
+#define TELEINFUSE_SAMPLE_LENGTH_MAX 23
+
+char * teleinfuse_history_render (int meter, int id, size_t * length)
+{
+  teleinfuse_ring * ring = &(teleinfuse_rings[meter * TI_LABEL_COUNT + id]);
+  char * text = NULL;
+
+  pthread_mutex_lock( &teleinfuse_history_mutex );
+  size_t count = ring->count;
+  // Samples are copied under the lock, formatted once it has been released
+  teleinfuse_sample * samples = malloc((count ? count : 1) * sizeof(teleinfuse_sample));
+  if (samples) {
+    size_t first = (ring->head + teleinfuse_history_capacity - count) % teleinfuse_history_capacity;
+    for (size_t n=0; n<count; n++) {
+      samples[n] = ring->samples[(first + n) % teleinfuse_history_capacity];
+    }
+  }
+  pthread_mutex_unlock( &teleinfuse_history_mutex );
+
+  if (samples && (text = malloc(count * TELEINFUSE_SAMPLE_LENGTH_MAX + 1))) {
+    char * p = text;
+    for (size_t n=0; n<count; n++) {
+      p += sprintf(p, "%lu %ld\n", (unsigned long)samples[n].time, (long)samples[n].value);
+    }
+    *length = p - text;
+  }
+  free(samples);
+  return text;
+}
@@ -0,0 +1,56 @@
+/*
+ * teleinfuse is a FUSE module to access to the Télé information of linky electric meter running in standard mode
+ * Télé info data are transmitted by french electric meters (EDF/ERDF)
+ * [FR] Permet de lire la téléinformation cliente (TIC) d'un compteur linky en mode standard.
+ * [FR] Pour le mode TIC historique, voir le projet original
+ *
+ * Based on https://github.com/neomilium/teleinfuse project by Romuald Conty
+ *
+ * Copyright (C) 2020 itineric
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _TELEINFUSE_HISTORY_H_
+#define _TELEINFUSE_HISTORY_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#define TELEINFUSE_HISTORY_DIRNAME "history"
+
+// Bounded history of the numeric labels: a ring of (time, value) samples per
+// label of each meter, allocated the first time the label gets a value.
+// meters: number of meters (meter arguments below are 0 to meters - 1)
+// capacity: samples per label (0 disables history)
+// labels: labels to keep, separated by ':' (NULL for every numeric label)
+void teleinfuse_history_init (size_t meters, size_t capacity, const char * labels);
+void teleinfuse_history_destroy (void);
+
+int teleinfuse_history_enabled (void);
+
+// Adds a sample (value parsed by the decoder), ignored if it does not fit 32 bits
+void teleinfuse_history_add (int meter, int id, int64_t value, time_t time);
+
+// returns 1 if a ring exists for the label
+int teleinfuse_history_exists (int meter, int id);
+
+// Number of samples ever added to the label (changes with each sample)
+unsigned long teleinfuse_history_generation (int meter, int id);
+
+// Renders the samples as "time value" lines, returns a malloc'ed buffer or NULL
+char * teleinfuse_history_render (int meter, int id, size_t * length);
+
+#endif
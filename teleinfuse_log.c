@@ -0,0 +1,1036 @@
+/*
+ * teleinfuse is a FUSE module to access to the Télé information of linky electric meter running in standard mode
+ * Télé info data are transmitted by french electric meters (EDF/ERDF)
+ * [FR] Permet de lire la téléinformation cliente (TIC) d'un compteur linky en mode standard.
+ * [FR] Pour le mode TIC historique, voir le projet original
+ *
+ * Based on https://github.com/neomilium/teleinfuse project by Romuald Conty
+ *
+ * Copyright (C) 2020 itineric
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "teleinfuse_log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+// Segment file (fixed size fields in host byte order):
+//   header: "TLOG", version, time of the first record (ms since epoch)
+//   records: varint count << 1 | keyframe, then the time as a zigzag varint
+//     (ms since epoch in a keyframe, delta from the previous record otherwise),
+//     then count messages: varint id << 3 | width << 2 | numeric << 1 | datetime,
+//     datetime: zigzag varint delta of the packed datetime,
+//     numeric: [varint width if it changed] zigzag varint delta of the number,
+//     text: varint length and chars.
+//     Deltas are from the value of the label in the previous records, from 0
+//     in a keyframe. Labels out of the specification are not kept.
+//   footer (closed segment): the keyframes (time, offset), then a trailer.
+#define TELEINFUSE_LOG_MAGIC   "TLOG"
+#define TELEINFUSE_LOG_VERSION 1
+#define TELEINFUSE_LOG_END     "TLOGEND\n"
+#define TELEINFUSE_LOG_SUFFIX  ".tlog"
+
+// About 6 minutes of frames: what a day read decodes before its first frame
+#define TELEINFUSE_LOG_KEYFRAME_RECORDS 256
+
+typedef struct {
+  char magic[4];
+  uint32_t version;
+  int64_t first;
+} teleinfuse_log_header;
+
+typedef struct {
+  int64_t time;
+  uint64_t offset;
+} teleinfuse_log_keyframe;
+
+typedef struct {
+  int64_t last;   // time of the last record
+  uint64_t count; // keyframes in the index before the trailer
+  char magic[8];
+} teleinfuse_log_trailer;
+
+// Varints of a record: count and time, then for each message header, datetime, width and value
+#define TELEINFUSE_LOG_RECORD_MAX (2 * 10 + TI_MESSAGE_COUNT_MAX * (2 + 10 + 2 + 2 + TI_VALUE_LENGTH_MAX))
+
+// Value of a label as of the last record, written or read
+typedef struct {
+  int64_t number;
+  uint64_t datetime;
+  unsigned char width;  // chars of a numeric value (leading zeros)
+  unsigned char length; // chars of a text value
+  char present;
+  char numeric;
+  char text[TI_VALUE_LENGTH_MAX + 1];
+} teleinfuse_log_value;
+
+typedef struct {
+  int64_t id;     // file name
+  int64_t first;  // ms
+  int64_t last;
+  size_t end;     // end of the records
+  char open;      // being written, its index is in memory
+} teleinfuse_segment;
+
+typedef struct {
+  const char * name;
+  teleinfuse_segment * segments; // by time
+  size_t segment_count;
+  size_t segment_capacity;
+  // Segment being written, the last one of segments
+  int fd;                        // -1 if none
+  size_t length;
+  teleinfuse_log_keyframe * index;
+  size_t index_count;
+  size_t index_capacity;
+  unsigned int records;          // since the last keyframe
+  int keyframe;                  // next record must be a keyframe
+  int failing;                   // last write failed (logged once)
+  int64_t time;                  // of the last record
+  teleinfuse_log_value values[TI_LABEL_COUNT];
+  unsigned long generation;
+} teleinfuse_log_meter;
+
+// Segment lists and indexes are changed by the reader thread under the lock,
+// file contents are only appended
+static pthread_mutex_t teleinfuse_log_mutex = PTHREAD_MUTEX_INITIALIZER;
+static teleinfuse_log_meter * teleinfuse_logs = NULL;
+static size_t teleinfuse_log_count = 0;
+static char * teleinfuse_log_dir = NULL;
+static size_t teleinfuse_log_segment_size = 0;
+
+static unsigned char * teleinfuse_log_varint (unsigned char * p, uint64_t n)
+{
+  while (n >= 0x80) {
+    *p++ = n | 0x80;
+    n >>= 7;
+  }
+  *p++ = n;
+  return p;
+}
+
+static uint64_t teleinfuse_log_zigzag (int64_t n)
+{
+  return ((uint64_t)n << 1) ^ (uint64_t)(n >> 63);
+}
+
+static int64_t teleinfuse_log_unzigzag (uint64_t n)
+{
+  return (int64_t)(n >> 1) ^ -(int64_t)(n & 1);
+}
+
+// returns 0 if succeed otherwise -1 (past end)
+static int teleinfuse_log_read_varint (const unsigned char ** p, const unsigned char * end, uint64_t * n)
+{
+  uint64_t value = 0;
+
+  for (int shift=0; shift<64 && *p < end; shift+=7) {
+    unsigned char c = *(*p)++;
+    value |= (uint64_t)(c & 0x7f) << shift;
+    if (!(c & 0x80)) {
+      *n = value;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+// Encodes the messages of frame that changed from values, then updates values
+// returns the end of the messages
+static unsigned char * teleinfuse_log_encode (unsigned char * p, teleinfuse_log_value * values, const teleinfo_frame * frame, size_t * count)
+{
+  for (size_t n=0; n<frame->datasetlen; n++) {
+    const teleinfo_data * data = &(frame->dataset[n]);
+    const char * text = TI_VALUE(frame, data);
+    if (data->id == TI_LABEL_UNKNOWN) {
+      continue;
+    }
+    teleinfuse_log_value * value = &(values[data->id]);
+    int numeric = data->numeric;
+    int width = numeric && (!value->numeric || value->width != data->value_length);
+    int datetime = value->datetime != data->datetime;
+    if (value->present && value->numeric == numeric && !width && !datetime
+        && (numeric ? value->number == data->number
+                    : value->length == data->value_length && !memcmp(value->text, text, data->value_length))) {
+      continue;
+    }
+
+    p = teleinfuse_log_varint(p, ((uint64_t)data->id << 3) | (width << 2) | (numeric << 1) | datetime);
+    if (datetime) {
+      p = teleinfuse_log_varint(p, teleinfuse_log_zigzag(data->datetime - value->datetime));
+      value->datetime = data->datetime;
+    }
+    if (numeric) {
+      if (width) {
+        p = teleinfuse_log_varint(p, data->value_length);
+        value->width = data->value_length;
+      }
+      p = teleinfuse_log_varint(p, teleinfuse_log_zigzag(data->number - (value->numeric ? value->number : 0)));
+      value->number = data->number;
+    } else {
+      p = teleinfuse_log_varint(p, data->value_length);
+      memcpy(p, text, data->value_length);
+      p += data->value_length;
+      memcpy(value->text, text, data->value_length);
+      value->length = data->value_length;
+    }
+    value->numeric = numeric;
+    value->present = 1;
+    (*count)++;
+  }
+  return p;
+}
+
+// Reads the record at *p into values and *time (time of the previous record)
+// returns 0 if succeed otherwise -1 (damaged or incomplete record)
+static int teleinfuse_log_decode (const unsigned char ** p, const unsigned char * end, teleinfuse_log_value * values, int64_t * time, int * keyframe)
+{
+  uint64_t head, n;
+
+  if (teleinfuse_log_read_varint(p, end, &head) || teleinfuse_log_read_varint(p, end, &n)) {
+    return -1;
+  }
+  *keyframe = head & 1;
+  if (*keyframe) {
+    memset(values, 0, TI_LABEL_COUNT * sizeof(teleinfuse_log_value));
+    *time = teleinfuse_log_unzigzag(n);
+  } else {
+    *time += teleinfuse_log_unzigzag(n);
+  }
+  for (uint64_t count = head >> 1; count; count--) {
+    uint64_t message;
+    if (teleinfuse_log_read_varint(p, end, &message) || (message >> 3) >= TI_LABEL_COUNT) {
+      return -1;
+    }
+    teleinfuse_log_value * value = &(values[message >> 3]);
+    int numeric = (message >> 1) & 1;
+    if (message & 1) {
+      if (teleinfuse_log_read_varint(p, end, &n)) {
+        return -1;
+      }
+      value->datetime += teleinfuse_log_unzigzag(n);
+    }
+    if (numeric) {
+      if (message & 4) {
+        if (teleinfuse_log_read_varint(p, end, &n) || n > TI_VALUE_LENGTH_MAX) {
+          return -1;
+        }
+        value->width = n;
+      }
+      if (teleinfuse_log_read_varint(p, end, &n)) {
+        return -1;
+      }
+      value->number = (value->numeric ? value->number : 0) + teleinfuse_log_unzigzag(n);
+    } else {
+      if (teleinfuse_log_read_varint(p, end, &n) || n > TI_VALUE_LENGTH_MAX || n > end - *p) {
+        return -1;
+      }
+      memcpy(value->text, *p, n);
+      value->text[n] = '\0';
+      value->length = n;
+      *p += n;
+    }
+    value->numeric = numeric;
+    value->present = 1;
+  }
+  return 0;
+}
+
+static void teleinfuse_log_path (const teleinfuse_log_meter * log, int64_t id, char path[PATH_MAX])
+{
+  snprintf(path, PATH_MAX, "%s/%s-%lld" TELEINFUSE_LOG_SUFFIX, teleinfuse_log_dir, log->name, (long long)id);
+}
+
+// Index of a mapped segment
+// returns the end of the records if the segment has a footer otherwise 0
+static size_t teleinfuse_log_footer (const unsigned char * data, size_t size, size_t * index, size_t * count, int64_t * last)
+{
+  teleinfuse_log_trailer trailer;
+
+  if (size < sizeof(teleinfuse_log_header) + sizeof(trailer)) {
+    return 0;
+  }
+  memcpy(&trailer, data + size - sizeof(trailer), sizeof(trailer));
+  size -= sizeof(trailer);
+  if (memcmp(trailer.magic, TELEINFUSE_LOG_END, sizeof(trailer.magic))
+      || trailer.count > (size - sizeof(teleinfuse_log_header)) / sizeof(teleinfuse_log_keyframe)) {
+    return 0;
+  }
+  *count = trailer.count;
+  *index = size - trailer.count * sizeof(teleinfuse_log_keyframe);
+  *last = trailer.last;
+  return *index;
+}
+
+// Writes the footer of the segment being written and closes it
+static void teleinfuse_log_close (teleinfuse_log_meter * log)
+{
+  teleinfuse_segment * segment = &(log->segments[log->segment_count - 1]);
+  teleinfuse_log_trailer trailer = { segment->last, log->index_count, TELEINFUSE_LOG_END };
+  struct iovec iov[2] = {
+    { log->index, log->index_count * sizeof(teleinfuse_log_keyframe) },
+    { &trailer, sizeof(trailer) },
+  };
+
+  if (writev(log->fd, iov, 2) != iov[0].iov_len + iov[1].iov_len) {
+    // Read without index, repaired at next start
+    syslog(LOG_ERR, "log: unable to write the index of %s: %s", log->name, strerror(errno));
+  }
+  close(log->fd);
+  log->fd = -1;
+  pthread_mutex_lock( &teleinfuse_log_mutex );
+  segment->open = 0;
+  log->index_count = 0;
+  pthread_mutex_unlock( &teleinfuse_log_mutex );
+}
+
+// Adds a segment to the list, under the lock
+// returns 0 if succeed otherwise -1
+static int teleinfuse_log_segment_add (teleinfuse_log_meter * log, const teleinfuse_segment * segment)
+{
+  if (log->segment_count == log->segment_capacity) {
+    size_t capacity = log->segment_capacity ? log->segment_capacity * 2 : 16;
+    teleinfuse_segment * segments = realloc(log->segments, capacity * sizeof(teleinfuse_segment));
+    if (!segments) {
+      return -1;
+    }
+    log->segments = segments;
+    log->segment_capacity = capacity;
+  }
+  log->segments[log->segment_count++] = *segment;
+  return 0;
+}
+
+void teleinfuse_log_add (int meter, const teleinfo_frame * frame, const struct timespec * time)
+{
+  static unsigned char record[TELEINFUSE_LOG_RECORD_MAX];
+  static unsigned char messages[TELEINFUSE_LOG_RECORD_MAX];
+  char path[PATH_MAX];
+  int64_t now = (int64_t)time->tv_sec * 1000 + time->tv_nsec / 1000000;
+
+  if (!teleinfuse_logs) {
+    return;
+  }
+  teleinfuse_log_meter * log = &(teleinfuse_logs[meter]);
+  if (log->fd != -1 && log->length >= teleinfuse_log_segment_size) {
+    teleinfuse_log_close(log);
+  }
+  int fresh = (log->fd == -1);
+  int64_t id = now;
+  if (fresh) {
+    // A new segment is only listed once its first record has been written
+    do {
+      teleinfuse_log_path(log, id++, path);
+      log->fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    } while (log->fd == -1 && errno == EEXIST);
+    id--;
+    if (log->fd == -1) {
+      if (!log->failing) {
+        syslog(LOG_ERR, "log: unable to create \"%s\": %s", path, strerror(errno));
+        log->failing = 1;
+      }
+      return;
+    }
+    log->length = 0;
+    log->keyframe = 1;
+  }
+
+  int keyframe = log->keyframe || log->records >= TELEINFUSE_LOG_KEYFRAME_RECORDS;
+  size_t count = 0;
+  if (keyframe) {
+    memset(log->values, 0, sizeof(log->values));
+  }
+  unsigned char * end = teleinfuse_log_encode(messages, log->values, frame, &count);
+  unsigned char * p = teleinfuse_log_varint(record, (count << 1) | keyframe);
+  p = teleinfuse_log_varint(p, teleinfuse_log_zigzag(keyframe ? now : now - log->time));
+
+  teleinfuse_log_header header = { TELEINFUSE_LOG_MAGIC, TELEINFUSE_LOG_VERSION, now };
+  struct iovec iov[3] = {
+    { &header, fresh ? sizeof(header) : 0 },
+    { record, p - record },
+    { messages, end - messages },
+  };
+  size_t length = iov[0].iov_len + iov[1].iov_len + iov[2].iov_len;
+  if (writev(log->fd, iov, 3) != length) {
+    if (!log->failing) {
+      syslog(LOG_ERR, "log: unable to write the log of %s: %s", log->name, strerror(errno));
+      log->failing = 1;
+    }
+    if (fresh) {
+      close(log->fd);
+      log->fd = -1;
+      unlink(path);
+    } else if (ftruncate(log->fd, log->length) || lseek(log->fd, log->length, SEEK_SET) == -1) {
+      teleinfuse_log_close(log);
+    }
+    // Values have been changed as if the record had been written
+    log->keyframe = 1;
+    return;
+  }
+  size_t offset = log->length + iov[0].iov_len;
+  log->length += length;
+  log->records = keyframe ? 1 : log->records + 1;
+  log->keyframe = 0;
+  log->failing = 0;
+  log->time = now;
+
+  pthread_mutex_lock( &teleinfuse_log_mutex );
+  if (fresh) {
+    teleinfuse_segment segment = { id, now, now, log->length, 1 };
+    if (teleinfuse_log_segment_add(log, &segment)) {
+      pthread_mutex_unlock( &teleinfuse_log_mutex );
+      syslog(LOG_ERR, "log: unable to allocate the segments of %s", log->name);
+      close(log->fd);
+      log->fd = -1;
+      unlink(path);
+      return;
+    }
+  }
+  teleinfuse_segment * segment = &(log->segments[log->segment_count - 1]);
+  segment->end = log->length;
+  segment->last = now;
+  if (keyframe) {
+    if (log->index_count == log->index_capacity) {
+      size_t capacity = log->index_capacity ? log->index_capacity * 2 : 64;
+      teleinfuse_log_keyframe * index = realloc(log->index, capacity * sizeof(teleinfuse_log_keyframe));
+      if (index) {
+        log->index = index;
+        log->index_capacity = capacity;
+      }
+    }
+    // A keyframe missing from the index only makes reads start earlier
+    if (log->index_count < log->index_capacity) {
+      log->index[log->index_count].time = now;
+      log->index[log->index_count].offset = offset;
+      log->index_count++;
+    }
+  }
+  log->generation++;
+  pthread_mutex_unlock( &teleinfuse_log_mutex );
+}
+
+// Segment of a previous run: checks its footer, or rebuilds it from the records
+// returns 0 if the segment can be listed otherwise -1
+static int teleinfuse_log_load (const char * path, teleinfuse_segment * segment)
+{
+  teleinfuse_log_header header;
+  struct stat st;
+  int fd = open(path, O_RDWR | O_CLOEXEC);
+  int res = -1;
+
+  if (fd == -1) {
+    syslog(LOG_ERR, "log: unable to open \"%s\": %s", path, strerror(errno));
+    return -1;
+  }
+  if (fstat(fd, &st) || st.st_size < sizeof(header)) {
+    // Nothing written but the start of the header
+    close(fd);
+    unlink(path);
+    return -1;
+  }
+  unsigned char * data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (data == MAP_FAILED) {
+    syslog(LOG_ERR, "log: unable to map \"%s\": %s", path, strerror(errno));
+    close(fd);
+    return -1;
+  }
+  memcpy(&header, data, sizeof(header));
+  if (memcmp(header.magic, TELEINFUSE_LOG_MAGIC, sizeof(header.magic)) || header.version != TELEINFUSE_LOG_VERSION) {
+    syslog(LOG_ERR, "log: \"%s\" is not a log segment, ignored", path);
+  } else {
+    size_t index, count;
+    segment->first = header.first;
+    if ( (segment->end = teleinfuse_log_footer(data, st.st_size, &index, &count, &(segment->last))) ) {
+      res = 0;
+    } else {
+      // Killed while writing: keeps the whole records and writes the index
+      static teleinfuse_log_value values[TI_LABEL_COUNT];
+      teleinfuse_log_keyframe * keyframes = NULL;
+      size_t keyframe_count = 0;
+      const unsigned char * p = data + sizeof(header);
+      int64_t time = header.first;
+      int keyframe;
+      segment->end = sizeof(header);
+      segment->last = header.first;
+      while (!teleinfuse_log_decode(&p, data + st.st_size, values, &time, &keyframe)) {
+        if (keyframe && (keyframe_count & 63) == 0) {
+          teleinfuse_log_keyframe * grown = realloc(keyframes, (keyframe_count + 64) * sizeof(teleinfuse_log_keyframe));
+          if (!grown) {
+            break;
+          }
+          keyframes = grown;
+        }
+        if (keyframe) {
+          keyframes[keyframe_count].time = time;
+          keyframes[keyframe_count].offset = segment->end;
+          keyframe_count++;
+        }
+        segment->end = p - data;
+        segment->last = time;
+      }
+      teleinfuse_log_trailer trailer = { segment->last, keyframe_count, TELEINFUSE_LOG_END };
+      struct iovec iov[2] = {
+        { keyframes, keyframe_count * sizeof(teleinfuse_log_keyframe) },
+        { &trailer, sizeof(trailer) },
+      };
+      if (segment->end == sizeof(header)) {
+        unlink(path);
+      } else if (ftruncate(fd, segment->end) || lseek(fd, segment->end, SEEK_SET) == -1
+                 || writev(fd, iov, 2) != iov[0].iov_len + iov[1].iov_len) {
+        syslog(LOG_ERR, "log: unable to repair \"%s\": %s", path, strerror(errno));
+      } else {
+        syslog(LOG_INFO, "log: \"%s\" repaired", path);
+        res = 0;
+      }
+      free(keyframes);
+    }
+  }
+  munmap(data, st.st_size);
+  close(fd);
+  return res;
+}
+
+static int teleinfuse_log_compare (const void * a, const void * b)
+{
+  const teleinfuse_segment * x = a, * y = b;
+  return (x->id > y->id) - (x->id < y->id);
+}
+
+void teleinfuse_log_init (const char * dir, size_t segment_size, size_t meters, const char * const names[])
+{
+  char path[PATH_MAX];
+  DIR * d;
+  struct dirent * entry;
+
+  if (!dir) {
+    return;
+  }
+  if (mkdir(dir, 0755) && errno != EEXIST) {
+    syslog(LOG_ERR, "log: unable to create \"%s\": %s, log disabled", dir, strerror(errno));
+    return;
+  }
+  if (!(d = opendir(dir))) {
+    syslog(LOG_ERR, "log: unable to read \"%s\": %s, log disabled", dir, strerror(errno));
+    return;
+  }
+  if (!(teleinfuse_logs = calloc(meters, sizeof(teleinfuse_log_meter))) || !(teleinfuse_log_dir = strdup(dir))) {
+    syslog(LOG_ERR, "log: unable to allocate meters, log disabled");
+    free(teleinfuse_logs);
+    teleinfuse_logs = NULL;
+    closedir(d);
+    return;
+  }
+  teleinfuse_log_count = meters;
+  teleinfuse_log_segment_size = segment_size;
+  for (size_t n=0; n<meters; n++) {
+    teleinfuse_logs[n].name = names[n];
+    teleinfuse_logs[n].fd = -1;
+  }
+
+  // "<meter>-<id>.tlog"
+  while ((entry = readdir(d))) {
+    for (size_t n=0; n<meters; n++) {
+      teleinfuse_log_meter * log = &(teleinfuse_logs[n]);
+      size_t length = strlen(log->name);
+      char * end;
+      if (strncmp(entry->d_name, log->name, length) || entry->d_name[length] != '-'
+          || entry->d_name[length + 1] < '0' || entry->d_name[length + 1] > '9') {
+        continue;
+      }
+      teleinfuse_segment segment = { strtoll(entry->d_name + length + 1, &end, 10), 0, 0, 0, 0 };
+      if (strcmp(end, TELEINFUSE_LOG_SUFFIX)) {
+        continue;
+      }
+      teleinfuse_log_path(log, segment.id, path);
+      if (!teleinfuse_log_load(path, &segment) && teleinfuse_log_segment_add(log, &segment)) {
+        syslog(LOG_ERR, "log: unable to allocate the segments of %s", log->name);
+      }
+    }
+  }
+  closedir(d);
+  for (size_t n=0; n<meters; n++) {
+    if (teleinfuse_logs[n].segment_count) {
+      qsort(teleinfuse_logs[n].segments, teleinfuse_logs[n].segment_count, sizeof(teleinfuse_segment), teleinfuse_log_compare);
+    }
+  }
+}
+
+void teleinfuse_log_destroy (void)
+{
+  for (size_t n=0; n<teleinfuse_log_count; n++) {
+    if (teleinfuse_logs[n].fd != -1) {
+      teleinfuse_log_close(&(teleinfuse_logs[n]));
+    }
+    free(teleinfuse_logs[n].segments);
+    free(teleinfuse_logs[n].index);
+  }
+  free(teleinfuse_logs);
+  free(teleinfuse_log_dir);
+  teleinfuse_logs = NULL;
+  teleinfuse_log_dir = NULL;
+  teleinfuse_log_count = 0;
+}
+
+int teleinfuse_log_enabled (void)
+{
+  return teleinfuse_logs != NULL;
+}
+
+// Day of a time (ms), in local time
+static int teleinfuse_log_day (int64_t time)
+{
+  time_t t = time / 1000;
+  struct tm tm;
+
+  localtime_r(&t, &tm);
+  tm.tm_hour = tm.tm_min = tm.tm_sec = 0;
+  return timegm(&tm) / 86400;
+}
+
+// Local midnight of a day (ms)
+static int64_t teleinfuse_log_day_start (int day)
+{
+  time_t t = (time_t)day * 86400;
+  struct tm tm;
+
+  gmtime_r(&t, &tm);
+  tm.tm_isdst = -1;
+  return (int64_t)mktime(&tm) * 1000;
+}
+
+int teleinfuse_log_days (int meter, int * first, int * last)
+{
+  int res = 0;
+
+  pthread_mutex_lock( &teleinfuse_log_mutex );
+  teleinfuse_log_meter * log = &(teleinfuse_logs[meter]);
+  if (log->segment_count) {
+    *first = teleinfuse_log_day(log->segments[0].first);
+    *last = teleinfuse_log_day(log->segments[log->segment_count - 1].last);
+    res = 1;
+  }
+  pthread_mutex_unlock( &teleinfuse_log_mutex );
+  return res;
+}
+
+int teleinfuse_log_day_exists (int meter, int day)
+{
+  int64_t start = teleinfuse_log_day_start(day);
+  int64_t end = teleinfuse_log_day_start(day + 1);
+  int exists = 0;
+
+  if (!teleinfuse_logs) {
+    return 0;
+  }
+  pthread_mutex_lock( &teleinfuse_log_mutex );
+  teleinfuse_log_meter * log = &(teleinfuse_logs[meter]);
+  for (size_t n=0; n<log->segment_count && !exists; n++) {
+    exists = (log->segments[n].first < end && log->segments[n].last >= start);
+  }
+  pthread_mutex_unlock( &teleinfuse_log_mutex );
+  return exists;
+}
+
+void teleinfuse_log_dayname (int day, char name[TELEINFUSE_LOG_DAYNAME_SIZE])
+{
+  time_t t = (time_t)day * 86400;
+  struct tm tm;
+
+  gmtime_r(&t, &tm);
+  strftime(name, TELEINFUSE_LOG_DAYNAME_SIZE, "%Y-%m-%d", &tm);
+}
+
+int teleinfuse_log_day_find (const char * name)
+{
+  char check[TELEINFUSE_LOG_DAYNAME_SIZE];
+  struct tm tm;
+
+  memset(&tm, 0, sizeof(tm));
+  if (strlen(name) != TELEINFUSE_LOG_DAYNAME_SIZE - 1
+      || sscanf(name, "%4d-%2d-%2d", &(tm.tm_year), &(tm.tm_mon), &(tm.tm_mday)) != 3) {
+    return -1;
+  }
+  tm.tm_year -= 1900;
+  tm.tm_mon--;
+  time_t t = timegm(&tm);
+  if (t < 0) {
+    return -1;
+  }
+  // Only the name of the day itself ("2020-02-30" is another name of March 1st)
+  teleinfuse_log_dayname(t / 86400, check);
+  return strcmp(check, name) ? -1 : t / 86400;
+}
+
+unsigned long teleinfuse_log_generation (int meter)
+{
+  pthread_mutex_lock( &teleinfuse_log_mutex );
+  unsigned long generation = teleinfuse_logs[meter].generation;
+  pthread_mutex_unlock( &teleinfuse_log_mutex );
+  return generation;
+}
+
+// Longest line: time, then every label with its longest value and datetime
+#define TELEINFUSE_LOG_LINE_MAX (24 + TI_LABEL_COUNT * (3 + 2 * TI_LABEL_LENGTH_MAX + TI_VALUE_LENGTH_MAX \
+                                 + sizeof(DATETIME_FILENAME_SUFFIX) + TI_DATETIME_LENGTH) + 1)
+
+// Where the text of a keyframe line begins: its line holds every value, the
+// text from there does not depend on the lines before
+typedef struct {
+  uint64_t text;    // offset in the text of the day
+  size_t segment;   // in the segments of the cursor
+  uint64_t record;  // offset in the segment
+} teleinfuse_log_checkpoint;
+
+// A reader of a day: lines are decoded from the mapped segments as they are
+// read, a handle never holds more than the line being read
+struct teleinfuse_log_cursor {
+  int meter;
+  int64_t start;                 // of the day (ms)
+  int64_t end;
+  teleinfuse_segment * segments; // of the day, as they were at open
+  size_t segment_count;
+  uint64_t first_record;         // of the first segment: last keyframe before start
+  // Position
+  size_t segment;                // being decoded (segment_count at the end)
+  unsigned char * data;          // mapping of segment, MAP_FAILED if none
+  size_t size;
+  size_t records;                // end of the records in data
+  uint64_t record;               // next record
+  int64_t time;                  // of the last record
+  unsigned long lines;           // lines produced
+  uint64_t offset;               // text read
+  teleinfuse_log_checkpoint * checkpoints; // by text offset
+  size_t checkpoint_count;
+  size_t checkpoint_capacity;
+  teleinfuse_log_value values[TI_LABEL_COUNT]; // decoded
+  teleinfuse_log_value shown[TI_LABEL_COUNT];  // as of the last line
+  size_t line_length;
+  size_t line_read;              // bytes of line already read
+  char line[TELEINFUSE_LOG_LINE_MAX];
+};
+
+// Prints the line of the last record read: the values that differ from shown
+// (every value if all is set), then updates shown
+// returns the length of the line
+static size_t teleinfuse_log_line (char * text, const teleinfuse_log_value * values, teleinfuse_log_value * shown, int64_t time, int all)
+{
+  char datetime[TI_DATETIME_LENGTH + 1];
+  char * p = text;
+
+  if (all) {
+    // Labels no longer sent are not remembered either
+    memset(shown, 0, TI_LABEL_COUNT * sizeof(teleinfuse_log_value));
+  }
+  p += sprintf(p, "%lld.%03d", (long long)(time / 1000), (int)(time % 1000));
+  for (int id=0; id<TI_LABEL_COUNT; id++) {
+    const teleinfuse_log_value * value = &(values[id]);
+    teleinfuse_log_value * last = &(shown[id]);
+    if (!value->present) {
+      continue;
+    }
+    if (last->present && last->numeric == value->numeric && last->datetime == value->datetime
+        && (value->numeric ? last->number == value->number && last->width == value->width
+                           : last->length == value->length && !memcmp(last->text, value->text, value->length))) {
+      continue;
+    }
+    if (!value->numeric) {
+      p += sprintf(p, "\t%s=%s", teleinfo_labels[id].name, value->text);
+    } else if (teleinfo_labels[id].type == TI_TYPE_REGISTER) {
+      p += sprintf(p, "\t%s=%0*llX", teleinfo_labels[id].name, value->width, (unsigned long long)value->number);
+    } else {
+      p += sprintf(p, "\t%s=%0*lld", teleinfo_labels[id].name, value->width, (long long)value->number);
+    }
+    if (value->datetime) {
+      teleinfo_datetime_format(value->datetime, datetime);
+      p += sprintf(p, "\t%s" DATETIME_FILENAME_SUFFIX "=%s", teleinfo_labels[id].name, datetime);
+    }
+    *last = *value;
+  }
+  *p++ = '\n';
+  return p - text;
+}
+
+// Offset of the last keyframe of an index before start
+static uint64_t teleinfuse_log_seek (const unsigned char * index, size_t count, int64_t start)
+{
+  teleinfuse_log_keyframe keyframe;
+  uint64_t offset = sizeof(teleinfuse_log_header);
+  size_t low = 0, high = count;
+
+  while (low < high) {
+    size_t middle = (low + high) / 2;
+    memcpy(&keyframe, index + middle * sizeof(keyframe), sizeof(keyframe));
+    if (keyframe.time <= start) {
+      offset = keyframe.offset;
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  return offset;
+}
+
+static void teleinfuse_log_unmap (teleinfuse_log_cursor * cursor)
+{
+  if (cursor->data != MAP_FAILED) {
+    munmap(cursor->data, cursor->size);
+    cursor->data = MAP_FAILED;
+  }
+}
+
+// Maps the segment of the cursor, decoding goes on from record (0: from the
+// last keyframe before the day in the first segment, from the start in the next ones)
+// returns 0 if succeed otherwise -1 (the segment is skipped)
+static int teleinfuse_log_map (teleinfuse_log_cursor * cursor, uint64_t record)
+{
+  const teleinfuse_segment * segment = &(cursor->segments[cursor->segment]);
+  char path[PATH_MAX];
+  struct stat st;
+
+  teleinfuse_log_path(&(teleinfuse_logs[cursor->meter]), segment->id, path);
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd != -1 && !fstat(fd, &st) && st.st_size >= sizeof(teleinfuse_log_header)) {
+    cursor->data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    cursor->size = st.st_size;
+  }
+  if (fd != -1) {
+    close(fd);
+  }
+  if (cursor->data == MAP_FAILED) {
+    syslog(LOG_ERR, "log: unable to map \"%s\": %s", path, strerror(errno));
+    return -1;
+  }
+
+  // Records of a segment being written end where they were when it has been listed
+  size_t records, index, count;
+  int64_t last;
+  int first = (!record && !cursor->segment);
+  cursor->records = segment->end;
+  if (segment->open) {
+    record = first ? cursor->first_record : record;
+  } else if ( (records = teleinfuse_log_footer(cursor->data, cursor->size, &index, &count, &last)) ) {
+    cursor->records = records;
+    record = first ? teleinfuse_log_seek(cursor->data + index, count, cursor->start) : record;
+  }
+  if (cursor->records > cursor->size) {
+    cursor->records = cursor->size;
+  }
+  cursor->record = record ? record : sizeof(teleinfuse_log_header);
+  return 0;
+}
+
+// Back to the start of the day
+static void teleinfuse_log_rewind (teleinfuse_log_cursor * cursor)
+{
+  teleinfuse_log_unmap(cursor);
+  cursor->segment = 0;
+  cursor->record = 0;
+  cursor->lines = 0;
+  cursor->offset = 0;
+  cursor->line_length = cursor->line_read = 0;
+  memset(cursor->values, 0, sizeof(cursor->values));
+}
+
+// Back to a keyframe line
+static void teleinfuse_log_restore (teleinfuse_log_cursor * cursor, const teleinfuse_log_checkpoint * checkpoint)
+{
+  teleinfuse_log_unmap(cursor);
+  cursor->segment = checkpoint->segment;
+  cursor->record = checkpoint->record;
+  cursor->lines = 1;
+  cursor->offset = checkpoint->text;
+  cursor->line_length = cursor->line_read = 0;
+  if (teleinfuse_log_map(cursor, checkpoint->record)) {
+    cursor->segment++;
+    cursor->record = 0;
+  }
+}
+
+// Decodes the next line of the day
+// returns 0 if succeed otherwise -1 (end of the day)
+static int teleinfuse_log_next (teleinfuse_log_cursor * cursor)
+{
+  while (cursor->segment < cursor->segment_count) {
+    if (cursor->data == MAP_FAILED && teleinfuse_log_map(cursor, cursor->record)) {
+      cursor->segment++;
+      cursor->record = 0;
+      continue;
+    }
+    uint64_t record = cursor->record;
+    const unsigned char * p = cursor->data + record;
+    int keyframe;
+    if (record >= cursor->records || teleinfuse_log_decode(&p, cursor->data + cursor->records, cursor->values, &(cursor->time), &keyframe)) {
+      teleinfuse_log_unmap(cursor);
+      cursor->segment++;
+      cursor->record = 0;
+      continue;
+    }
+    cursor->record = p - cursor->data;
+    if (cursor->time >= cursor->end) {
+      teleinfuse_log_unmap(cursor);
+      cursor->segment = cursor->segment_count;
+      break;
+    }
+    if (cursor->time < cursor->start) {
+      continue;
+    }
+    if (keyframe && cursor->lines
+        && (!cursor->checkpoint_count || cursor->checkpoints[cursor->checkpoint_count - 1].text < cursor->offset)) {
+      if (cursor->checkpoint_count == cursor->checkpoint_capacity) {
+        size_t capacity = cursor->checkpoint_capacity ? cursor->checkpoint_capacity * 2 : 64;
+        teleinfuse_log_checkpoint * checkpoints = realloc(cursor->checkpoints, capacity * sizeof(teleinfuse_log_checkpoint));
+        if (checkpoints) {
+          cursor->checkpoints = checkpoints;
+          cursor->checkpoint_capacity = capacity;
+        }
+      }
+      // A missing checkpoint only makes seeks decode more
+      if (cursor->checkpoint_count < cursor->checkpoint_capacity) {
+        teleinfuse_log_checkpoint checkpoint = { cursor->offset, cursor->segment, record };
+        cursor->checkpoints[cursor->checkpoint_count++] = checkpoint;
+      }
+    }
+    cursor->line_length = teleinfuse_log_line(cursor->line, cursor->values, cursor->shown, cursor->time, keyframe || !cursor->lines);
+    cursor->line_read = 0;
+    cursor->lines++;
+    return 0;
+  }
+  return -1;
+}
+
+// Moves the cursor to offset (or to the end of the day if it is shorter)
+static void teleinfuse_log_move (teleinfuse_log_cursor * cursor, uint64_t offset)
+{
+  size_t low = 0, high = cursor->checkpoint_count;
+
+  // Last keyframe line at or before offset
+  while (low < high) {
+    size_t middle = (low + high) / 2;
+    if (cursor->checkpoints[middle].text <= offset) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  uint64_t from = low ? cursor->checkpoints[low - 1].text : 0;
+  if (cursor->offset > offset || cursor->offset < from) {
+    if (low) {
+      teleinfuse_log_restore(cursor, &(cursor->checkpoints[low - 1]));
+    } else {
+      teleinfuse_log_rewind(cursor);
+    }
+  }
+  while (cursor->offset < offset) {
+    if (cursor->line_read == cursor->line_length && teleinfuse_log_next(cursor)) {
+      break;
+    }
+    size_t skip = cursor->line_length - cursor->line_read;
+    if (skip > offset - cursor->offset) {
+      skip = offset - cursor->offset;
+    }
+    cursor->line_read += skip;
+    cursor->offset += skip;
+  }
+}
+
+teleinfuse_log_cursor * teleinfuse_log_open (int meter, int day)
+{
+  teleinfuse_log_cursor * cursor = calloc(1, sizeof(teleinfuse_log_cursor));
+
+  if (!cursor) {
+    return NULL;
+  }
+  cursor->meter = meter;
+  cursor->start = teleinfuse_log_day_start(day);
+  cursor->end = teleinfuse_log_day_start(day + 1);
+  cursor->data = MAP_FAILED;
+
+  // Segments of the day, files are read once the lock is released
+  pthread_mutex_lock( &teleinfuse_log_mutex );
+  teleinfuse_log_meter * log = &(teleinfuse_logs[meter]);
+  for (size_t n=0; n<log->segment_count; n++) {
+    if (log->segments[n].first < cursor->end && log->segments[n].last >= cursor->start) {
+      cursor->segment_count++;
+    }
+  }
+  if ((cursor->segments = malloc((cursor->segment_count ? cursor->segment_count : 1) * sizeof(teleinfuse_segment)))) {
+    cursor->segment_count = 0;
+    for (size_t n=0; n<log->segment_count; n++) {
+      if (log->segments[n].first < cursor->end && log->segments[n].last >= cursor->start) {
+        cursor->segments[cursor->segment_count++] = log->segments[n];
+      }
+    }
+    // The index of the segment being written is in memory
+    if (cursor->segment_count && cursor->segments[0].open) {
+      cursor->first_record = teleinfuse_log_seek((const unsigned char*)log->index, log->index_count, cursor->start);
+    }
+  }
+  pthread_mutex_unlock( &teleinfuse_log_mutex );
+
+  if (!cursor->segments) {
+    free(cursor);
+    return NULL;
+  }
+  return cursor;
+}
+
+void teleinfuse_log_release (teleinfuse_log_cursor * cursor)
+{
+  if (!cursor) {
+    return;
+  }
+  teleinfuse_log_unmap(cursor);
+  free(cursor->segments);
+  free(cursor->checkpoints);
+  free(cursor);
+}
+
+size_t teleinfuse_log_read (teleinfuse_log_cursor * cursor, char * buffer, size_t size, uint64_t offset)
+{
+  size_t length = 0;
+
+  if (cursor->offset != offset) {
+    teleinfuse_log_move(cursor, offset);
+    if (cursor->offset != offset) {
+      return 0; // past the end
+    }
+  }
+  while (length < size) {
+    if (cursor->line_read == cursor->line_length && teleinfuse_log_next(cursor)) {
+      break;
+    }
+    size_t n = cursor->line_length - cursor->line_read;
+    if (n > size - length) {
+      n = size - length;
+    }
+    memcpy(buffer + length, cursor->line + cursor->line_read, n);
+    cursor->line_read += n;
+    cursor->offset += n;
+    length += n;
+  }
+  return length;
+}
@@ -0,0 +1,84 @@
+/*
+ * teleinfuse is a FUSE module to access to the Télé information of linky electric meter running in standard mode
+ * Télé info data are transmitted by french electric meters (EDF/ERDF)
+ * [FR] Permet de lire la téléinformation cliente (TIC) d'un compteur linky en mode standard.
+ * [FR] Pour le mode TIC historique, voir le projet original
+ *
+ * Based on https://github.com/neomilium/teleinfuse project by Romuald Conty
+ *
+ * Copyright (C) 2020 itineric
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _TELEINFUSE_LOG_H_
+#define _TELEINFUSE_LOG_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "teleinfo.h"
+
+#define TELEINFUSE_LOG_DIRNAME "log"
+
+// "YYYY-MM-DD" and a NUL
+#define TELEINFUSE_LOG_DAYNAME_SIZE 11
+
+// Append-only log of every decoded frame of each meter, in segment files
+// "<dir>/<meter>-<ms>.tlog" of about segment_size bytes. Each record holds the
+// messages that changed since the previous frame, numbers and datetimes as
+// varint deltas; every TELEINFUSE_LOG_KEYFRAME_RECORDS records, a keyframe
+// holds the whole frame. A closed segment ends with the index of its
+// keyframes: a day is read from the mapped segments, starting at the last
+// keyframe before it.
+// Segments left without index (daemon killed) are repaired at init.
+// meters: number of meters (meter arguments below are 0 to meters - 1)
+// names: file name prefix of each meter
+// dir: NULL disables the log
+void teleinfuse_log_init (const char * dir, size_t segment_size, size_t meters, const char * const names[]);
+// Closes the segments being written
+void teleinfuse_log_destroy (void);
+
+int teleinfuse_log_enabled (void);
+
+// Appends a frame received at time (CLOCK_REALTIME)
+void teleinfuse_log_add (int meter, const teleinfo_frame * frame, const struct timespec * time);
+
+// Days are numbered from 1970-01-01, in local time
+// returns 1 and the first and last days of the log of meter, 0 if it is empty
+int teleinfuse_log_days (int meter, int * first, int * last);
+int teleinfuse_log_day_exists (int meter, int day);
+void teleinfuse_log_dayname (int day, char name[TELEINFUSE_LOG_DAYNAME_SIZE]);
+// returns the day of a name or -1
+int teleinfuse_log_day_find (const char * name);
+
+// Number of records written for meter (changes with each frame)
+unsigned long teleinfuse_log_generation (int meter);
+
+// The frames of a day are read as "time\tLABEL=value\t...\n" lines (as
+// /stream): the first line and the line of each keyframe hold every value, the
+// next ones what changed. Lines are decoded as they are read: a cursor keeps
+// its position and the text offset of the keyframe lines it went through, a
+// read elsewhere starts again from the keyframe line before it.
+typedef struct teleinfuse_log_cursor teleinfuse_log_cursor;
+
+// returns a cursor on the day of meter, NULL if there is no memory
+teleinfuse_log_cursor * teleinfuse_log_open (int meter, int day);
+void teleinfuse_log_release (teleinfuse_log_cursor * cursor);
+// Copies at most size bytes of the text of the day at offset into buffer
+// returns the number of bytes, 0 past the end
+size_t teleinfuse_log_read (teleinfuse_log_cursor * cursor, char * buffer, size_t size, uint64_t offset);
+
+#endif
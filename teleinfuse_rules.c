@@ -0,0 +1,661 @@
+/*
+ * teleinfuse is a FUSE module to access to the Télé information of linky electric meter running in standard mode
+ * Télé info data are transmitted by french electric meters (EDF/ERDF)
+ * [FR] Permet de lire la téléinformation cliente (TIC) d'un compteur linky en mode standard.
+ * [FR] Pour le mode TIC historique, voir le projet original
+ *
+ * Based on https://github.com/neomilium/teleinfuse project by Romuald Conty
+ *
+ * Copyright (C) 2020 itineric
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "teleinfuse_rules.h"
+#include "teleinfuse_stats.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+extern char ** environ;
+
+// Labels of the conditions are copied from a frame to registers
+#define TELEINFUSE_RULES_REGISTERS 64
+#define TELEINFUSE_RULES_CONSTANT  0xff
+
+enum {
+  TELEINFUSE_RULES_LT,
+  TELEINFUSE_RULES_LE,
+  TELEINFUSE_RULES_GT,
+  TELEINFUSE_RULES_GE,
+  TELEINFUSE_RULES_EQ,
+  TELEINFUSE_RULES_NE,
+};
+
+static const char * teleinfuse_rules_ops[] = { "<", "<=", ">", ">=", "==", "!=" };
+
+// A comparison: lhs * 1000 OP k, or lhs * 1000 OP rhs * k
+typedef struct {
+  unsigned char op;
+  unsigned char lhs;  // register
+  unsigned char rhs;  // register or TELEINFUSE_RULES_CONSTANT
+  unsigned char last; // last comparison of a condition
+  int64_t k;          // thousandths
+} teleinfuse_rules_test;
+
+typedef struct {
+  char * name;
+  int meter;          // -1 for every meter
+  int condition[2];   // when, until (-1 for not when)
+  int64_t hold[2];    // ms
+  char * command;     // exec
+  char * path;        // write
+} teleinfuse_rule;
+
+typedef struct {
+  int64_t since;      // when the condition to switch began to hold, -1 if it does not
+  int on;
+} teleinfuse_rules_state;
+
+static teleinfuse_rules_test * teleinfuse_rules_program = NULL;
+static size_t teleinfuse_rules_length = 0;
+static size_t teleinfuse_rules_capacity = 0;
+static teleinfuse_rule * teleinfuse_rules = NULL;
+static size_t teleinfuse_rules_count = 0;
+static size_t teleinfuse_rules_conditions = 0;
+static teleinfuse_rules_state * teleinfuse_rules_states = NULL; // teleinfuse_rules_count per meter
+static signed char * teleinfuse_rules_results = NULL;           // one per condition
+static signed char teleinfuse_rules_register[TI_LABEL_COUNT];
+static size_t teleinfuse_rules_registers = 0;
+static const char ** teleinfuse_rules_names = NULL;
+static size_t teleinfuse_rules_meters = 0;
+// Commands still running: pid (0 for a free slot) and pidfd (-1 if it could not be opened)
+static pid_t teleinfuse_rules_children[TELEINFUSE_RULES_CHILDREN_MAX];
+static int teleinfuse_rules_pidfds[TELEINFUSE_RULES_CHILDREN_MAX];
+static size_t teleinfuse_rules_running = 0;
+static int teleinfuse_rules_epoll_fd = -1;
+static uint64_t teleinfuse_rules_source;
+
+// returns the next word of *line (length in *length) and moves *line after it, NULL at the end
+static const char * teleinfuse_rules_word (const char ** line, size_t * length)
+{
+  const char * p = *line;
+  while (isspace((unsigned char)*p)) {
+    p++;
+  }
+  if (!*p || *p == '#') {
+    *line = p;
+    return NULL;
+  }
+  const char * word = p;
+  while (*p && !isspace((unsigned char)*p)) {
+    p++;
+  }
+  *length = p - word;
+  *line = p;
+  return word;
+}
+
+static int teleinfuse_rules_is (const char * word, size_t length, const char * keyword)
+{
+  return word && length == strlen(keyword) && !memcmp(word, keyword, length);
+}
+
+// "12", "-0.9": value in thousandths
+// returns 0 if succeed otherwise -1
+static int teleinfuse_rules_number (const char * word, size_t length, int64_t * value)
+{
+  const char * end = word + length;
+  int negative = (word < end && *word == '-');
+  int64_t number = 0;
+  int decimals = -1;
+
+  word += negative;
+  if (word == end) {
+    return -1;
+  }
+  for (; word < end; word++) {
+    if (*word == '.' && decimals < 0) {
+      decimals = 0;
+    } else if (isdigit((unsigned char)*word) && decimals < 3 && number < INT64_MAX / 10000) {
+      number = number * 10 + (*word - '0');
+      decimals += (decimals >= 0);
+    } else {
+      return -1;
+    }
+  }
+  for (decimals = decimals < 0 ? 0 : decimals; decimals < 3; decimals++) {
+    number *= 10;
+  }
+  *value = negative ? -number : number;
+  return 0;
+}
+
+// "500ms", "10s", "2m"
+// returns 0 if succeed otherwise -1
+static int teleinfuse_rules_duration (const char * word, size_t length, int64_t * ms)
+{
+  size_t digits = 0;
+  int64_t value = 0;
+
+  while (digits < length && isdigit((unsigned char)word[digits]) && value < INT32_MAX) {
+    value = value * 10 + (word[digits++] - '0');
+  }
+  if (!digits) {
+    return -1;
+  }
+  if (teleinfuse_rules_is(word + digits, length - digits, "ms")) {
+    *ms = value;
+  } else if (teleinfuse_rules_is(word + digits, length - digits, "s")) {
+    *ms = value * 1000;
+  } else if (teleinfuse_rules_is(word + digits, length - digits, "m")) {
+    *ms = value * 60000;
+  } else {
+    return -1;
+  }
+  return 0;
+}
+
+// returns the register of a numeric label, -1 if there is none
+static int teleinfuse_rules_label (const char * word, size_t length, const char ** error)
+{
+  int id = teleinfo_label_find(word, length);
+  if (id == TI_LABEL_UNKNOWN) {
+    *error = "unknown label";
+    return -1;
+  }
+  if (teleinfo_labels[id].type == TI_TYPE_TEXT) {
+    *error = "label without numeric value";
+    return -1;
+  }
+  if (teleinfuse_rules_register[id] < 0) {
+    if (teleinfuse_rules_registers == TELEINFUSE_RULES_REGISTERS) {
+      *error = "too many labels";
+      return -1;
+    }
+    teleinfuse_rules_register[id] = teleinfuse_rules_registers++;
+  }
+  return teleinfuse_rules_register[id];
+}
+
+static teleinfuse_rules_test * teleinfuse_rules_emit (void)
+{
+  if (teleinfuse_rules_length == teleinfuse_rules_capacity) {
+    size_t capacity = teleinfuse_rules_capacity ? 2 * teleinfuse_rules_capacity : 16;
+    teleinfuse_rules_test * program = realloc(teleinfuse_rules_program, capacity * sizeof(teleinfuse_rules_test));
+    if (!program) {
+      return NULL;
+    }
+    teleinfuse_rules_program = program;
+    teleinfuse_rules_capacity = capacity;
+  }
+  return &(teleinfuse_rules_program[teleinfuse_rules_length++]);
+}
+
+// COND: "LABEL OP OPERAND [and LABEL OP OPERAND...]", compiled at the end of the program
+// returns the condition index, -1 on error
+static int teleinfuse_rules_condition (const char ** line, const char ** error)
+{
+  for (;;) {
+    size_t length;
+    const char * word = teleinfuse_rules_word(line, &length);
+    teleinfuse_rules_test test = { .rhs = TELEINFUSE_RULES_CONSTANT };
+    int lhs;
+
+    if (!word) {
+      *error = "condition expected";
+      return -1;
+    }
+    if ((lhs = teleinfuse_rules_label(word, length, error)) < 0) {
+      return -1;
+    }
+    test.lhs = lhs;
+    word = teleinfuse_rules_word(line, &length);
+    size_t op = 0;
+    while (op < sizeof(teleinfuse_rules_ops) / sizeof(teleinfuse_rules_ops[0]) && !teleinfuse_rules_is(word, length, teleinfuse_rules_ops[op])) {
+      op++;
+    }
+    if (op == sizeof(teleinfuse_rules_ops) / sizeof(teleinfuse_rules_ops[0])) {
+      *error = "comparison operator expected";
+      return -1;
+    }
+    test.op = op;
+    if (!(word = teleinfuse_rules_word(line, &length))) {
+      *error = "operand expected";
+      return -1;
+    }
+    if (isdigit((unsigned char)*word) || *word == '-') {
+      if (teleinfuse_rules_number(word, length, &(test.k))) {
+        *error = "invalid number";
+        return -1;
+      }
+    } else {
+      const char * star = memchr(word, '*', length);
+      size_t label_length = star ? (size_t)(star - word) : length;
+      int rhs = teleinfuse_rules_label(word, label_length, error);
+      if (rhs < 0) {
+        return -1;
+      }
+      test.rhs = rhs;
+      test.k = 1000;
+      if (star && teleinfuse_rules_number(star + 1, length - label_length - 1, &(test.k))) {
+        *error = "invalid factor";
+        return -1;
+      }
+    }
+    teleinfuse_rules_test * emitted = teleinfuse_rules_emit();
+    if (!emitted) {
+      *error = strerror(ENOMEM);
+      return -1;
+    }
+    *emitted = test;
+
+    const char * next = *line;
+    word = teleinfuse_rules_word(&next, &length);
+    if (!teleinfuse_rules_is(word, length, "and")) {
+      emitted->last = 1;
+      return teleinfuse_rules_conditions++;
+    }
+    *line = next;
+  }
+}
+
+// Parses and compiles a line of the rules file into rule
+// returns 0 if succeed otherwise -1 and the reason in *error
+static int teleinfuse_rules_parse (const char * line, teleinfuse_rule * rule, const char ** error)
+{
+  size_t length;
+  const char * word = teleinfuse_rules_word(&line, &length);
+
+  rule->meter = -1;
+  rule->condition[1] = -1;
+  rule->name = strndup(word, length);
+  word = teleinfuse_rules_word(&line, &length);
+  if (word && length > 6 && !memcmp(word, "meter=", 6)) {
+    for (size_t n=0; n<teleinfuse_rules_meters; n++) {
+      if (teleinfuse_rules_is(word + 6, length - 6, teleinfuse_rules_names[n])) {
+        rule->meter = n;
+      }
+    }
+    if (rule->meter < 0) {
+      *error = "unknown meter";
+      return -1;
+    }
+    word = teleinfuse_rules_word(&line, &length);
+  }
+  for (int n=0; n<2; n++) {
+    if (!teleinfuse_rules_is(word, length, n ? "until" : "when")) {
+      if (n) {
+        break;
+      }
+      *error = "\"when\" expected";
+      return -1;
+    }
+    if ((rule->condition[n] = teleinfuse_rules_condition(&line, error)) < 0) {
+      return -1;
+    }
+    word = teleinfuse_rules_word(&line, &length);
+    if (teleinfuse_rules_is(word, length, "for")) {
+      word = teleinfuse_rules_word(&line, &length);
+      if (!word || teleinfuse_rules_duration(word, length, &(rule->hold[n]))) {
+        *error = "invalid duration";
+        return -1;
+      }
+      word = teleinfuse_rules_word(&line, &length);
+    }
+  }
+  if (teleinfuse_rules_is(word, length, "exec")) {
+    // The command is the rest of the line
+    while (isspace((unsigned char)*line)) {
+      line++;
+    }
+    length = strlen(line);
+    while (length && isspace((unsigned char)line[length - 1])) {
+      length--;
+    }
+    if (!length) {
+      *error = "command expected";
+      return -1;
+    }
+    rule->command = strndup(line, length);
+  } else if (teleinfuse_rules_is(word, length, "write")) {
+    if (!(word = teleinfuse_rules_word(&line, &length))) {
+      *error = "path expected";
+      return -1;
+    }
+    if (*word != '/') {
+      *error = "absolute path expected"; // the daemon runs in /
+      return -1;
+    }
+    rule->path = strndup(word, length);
+    if (teleinfuse_rules_word(&line, &length)) {
+      *error = "end of line expected";
+      return -1;
+    }
+  } else {
+    *error = "\"exec\" or \"write\" expected";
+    return -1;
+  }
+  if (!rule->name || (!rule->command && !rule->path)) {
+    *error = strerror(ENOMEM);
+    return -1;
+  }
+  return 0;
+}
+
+void teleinfuse_rules_watch (int epoll_fd, uint64_t source)
+{
+  teleinfuse_rules_epoll_fd = epoll_fd;
+  teleinfuse_rules_source = source;
+}
+
+// Collects the command of slot if it ended
+static void teleinfuse_rules_wait (size_t slot)
+{
+  int status;
+  pid_t pid = waitpid(teleinfuse_rules_children[slot], &status, WNOHANG);
+
+  if (pid == 0) {
+    return;
+  }
+  if (pid > 0 && (!WIFEXITED(status) || WEXITSTATUS(status))) {
+    syslog(LOG_WARNING, "rule command %d failed (status %d)", (int)pid, status);
+    teleinfuse_stats_count(TELEINFUSE_STAT_RULE_ERRORS);
+  }
+  if (teleinfuse_rules_pidfds[slot] != -1) {
+    close(teleinfuse_rules_pidfds[slot]); // leaves the epoll set
+  }
+  teleinfuse_rules_children[slot] = 0;
+  teleinfuse_rules_running--;
+}
+
+void teleinfuse_rules_event (uint64_t slot)
+{
+  if (slot < TELEINFUSE_RULES_CHILDREN_MAX && teleinfuse_rules_children[slot]) {
+    teleinfuse_rules_wait(slot);
+  }
+}
+
+// A command gets a pidfd watched by the reactor, which reaps it as soon as it
+// ends even if no frame comes anymore. Without pidfd (Linux < 5.3), it is
+// reaped on the next frame.
+static void teleinfuse_rules_child (pid_t pid)
+{
+  size_t slot = 0;
+  while (teleinfuse_rules_children[slot]) {
+    slot++;
+  }
+  int fd = syscall(SYS_pidfd_open, pid, 0);
+  if (fd != -1 && teleinfuse_rules_epoll_fd != -1) {
+    struct epoll_event event = { .events = EPOLLIN, .data.u64 = teleinfuse_rules_source + slot };
+    if (epoll_ctl(teleinfuse_rules_epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+      close(fd);
+      fd = -1;
+    }
+  } else if (fd != -1) {
+    close(fd);
+    fd = -1;
+  }
+  teleinfuse_rules_children[slot] = pid;
+  teleinfuse_rules_pidfds[slot] = fd;
+  teleinfuse_rules_running++;
+}
+
+int teleinfuse_rules_init (const char * path, size_t meters, const char * const names[])
+{
+  FILE * file = fopen(path, "r");
+  char * line = NULL;
+  size_t size = 0;
+  int number = 0;
+  int res = 0;
+
+  if (!file) {
+    fprintf(stderr, "Unable to read rules \"%s\": %s.\n", path, strerror(errno));
+    return -1;
+  }
+  if (!(teleinfuse_rules_names = malloc(meters * sizeof(const char *)))) {
+    fprintf(stderr, "Unable to allocate rules.\n");
+    fclose(file);
+    return -1;
+  }
+  memcpy(teleinfuse_rules_names, names, meters * sizeof(const char *));
+  teleinfuse_rules_meters = meters;
+  memset(teleinfuse_rules_register, -1, sizeof(teleinfuse_rules_register));
+  while (!res && getline(&line, &size, file) != -1) {
+    const char * p = line;
+    const char * error = NULL;
+    size_t length;
+    number++;
+    if (!teleinfuse_rules_word(&p, &length)) {
+      continue; // blank or comment
+    }
+    teleinfuse_rule * rules = realloc(teleinfuse_rules, (teleinfuse_rules_count + 1) * sizeof(teleinfuse_rule));
+    if (!rules) {
+      error = strerror(ENOMEM);
+    } else {
+      teleinfuse_rules = rules;
+      memset(&(rules[teleinfuse_rules_count]), 0, sizeof(teleinfuse_rule));
+      teleinfuse_rules_count++;
+      teleinfuse_rules_parse(line, &(rules[teleinfuse_rules_count - 1]), &error);
+    }
+    if (error) {
+      fprintf(stderr, "%s:%d: %s.\n", path, number, error);
+      res = -1;
+    }
+  }
+  free(line);
+  fclose(file);
+  if (!res && teleinfuse_rules_count) {
+    teleinfuse_rules_states = malloc(meters * teleinfuse_rules_count * sizeof(teleinfuse_rules_state));
+    teleinfuse_rules_results = malloc(teleinfuse_rules_conditions);
+    if (!teleinfuse_rules_states || !teleinfuse_rules_results) {
+      fprintf(stderr, "Unable to allocate rules.\n");
+      res = -1;
+    } else {
+      for (size_t n=0; n<meters * teleinfuse_rules_count; n++) {
+        teleinfuse_rules_states[n].since = -1;
+        teleinfuse_rules_states[n].on = 0;
+      }
+    }
+  }
+  if (res) {
+    teleinfuse_rules_destroy();
+  } else {
+    syslog(LOG_INFO, "%zu rule(s) compiled into %zu comparisons on %zu labels", teleinfuse_rules_count, teleinfuse_rules_length, teleinfuse_rules_registers);
+  }
+  return res;
+}
+
+void teleinfuse_rules_destroy (void)
+{
+  // Commands still running are left to init when the daemon exits
+  for (size_t n=0; n<TELEINFUSE_RULES_CHILDREN_MAX; n++) {
+    if (teleinfuse_rules_children[n]) {
+      teleinfuse_rules_wait(n);
+    }
+    if (teleinfuse_rules_children[n] && teleinfuse_rules_pidfds[n] != -1) {
+      close(teleinfuse_rules_pidfds[n]);
+    }
+    teleinfuse_rules_children[n] = 0;
+  }
+  teleinfuse_rules_running = 0;
+  teleinfuse_rules_epoll_fd = -1;
+  for (size_t n=0; n<teleinfuse_rules_count; n++) {
+    free(teleinfuse_rules[n].name);
+    free(teleinfuse_rules[n].command);
+    free(teleinfuse_rules[n].path);
+  }
+  free(teleinfuse_rules);
+  free(teleinfuse_rules_program);
+  free(teleinfuse_rules_states);
+  free(teleinfuse_rules_results);
+  free(teleinfuse_rules_names);
+  teleinfuse_rules = NULL;
+  teleinfuse_rules_names = NULL;
+  teleinfuse_rules_program = NULL;
+  teleinfuse_rules_states = NULL;
+  teleinfuse_rules_results = NULL;
+  teleinfuse_rules_count = 0;
+  teleinfuse_rules_length = 0;
+  teleinfuse_rules_capacity = 0;
+  teleinfuse_rules_conditions = 0;
+  teleinfuse_rules_registers = 0;
+}
+
+// value * k, saturated: an index (up to 10^12 in thousandths) times a large
+// factor would overflow and flip the comparison
+static int64_t teleinfuse_rules_scale (int64_t value, int64_t k)
+{
+  int64_t scaled;
+  if (__builtin_mul_overflow(value, k, &scaled)) {
+    return ((value < 0) != (k < 0)) ? INT64_MIN : INT64_MAX;
+  }
+  return scaled;
+}
+
+static void teleinfuse_rules_action (const teleinfuse_rule * rule, int meter, int on, const struct timespec * time)
+{
+  const char * name = teleinfuse_rules_names[meter];
+  const char * state = on ? "on" : "off";
+  int err = 0;
+
+  syslog(LOG_NOTICE, "%s: rule %s %s", name, rule->name, state);
+  teleinfuse_stats_count(TELEINFUSE_STAT_RULES_FIRED);
+  if (rule->command) {
+    char * argv[] = { "sh", "-c", rule->command, "teleinfuse", rule->name, (char*)state, (char*)name, NULL };
+    posix_spawnattr_t attr;
+    sigset_t none;
+    pid_t pid;
+    if (teleinfuse_rules_running == TELEINFUSE_RULES_CHILDREN_MAX) {
+      err = EAGAIN;
+    } else if (!(err = posix_spawnattr_init(&attr))) {
+      // The command does not inherit the signals blocked by the threads
+      sigemptyset(&none);
+      posix_spawnattr_setsigmask(&attr, &none);
+      posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+      if (!(err = posix_spawn(&pid, "/bin/sh", NULL, &attr, argv, environ))) {
+        teleinfuse_rules_child(pid);
+      }
+      posix_spawnattr_destroy(&attr);
+    }
+  } else {
+    // A FIFO without reader fails at once (ENXIO) rather than blocking the reader thread
+    char text[64 + TI_LABEL_LENGTH_MAX + 256];
+    errno = 0;
+    int fd = open(rule->path, O_WRONLY | O_APPEND | O_NONBLOCK | O_CLOEXEC);
+    int length = snprintf(text, sizeof(text), "%lld.%03ld\t%s\t%s\t%s\n",
+                          (long long)time->tv_sec, time->tv_nsec / 1000000, name, rule->name, state);
+    if (length >= (int)sizeof(text)) {
+      length = sizeof(text) - 1;
+    }
+    if (fd == -1 || write(fd, text, length) != length) {
+      err = errno ? errno : EIO;
+    }
+    if (fd != -1) {
+      close(fd);
+    }
+  }
+  if (err) {
+    syslog(LOG_WARNING, "%s: rule %s: unable to %s: %s", name, rule->name, rule->command ? "run command" : "write", strerror(err));
+    teleinfuse_stats_count(TELEINFUSE_STAT_RULE_ERRORS);
+  }
+}
+
+void teleinfuse_rules_evaluate (int meter, const teleinfo_frame * frame, int64_t now, const struct timespec * time)
+{
+  int64_t registers[TELEINFUSE_RULES_REGISTERS];
+  uint64_t present = 0;
+
+  if (!teleinfuse_rules_count) {
+    return;
+  }
+  for (size_t n=0; teleinfuse_rules_running && n<TELEINFUSE_RULES_CHILDREN_MAX; n++) {
+    if (teleinfuse_rules_children[n] && teleinfuse_rules_pidfds[n] == -1) {
+      teleinfuse_rules_wait(n);
+    }
+  }
+  for (size_t n=0; n<frame->datasetlen; n++) {
+    const teleinfo_data * data = &(frame->dataset[n]);
+    if (data->numeric && data->id != TI_LABEL_UNKNOWN && teleinfuse_rules_register[data->id] >= 0) {
+      registers[teleinfuse_rules_register[data->id]] = data->number;
+      present |= (uint64_t)1 << teleinfuse_rules_register[data->id];
+    }
+  }
+
+  // Conditions are 1 (true), 0 (false) or -1 (a label is missing)
+  signed char * result = teleinfuse_rules_results;
+  signed char value = 1;
+  for (const teleinfuse_rules_test * test = teleinfuse_rules_program; test < teleinfuse_rules_program + teleinfuse_rules_length; test++) {
+    if (!(present >> test->lhs & 1) || (test->rhs != TELEINFUSE_RULES_CONSTANT && !(present >> test->rhs & 1))) {
+      value = value ? -1 : 0;
+    } else if (value) {
+      int64_t lhs = teleinfuse_rules_scale(registers[test->lhs], 1000);
+      int64_t rhs = test->rhs == TELEINFUSE_RULES_CONSTANT ? test->k : teleinfuse_rules_scale(registers[test->rhs], test->k);
+      int holds;
+      switch (test->op) {
+        case TELEINFUSE_RULES_LT: holds = lhs < rhs; break;
+        case TELEINFUSE_RULES_LE: holds = lhs <= rhs; break;
+        case TELEINFUSE_RULES_GT: holds = lhs > rhs; break;
+        case TELEINFUSE_RULES_GE: holds = lhs >= rhs; break;
+        case TELEINFUSE_RULES_EQ: holds = lhs == rhs; break;
+        default:                  holds = lhs != rhs; break;
+      }
+      value = holds ? value : 0;
+    }
+    if (test->last) {
+      *(result++) = value;
+      value = 1;
+    }
+  }
+
+  teleinfuse_rules_state * states = &(teleinfuse_rules_states[meter * teleinfuse_rules_count]);
+  for (size_t n=0; n<teleinfuse_rules_count; n++) {
+    const teleinfuse_rule * rule = &(teleinfuse_rules[n]);
+    teleinfuse_rules_state * state = &(states[n]);
+    if (rule->meter >= 0 && rule->meter != meter) {
+      continue;
+    }
+    // Switching condition: when while off, until (or not when) while on
+    signed char holds = teleinfuse_rules_results[rule->condition[0]];
+    if (state->on) {
+      holds = rule->condition[1] >= 0 ? teleinfuse_rules_results[rule->condition[1]] : (holds < 0 ? -1 : !holds);
+    }
+    if (holds < 0) {
+      continue;
+    }
+    if (!holds) {
+      state->since = -1;
+      continue;
+    }
+    if (state->since < 0) {
+      state->since = now;
+    }
+    if (now - state->since >= rule->hold[state->on]) {
+      state->on = !state->on;
+      state->since = -1;
+      teleinfuse_rules_action(rule, meter, state->on, time);
+    }
+  }
+}
@@ -0,0 +1,68 @@
+/*
+ * teleinfuse is a FUSE module to access to the Télé information of linky electric meter running in standard mode
+ * Télé info data are transmitted by french electric meters (EDF/ERDF)
+ * [FR] Permet de lire la téléinformation cliente (TIC) d'un compteur linky en mode standard.
+ * [FR] Pour le mode TIC historique, voir le projet original
+ *
+ * Based on https://github.com/neomilium/teleinfuse project by Romuald Conty
+ *
+ * Copyright (C) 2020 itineric
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _TELEINFUSE_RULES_H_
+#define _TELEINFUSE_RULES_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "teleinfo.h"
+
+// Threshold rules evaluated by the reader thread on every decoded frame,
+// whatever the publication interval. A rules file holds one rule per line:
+//   NAME [meter=METER] when COND [for DURATION] [until COND [for DURATION]] ACTION
+// COND: comparisons "LABEL OP OPERAND" joined by "and", OP one of < <= > >= == !=,
+//       OPERAND a number (up to 3 decimals), a LABEL or LABEL*NUMBER
+// DURATION: "500ms", "10s" or "2m", how long a condition must hold (0 by default)
+// ACTION: "exec COMMAND..." runs /bin/sh -c COMMAND with $1 the rule name,
+//         $2 "on" or "off" and $3 the meter name
+//         "write PATH" writes "time\tmeter\tNAME\ton|off\n" to a FIFO or a file
+// A rule goes on when its "when" condition held for its duration, and off when
+// its "until" condition (by default "when" being false) held for its own.
+// A frame without a label of a condition leaves the rule as it is.
+// Example, shedding loads before the breaker trips (PREF is in kVA):
+//   shed when SINSTS > PREF*900 for 2s until SINSTS < PREF*800 for 30s exec /usr/local/bin/shed
+// Rules are compiled once into a flat program of comparisons.
+
+// Commands still running when a rule needs another one are not waited for
+#define TELEINFUSE_RULES_CHILDREN_MAX 16
+
+// Reads the rules of path, meters names the meters
+// returns 0 if succeed otherwise -1 (errors are printed to stderr)
+int teleinfuse_rules_init (const char * path, size_t meters, const char * const names[]);
+void teleinfuse_rules_destroy (void);
+
+// The pidfd of a running command is watched in epoll_fd as source + N
+// (0 <= N < TELEINFUSE_RULES_CHILDREN_MAX), to reap it when it ends
+void teleinfuse_rules_watch (int epoll_fd, uint64_t source);
+// Handles the readiness of source - (source given to teleinfuse_rules_watch)
+void teleinfuse_rules_event (uint64_t source);
+
+// Evaluates the rules on a frame of meter received at now (monotonic ms) and
+// time (CLOCK_REALTIME), runs the actions of the rules going on or off
+void teleinfuse_rules_evaluate (int meter, const teleinfo_frame * frame, int64_t now, const struct timespec * time);
+
+#endif
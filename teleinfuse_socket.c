@@ -0,0 +1,298 @@
+/*
+ * teleinfuse is a FUSE module to access to the Télé information of linky electric meter running in standard mode
+ * Télé info data are transmitted by french electric meters (EDF/ERDF)
+ * [FR] Permet de lire la téléinformation cliente (TIC) d'un compteur linky en mode standard.
+ * [FR] Pour le mode TIC historique, voir le projet original
+ *
+ * Based on https://github.com/neomilium/teleinfuse project by Romuald Conty
+ *
+ * Copyright (C) 2020 itineric
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "teleinfuse_socket.h"
+#include "teleinfuse_stats.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#define TELEINFUSE_SOCKET_COMMAND_MAX 512
+
+typedef struct {
+  int fd;       // -1 if the slot is free
+  char changes; // only changed labels
+  char all;     // every label, out of the specification ones included
+  unsigned char labels[TI_LABEL_COUNT];
+  char command[TELEINFUSE_SOCKET_COMMAND_MAX]; // received, not complete yet
+  size_t command_length;
+} teleinfuse_subscriber;
+
+static int teleinfuse_socket_fd = -1;
+static int teleinfuse_socket_epoll_fd = -1;
+static uint64_t teleinfuse_socket_source;
+static char * teleinfuse_socket_path = NULL;
+static teleinfuse_subscriber teleinfuse_subscribers[TELEINFUSE_SOCKET_SUBSCRIBERS_MAX];
+static size_t teleinfuse_subscriber_count = 0;
+// Last frame of each meter, to find the changed values
+static teleinfo_frame * teleinfuse_socket_frames = NULL;
+
+int teleinfuse_socket_init (const char * path, size_t meters, int epoll_fd, uint64_t source)
+{
+  struct sockaddr_un address = { .sun_family = AF_UNIX };
+  struct epoll_event event = { .events = EPOLLIN, .data.u64 = source };
+
+  if (strlen(path) >= sizeof(address.sun_path)) {
+    syslog(LOG_ERR, "socket: path too long \"%s\"", path);
+    return -1;
+  }
+  strcpy(address.sun_path, path);
+  if (!(teleinfuse_socket_frames = calloc(meters, sizeof(teleinfo_frame)))
+      || !(teleinfuse_socket_path = strdup(path))) {
+    syslog(LOG_ERR, "socket: unable to allocate");
+    teleinfuse_socket_destroy();
+    return -1;
+  }
+  // Left by a previous run
+  unlink(path);
+  if ((teleinfuse_socket_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1
+      || bind(teleinfuse_socket_fd, (struct sockaddr*)&address, sizeof(address)) == -1
+      || listen(teleinfuse_socket_fd, TELEINFUSE_SOCKET_SUBSCRIBERS_MAX) == -1
+      || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, teleinfuse_socket_fd, &event) == -1) {
+    syslog(LOG_ERR, "socket: unable to listen on \"%s\": %s", path, strerror(errno));
+    teleinfuse_socket_destroy();
+    return -1;
+  }
+  for (size_t n=0; n<TELEINFUSE_SOCKET_SUBSCRIBERS_MAX; n++) {
+    teleinfuse_subscribers[n].fd = -1;
+  }
+  teleinfuse_socket_epoll_fd = epoll_fd;
+  teleinfuse_socket_source = source;
+  return 0;
+}
+
+static void teleinfuse_subscriber_close (teleinfuse_subscriber * subscriber)
+{
+  epoll_ctl(teleinfuse_socket_epoll_fd, EPOLL_CTL_DEL, subscriber->fd, NULL);
+  close(subscriber->fd);
+  subscriber->fd = -1;
+  teleinfuse_subscriber_count--;
+}
+
+void teleinfuse_socket_destroy (void)
+{
+  if (teleinfuse_socket_fd != -1) {
+    for (size_t n=0; n<TELEINFUSE_SOCKET_SUBSCRIBERS_MAX; n++) {
+      if (teleinfuse_subscribers[n].fd != -1) {
+        teleinfuse_subscriber_close(&(teleinfuse_subscribers[n]));
+      }
+    }
+    close(teleinfuse_socket_fd);
+    teleinfuse_socket_fd = -1;
+  }
+  if (teleinfuse_socket_path) {
+    unlink(teleinfuse_socket_path);
+    free(teleinfuse_socket_path);
+    teleinfuse_socket_path = NULL;
+  }
+  free(teleinfuse_socket_frames);
+  teleinfuse_socket_frames = NULL;
+}
+
+static void teleinfuse_socket_accept (void)
+{
+  int fd = accept(teleinfuse_socket_fd, NULL, NULL);
+  size_t n = 0;
+
+  if (fd == -1) {
+    return;
+  }
+  fcntl(fd, F_SETFL, O_NONBLOCK);
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+  while (n < TELEINFUSE_SOCKET_SUBSCRIBERS_MAX && teleinfuse_subscribers[n].fd != -1) {
+    n++;
+  }
+  struct epoll_event event = { .events = EPOLLIN, .data.u64 = teleinfuse_socket_source + 1 + n };
+  if (n == TELEINFUSE_SOCKET_SUBSCRIBERS_MAX || epoll_ctl(teleinfuse_socket_epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+    syslog(LOG_INFO, "socket: subscriber refused");
+    close(fd);
+    return;
+  }
+  teleinfuse_subscriber * subscriber = &(teleinfuse_subscribers[n]);
+  subscriber->fd = fd;
+  subscriber->changes = 0;
+  subscriber->all = 1;
+  subscriber->command_length = 0;
+  teleinfuse_subscriber_count++;
+}
+
+static void teleinfuse_subscriber_command (teleinfuse_subscriber * subscriber, char * command)
+{
+  char * save;
+  char * word = strtok_r(command, " :\r", &save);
+
+  if (!word) {
+    return;
+  }
+  if (!strcmp(word, "changes")) {
+    subscriber->changes = 1;
+  } else if (!strcmp(word, "frames")) {
+    subscriber->changes = 0;
+  } else if (!strcmp(word, "labels")) {
+    // "labels" alone for every label, unknown names select nothing
+    subscriber->all = 1;
+    memset(subscriber->labels, 0, sizeof(subscriber->labels));
+    while ((word = strtok_r(NULL, " :\r", &save))) {
+      int id = teleinfo_label_find(word, strlen(word));
+      subscriber->all = 0;
+      if (id != TI_LABEL_UNKNOWN) {
+        subscriber->labels[id] = 1;
+      }
+    }
+  }
+}
+
+// Commands sent by the subscriber, or end of connection
+static void teleinfuse_subscriber_input (teleinfuse_subscriber * subscriber)
+{
+  ssize_t length = read(subscriber->fd, subscriber->command + subscriber->command_length,
+                        sizeof(subscriber->command) - subscriber->command_length);
+
+  if (length < 0 && (errno == EAGAIN || errno == EINTR)) {
+    return;
+  }
+  if (length <= 0) {
+    teleinfuse_subscriber_close(subscriber);
+    return;
+  }
+  subscriber->command_length += length;
+  char * begin = subscriber->command;
+  char * end;
+  while ((end = memchr(begin, '\n', subscriber->command + subscriber->command_length - begin))) {
+    *end = '\0';
+    teleinfuse_subscriber_command(subscriber, begin);
+    begin = end + 1;
+  }
+  subscriber->command_length -= begin - subscriber->command;
+  memmove(subscriber->command, begin, subscriber->command_length);
+  if (subscriber->command_length == sizeof(subscriber->command)) {
+    syslog(LOG_INFO, "socket: command too long, subscriber disconnected");
+    teleinfuse_subscriber_close(subscriber);
+  }
+}
+
+void teleinfuse_socket_event (uint64_t source)
+{
+  if (source == 0) {
+    teleinfuse_socket_accept();
+  } else if (source <= TELEINFUSE_SOCKET_SUBSCRIBERS_MAX && teleinfuse_subscribers[source - 1].fd != -1) {
+    teleinfuse_subscriber_input(&(teleinfuse_subscribers[source - 1]));
+  }
+}
+
+// "meter\t1792194369.123" + "\tLABEL=value" + "\tLABEL.datetime=datetime" per message
+#define TELEINFUSE_SOCKET_LINE_MAX (64 + TI_MESSAGE_COUNT_MAX * (2 * TI_LABEL_LENGTH_MAX \
+  + sizeof(DATETIME_FILENAME_SUFFIX) + TI_DATETIME_LENGTH + TI_VALUE_LENGTH_MAX + 4))
+
+// The frame is encoded once, each subscriber gets the parts it wants from the
+// same buffer in a single sendmsg (contiguous parts are merged)
+void teleinfuse_socket_publish (int meter, const char * name, const teleinfo_frame * frame, const struct timespec * time)
+{
+  static char line[TELEINFUSE_SOCKET_LINE_MAX];
+  static size_t ends[TI_MESSAGE_COUNT_MAX]; // end of the message fields in line
+  static char changed[TI_MESSAGE_COUNT_MAX];
+  static short previous[TI_LABEL_COUNT]; // message of each label in the last frame, -1 if none
+  const teleinfo_data * dataset = frame->dataset;
+  size_t datasetlen = frame->datasetlen;
+  char datetime[TI_DATETIME_LENGTH + 1];
+
+  if (teleinfuse_socket_fd == -1) {
+    return;
+  }
+  teleinfo_frame * last = &(teleinfuse_socket_frames[meter]);
+  memset(previous, -1, sizeof(previous));
+  for (size_t n=0; n<last->datasetlen; n++) {
+    if (last->dataset[n].id != TI_LABEL_UNKNOWN) {
+      previous[last->dataset[n].id] = n;
+    }
+  }
+  char * p = line + sprintf(line, "%s\t%lld.%03ld", name, (long long)time->tv_sec, time->tv_nsec / 1000000);
+  size_t header = p - line;
+  for (size_t n=0; n<datasetlen; n++) {
+    const teleinfo_data * data = &(dataset[n]);
+    p += sprintf(p, "\t%s=%s", TI_LABEL(frame, data), TI_VALUE(frame, data));
+    if (data->datetime) {
+      teleinfo_datetime_format(data->datetime, datetime);
+      p += sprintf(p, "\t%s" DATETIME_FILENAME_SUFFIX "=%s", TI_LABEL(frame, data), datetime);
+    }
+    ends[n] = p - line;
+    // Labels out of the specification are always sent
+    int before = (data->id != TI_LABEL_UNKNOWN) ? previous[data->id] : -1;
+    changed[n] = before < 0 || strcmp(TI_VALUE(last, &(last->dataset[before])), TI_VALUE(frame, data));
+  }
+  *p++ = '\n';
+  teleinfo_frame_copy(last, frame);
+
+  for (size_t s=0; teleinfuse_subscriber_count && s<TELEINFUSE_SOCKET_SUBSCRIBERS_MAX; s++) {
+    teleinfuse_subscriber * subscriber = &(teleinfuse_subscribers[s]);
+    struct iovec iov[TI_MESSAGE_COUNT_MAX + 2] = { { line, header } };
+    struct msghdr message = { .msg_iov = iov, .msg_iovlen = 1 };
+    size_t length = header;
+    int selected = 0;
+
+    if (subscriber->fd == -1) {
+      continue;
+    }
+    for (size_t n=0; n<=datasetlen; n++) {
+      size_t begin = n ? ends[n - 1] : header;
+      size_t end = (n < datasetlen) ? ends[n] : begin + 1; // then the newline
+      if (n < datasetlen) {
+        int id = dataset[n].id;
+        if ((!subscriber->all && (id == TI_LABEL_UNKNOWN || !subscriber->labels[id])) || (subscriber->changes && !changed[n])) {
+          continue;
+        }
+        selected = 1;
+      } else {
+        begin = p - 1 - line;
+        end = p - line;
+      }
+      struct iovec * last = &(iov[message.msg_iovlen - 1]);
+      if ((char*)last->iov_base + last->iov_len == line + begin) {
+        last->iov_len += end - begin;
+      } else {
+        iov[message.msg_iovlen].iov_base = line + begin;
+        iov[message.msg_iovlen++].iov_len = end - begin;
+      }
+      length += end - begin;
+    }
+    if (!selected) {
+      continue;
+    }
+    // MSG_NOSIGNAL: a subscriber gone is not worth a SIGPIPE
+    if (sendmsg(subscriber->fd, &message, MSG_DONTWAIT | MSG_NOSIGNAL) != (ssize_t)length) {
+      syslog(LOG_INFO, "socket: subscriber too slow or gone, disconnected");
+      teleinfuse_stats_count(TELEINFUSE_STAT_SUBSCRIBERS_DROPPED);
+      teleinfuse_subscriber_close(subscriber);
+    }
+  }
+}
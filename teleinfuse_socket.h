@@ -0,0 +1,57 @@
+/*
+ * teleinfuse is a FUSE module to access to the Télé information of linky electric meter running in standard mode
+ * Télé info data are transmitted by french electric meters (EDF/ERDF)
+ * [FR] Permet de lire la téléinformation cliente (TIC) d'un compteur linky en mode standard.
+ * [FR] Pour le mode TIC historique, voir le projet original
+ *
+ * Based on https://github.com/neomilium/teleinfuse project by Romuald Conty
+ *
+ * Copyright (C) 2020 itineric
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _TELEINFUSE_SOCKET_H_
+#define _TELEINFUSE_SOCKET_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "teleinfo.h"
+
+#define TELEINFUSE_SOCKET_SUBSCRIBERS_MAX 16
+
+// Publish/subscribe feed on a Unix stream socket, run by the reader thread.
+// Every decoded frame is pushed to the subscribers as a line:
+//   "meter\ttime\tLABEL=value\tLABEL.datetime=datetime...\n"
+// A subscriber may send commands, one per line:
+//   "labels SINSTS:EAST" only these labels ("labels" alone for every label)
+//   "changes"            only the labels whose value changed since the previous frame
+//   "frames"             every label of the frame again (default)
+// Sends never block: a subscriber which does not keep up is disconnected.
+
+// Listens on path. The listening socket is watched in epoll_fd as source,
+// subscriber N as source + 1 + N
+// returns 0 if succeed otherwise -1
+int teleinfuse_socket_init (const char * path, size_t meters, int epoll_fd, uint64_t source);
+void teleinfuse_socket_destroy (void);
+
+// Handles the readiness of source - (source given to teleinfuse_socket_init)
+void teleinfuse_socket_event (uint64_t source);
+
+// Sends a frame of meter (named name) to the subscribers
+void teleinfuse_socket_publish (int meter, const char * name, const teleinfo_frame * frame, const struct timespec * time);
+
+#endif
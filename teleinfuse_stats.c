@@ -0,0 +1,250 @@
+/*
+ * teleinfuse is a FUSE module to access to the Télé information of linky electric meter running in standard mode
+ * Télé info data are transmitted by french electric meters (EDF/ERDF)
+ * [FR] Permet de lire la téléinformation cliente (TIC) d'un compteur linky en mode standard.
+ * [FR] Pour le mode TIC historique, voir le projet original
+ *
+ * Based on https://github.com/neomilium/teleinfuse project by Romuald Conty
+ *
+ * Copyright (C) 2020 itineric
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "teleinfuse_stats.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+// value 0 in bucket 0, [2^(n-1), 2^n - 1] in bucket n
+#define TELEINFUSE_BUCKET_COUNT 65
+
+typedef struct {
+  uint64_t count;
+  uint64_t sum;
+  uint64_t max;
+  uint64_t buckets[TELEINFUSE_BUCKET_COUNT];
+} teleinfuse_stats_histogram;
+
+typedef struct teleinfuse_stats_block {
+  unsigned long counters[TELEINFUSE_STAT_COUNT];
+  teleinfo_counters decoder;
+  teleinfuse_stats_histogram histograms[TELEINFUSE_HISTOGRAM_COUNT];
+  int used;                            // owned by a running thread
+  struct teleinfuse_stats_block * next;
+} teleinfuse_stats_block;
+
+static const char * teleinfuse_stats_names[TELEINFUSE_STAT_COUNT] = {
+  "bytes", "syscalls", "frames_rejected", "timeouts", "opens", "open_errors",
+  "published", "publish_skipped", "snapshot_retries", "invalidations",
+  "subscribers_dropped", "rules_fired", "rule_errors",
+  "fuse_lookup", "fuse_getattr", "fuse_readdir", "fuse_open", "fuse_read", "fuse_release", "fuse_poll",
+};
+
+static const char * teleinfuse_stats_filenames[TELEINFUSE_STATS_FILE_COUNT] = {
+  "counters", "frame_bytes", "frame_syscalls", "decode_ns", "interarrival_ms", "publish_ns",
+};
+
+// Blocks are never freed: the block of an exited thread (FUSE threads come and
+// go) is given to the next new thread and its counts go on
+static pthread_mutex_t teleinfuse_stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+static teleinfuse_stats_block * teleinfuse_stats_blocks = NULL;
+static pthread_once_t teleinfuse_stats_once = PTHREAD_ONCE_INIT;
+static pthread_key_t teleinfuse_stats_key;
+static __thread teleinfuse_stats_block * teleinfuse_stats_local = NULL;
+
+static void teleinfuse_stats_release (void * block)
+{
+  pthread_mutex_lock( &teleinfuse_stats_mutex );
+  ((teleinfuse_stats_block*)block)->used = 0;
+  pthread_mutex_unlock( &teleinfuse_stats_mutex );
+}
+
+static void teleinfuse_stats_key_create (void)
+{
+  pthread_key_create(&teleinfuse_stats_key, teleinfuse_stats_release);
+}
+
+// Slow path, once per thread
+static teleinfuse_stats_block * teleinfuse_stats_attach (void)
+{
+  teleinfuse_stats_block * block;
+
+  pthread_once(&teleinfuse_stats_once, teleinfuse_stats_key_create);
+  pthread_mutex_lock( &teleinfuse_stats_mutex );
+  for (block = teleinfuse_stats_blocks; block && block->used; block = block->next);
+  if (!block && (block = calloc(1, sizeof(teleinfuse_stats_block)))) {
+    block->next = teleinfuse_stats_blocks;
+    teleinfuse_stats_blocks = block;
+  }
+  if (block) {
+    block->used = 1;
+  }
+  pthread_mutex_unlock( &teleinfuse_stats_mutex );
+  if (block) {
+    pthread_setspecific(teleinfuse_stats_key, block);
+  }
+  return teleinfuse_stats_local = block;
+}
+
+static inline teleinfuse_stats_block * teleinfuse_stats_block_get (void)
+{
+  return teleinfuse_stats_local ? teleinfuse_stats_local : teleinfuse_stats_attach();
+}
+
+// Only the owner thread writes a block: plain read, relaxed store for readers
+#define TELEINFUSE_STATS_ADD(X, N) __atomic_store_n(&(X), (X) + (N), __ATOMIC_RELAXED)
+#define TELEINFUSE_STATS_LOAD(X) __atomic_load_n(&(X), __ATOMIC_RELAXED)
+
+void teleinfuse_stats_add (teleinfuse_stat stat, unsigned long n)
+{
+  teleinfuse_stats_block * block = teleinfuse_stats_block_get();
+  if (block) {
+    TELEINFUSE_STATS_ADD(block->counters[stat], n);
+  }
+}
+
+void teleinfuse_stats_record (teleinfuse_histogram histogram, uint64_t value)
+{
+  teleinfuse_stats_block * block = teleinfuse_stats_block_get();
+  if (!block) {
+    return;
+  }
+  teleinfuse_stats_histogram * h = &(block->histograms[histogram]);
+  TELEINFUSE_STATS_ADD(h->count, 1);
+  TELEINFUSE_STATS_ADD(h->sum, value);
+  if (value > h->max) {
+    __atomic_store_n(&(h->max), value, __ATOMIC_RELAXED);
+  }
+  TELEINFUSE_STATS_ADD(h->buckets[value ? 64 - __builtin_clzll(value) : 0], 1);
+}
+
+teleinfo_counters * teleinfuse_stats_decoder (void)
+{
+  teleinfuse_stats_block * block = teleinfuse_stats_block_get();
+  return block ? &(block->decoder) : NULL;
+}
+
+const char * teleinfuse_stats_name (teleinfuse_stat stat)
+{
+  return teleinfuse_stats_names[stat];
+}
+
+const char * teleinfuse_stats_filename (int file)
+{
+  return teleinfuse_stats_filenames[file];
+}
+
+int teleinfuse_stats_find (const char * name)
+{
+  for (int file=0; file<TELEINFUSE_STATS_FILE_COUNT; file++) {
+    if (0==strcmp(name, teleinfuse_stats_filenames[file])) {
+      return file;
+    }
+  }
+  return -1;
+}
+
+const char * teleinfuse_stats_reject_name (int reason)
+{
+  static const char * names[TI_REJECT_COUNT] = { "checksum", "framing", "oversize" };
+  return names[reason];
+}
+
+void teleinfuse_stats_totals (unsigned long counters[TELEINFUSE_STAT_COUNT], teleinfo_counters * decoder)
+{
+  memset(counters, 0, TELEINFUSE_STAT_COUNT * sizeof(unsigned long));
+  memset(decoder, 0, sizeof(*decoder));
+  pthread_mutex_lock( &teleinfuse_stats_mutex );
+  for (teleinfuse_stats_block * block = teleinfuse_stats_blocks; block; block = block->next) {
+    for (size_t n=0; n<TELEINFUSE_STAT_COUNT; n++) {
+      counters[n] += TELEINFUSE_STATS_LOAD(block->counters[n]);
+    }
+    decoder->frames += TELEINFUSE_STATS_LOAD(block->decoder.frames);
+    decoder->lines += TELEINFUSE_STATS_LOAD(block->decoder.lines);
+    decoder->salvaged += TELEINFUSE_STATS_LOAD(block->decoder.salvaged);
+    for (size_t n=0; n<TI_REJECT_COUNT; n++) {
+      decoder->rejected[n] += TELEINFUSE_STATS_LOAD(block->decoder.rejected[n]);
+    }
+  }
+  pthread_mutex_unlock( &teleinfuse_stats_mutex );
+}
+
+// "name value" lines
+static char * teleinfuse_stats_render_counters (size_t * length)
+{
+  unsigned long counters[TELEINFUSE_STAT_COUNT];
+  teleinfo_counters decoder;
+
+  teleinfuse_stats_totals(counters, &decoder);
+  char * text = malloc((TELEINFUSE_STAT_COUNT + 3 + TI_REJECT_COUNT) * 48);
+  if (!text) {
+    return NULL;
+  }
+  char * p = text;
+  p += sprintf(p, "frames %lu\nlines %lu\nframes_salvaged %lu\n", decoder.frames, decoder.lines, decoder.salvaged);
+  for (size_t n=0; n<TI_REJECT_COUNT; n++) {
+    p += sprintf(p, "rejected_%s %lu\n", teleinfuse_stats_reject_name(n), decoder.rejected[n]);
+  }
+  for (size_t n=0; n<TELEINFUSE_STAT_COUNT; n++) {
+    p += sprintf(p, "%s %lu\n", teleinfuse_stats_name(n), counters[n]);
+  }
+  *length = p - text;
+  return text;
+}
+
+// count, sum and max, then "upper_bound count" for each bucket used
+static char * teleinfuse_stats_render_histogram (teleinfuse_histogram histogram, size_t * length)
+{
+  teleinfuse_stats_histogram total = { 0 };
+
+  pthread_mutex_lock( &teleinfuse_stats_mutex );
+  for (teleinfuse_stats_block * block = teleinfuse_stats_blocks; block; block = block->next) {
+    teleinfuse_stats_histogram * h = &(block->histograms[histogram]);
+    uint64_t max = TELEINFUSE_STATS_LOAD(h->max);
+    total.count += TELEINFUSE_STATS_LOAD(h->count);
+    total.sum += TELEINFUSE_STATS_LOAD(h->sum);
+    total.max = (max > total.max) ? max : total.max;
+    for (size_t n=0; n<TELEINFUSE_BUCKET_COUNT; n++) {
+      total.buckets[n] += TELEINFUSE_STATS_LOAD(h->buckets[n]);
+    }
+  }
+  pthread_mutex_unlock( &teleinfuse_stats_mutex );
+
+  char * text = malloc((3 + TELEINFUSE_BUCKET_COUNT) * 48);
+  if (!text) {
+    return NULL;
+  }
+  char * p = text;
+  p += sprintf(p, "count %llu\nsum %llu\nmax %llu\n",
+               (unsigned long long)total.count, (unsigned long long)total.sum, (unsigned long long)total.max);
+  for (size_t n=0; n<TELEINFUSE_BUCKET_COUNT; n++) {
+    if (total.buckets[n]) {
+      unsigned long long bound = n ? (n == 64 ? UINT64_MAX : (1ULL << n) - 1) : 0;
+      p += sprintf(p, "%llu %llu\n", bound, (unsigned long long)total.buckets[n]);
+    }
+  }
+  *length = p - text;
+  return text;
+}
+
+char * teleinfuse_stats_render (int file, size_t * length)
+{
+  if (file == 0) {
+    return teleinfuse_stats_render_counters(length);
+  }
+  return teleinfuse_stats_render_histogram(file - 1, length);
+}
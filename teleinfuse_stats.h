@@ -0,0 +1,95 @@
+/*
+ * teleinfuse is a FUSE module to access to the Télé information of linky electric meter running in standard mode
+ * Télé info data are transmitted by french electric meters (EDF/ERDF)
+ * [FR] Permet de lire la téléinformation cliente (TIC) d'un compteur linky en mode standard.
+ * [FR] Pour le mode TIC historique, voir le projet original
+ *
+ * Based on https://github.com/neomilium/teleinfuse project by Romuald Conty
+ *
+ * Copyright (C) 2020 itineric
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _TELEINFUSE_STATS_H_
+#define _TELEINFUSE_STATS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "teleinfo.h"
+
+#define TELEINFUSE_STATS_DIRNAME ".stats"
+
+// Instrumentation: each thread updates its own block of counters (no lock,
+// no shared cache line), blocks are only summed when a stats file is read.
+
+typedef enum {
+  TELEINFUSE_STAT_BYTES,            // bytes read from the ports
+  TELEINFUSE_STAT_SYSCALLS,         // poll/read calls on the ports
+  TELEINFUSE_STAT_FRAMES_REJECTED,  // frames given up (garbage, too many errors)
+  TELEINFUSE_STAT_TIMEOUTS,         // meter silent for TI_READ_TIMEOUT_MS
+  TELEINFUSE_STAT_OPENS,            // ports (re)opened
+  TELEINFUSE_STAT_OPEN_ERRORS,
+  TELEINFUSE_STAT_PUBLISHED,        // snapshots published
+  TELEINFUSE_STAT_PUBLISH_SKIPPED,  // frames not published, no free snapshot
+  TELEINFUSE_STAT_SNAPSHOT_RETRIES, // snapshot published while a reader acquired it
+  TELEINFUSE_STAT_INVALIDATIONS,    // kernel cache entries dropped on change
+  TELEINFUSE_STAT_SUBSCRIBERS_DROPPED, // socket subscribers too slow or gone
+  TELEINFUSE_STAT_RULES_FIRED,      // rules gone on or off
+  TELEINFUSE_STAT_RULE_ERRORS,      // rule actions which could not run or failed
+  TELEINFUSE_STAT_FUSE_LOOKUP,
+  TELEINFUSE_STAT_FUSE_GETATTR,
+  TELEINFUSE_STAT_FUSE_READDIR,
+  TELEINFUSE_STAT_FUSE_OPEN,
+  TELEINFUSE_STAT_FUSE_READ,
+  TELEINFUSE_STAT_FUSE_RELEASE,
+  TELEINFUSE_STAT_FUSE_POLL,
+  TELEINFUSE_STAT_COUNT,
+} teleinfuse_stat;
+
+// Histograms have power of two buckets
+typedef enum {
+  TELEINFUSE_HISTOGRAM_FRAME_BYTES,
+  TELEINFUSE_HISTOGRAM_FRAME_SYSCALLS,
+  TELEINFUSE_HISTOGRAM_DECODE_NS,      // time spent decoding a frame
+  TELEINFUSE_HISTOGRAM_INTERARRIVAL_MS, // between two frames of a meter
+  TELEINFUSE_HISTOGRAM_PUBLISH_NS,     // building and publishing a snapshot
+  TELEINFUSE_HISTOGRAM_COUNT,
+} teleinfuse_histogram;
+
+void teleinfuse_stats_add (teleinfuse_stat stat, unsigned long n);
+#define teleinfuse_stats_count(STAT) teleinfuse_stats_add(STAT, 1)
+
+void teleinfuse_stats_record (teleinfuse_histogram histogram, uint64_t value);
+
+// Decoding counters of the calling thread (see teleinfo_decoder.counters)
+teleinfo_counters * teleinfuse_stats_decoder (void);
+
+// Sums of every thread counters
+void teleinfuse_stats_totals (unsigned long counters[TELEINFUSE_STAT_COUNT], teleinfo_counters * decoder);
+const char * teleinfuse_stats_name (teleinfuse_stat stat);
+const char * teleinfuse_stats_reject_name (int reason);
+
+// Files of the stats directory: "counters", then one per histogram
+#define TELEINFUSE_STATS_FILE_COUNT (1 + TELEINFUSE_HISTOGRAM_COUNT)
+const char * teleinfuse_stats_filename (int file);
+
+// returns the file index, -1 if there is none
+int teleinfuse_stats_find (const char * name);
+
+// Renders a stats file, returns a malloc'ed buffer or NULL
+char * teleinfuse_stats_render (int file, size_t * length);
+
+#endif
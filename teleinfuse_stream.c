@@ -0,0 +1,138 @@
+/*
+ * teleinfuse is a FUSE module to access to the Télé information of linky electric meter running in standard mode
+ * Télé info data are transmitted by french electric meters (EDF/ERDF)
+ * [FR] Permet de lire la téléinformation cliente (TIC) d'un compteur linky en mode standard.
+ * [FR] Pour le mode TIC historique, voir le projet original
+ *
+ * Based on https://github.com/neomilium/teleinfuse project by Romuald Conty
+ *
+ * Copyright (C) 2020 itineric
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "teleinfuse_stream.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+// Written like a seqlock: the writer announces the bytes it is about to
+// overwrite (reserved) before writing them, readers copy then check that
+// nothing they copied was announced meanwhile.
+typedef struct {
+  uint64_t head;     // bytes written
+  uint64_t reserved; // bytes written once the line being written is complete
+  char data[TELEINFUSE_STREAM_SIZE];
+} teleinfuse_stream_ring;
+
+static teleinfuse_stream_ring * teleinfuse_streams = NULL;
+static size_t teleinfuse_stream_meters = 0;
+
+// "1792194369.123" + "\tLABEL=value" + "\tLABEL.datetime=datetime" per message
+#define TELEINFUSE_STREAM_LINE_MAX (24 + TI_MESSAGE_COUNT_MAX * (2 * TI_LABEL_LENGTH_MAX \
+  + sizeof(DATETIME_FILENAME_SUFFIX) + TI_DATETIME_LENGTH + TI_VALUE_LENGTH_MAX + 4))
+
+void teleinfuse_stream_init (size_t meters)
+{
+  if (!(teleinfuse_streams = calloc(meters, sizeof(teleinfuse_stream_ring)))) {
+    syslog(LOG_ERR, "stream: unable to allocate rings, stream disabled");
+    return;
+  }
+  teleinfuse_stream_meters = meters;
+}
+
+void teleinfuse_stream_destroy (void)
+{
+  free(teleinfuse_streams);
+  teleinfuse_streams = NULL;
+  teleinfuse_stream_meters = 0;
+}
+
+int teleinfuse_stream_enabled (void)
+{
+  return teleinfuse_streams != NULL;
+}
+
+void teleinfuse_stream_add (int meter, const teleinfo_frame * frame, const struct timespec * time)
+{
+  static char line[TELEINFUSE_STREAM_LINE_MAX]; // only the reader thread writes
+  char datetime[TI_DATETIME_LENGTH + 1];
+
+  if (!teleinfuse_streams) {
+    return;
+  }
+  char * p = line + sprintf(line, "%lld.%03ld", (long long)time->tv_sec, time->tv_nsec / 1000000);
+  for (size_t n=0; n<frame->datasetlen; n++) {
+    const teleinfo_data * data = &(frame->dataset[n]);
+    p += sprintf(p, "\t%s=%s", TI_LABEL(frame, data), TI_VALUE(frame, data));
+    if (data->datetime) {
+      teleinfo_datetime_format(data->datetime, datetime);
+      p += sprintf(p, "\t%s" DATETIME_FILENAME_SUFFIX "=%s", TI_LABEL(frame, data), datetime);
+    }
+  }
+  *p++ = '\n';
+
+  teleinfuse_stream_ring * ring = &(teleinfuse_streams[meter]);
+  size_t length = p - line;
+  uint64_t head = ring->head;
+  size_t offset = head % TELEINFUSE_STREAM_SIZE;
+  size_t first = (length < TELEINFUSE_STREAM_SIZE - offset) ? length : TELEINFUSE_STREAM_SIZE - offset;
+
+  __atomic_store_n(&(ring->reserved), head + length, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  memcpy(ring->data + offset, line, first);
+  memcpy(ring->data, line + first, length - first);
+  __atomic_store_n(&(ring->head), head + length, __ATOMIC_RELEASE);
+}
+
+uint64_t teleinfuse_stream_head (int meter)
+{
+  return teleinfuse_streams ? __atomic_load_n(&(teleinfuse_streams[meter].head), __ATOMIC_ACQUIRE) : 0;
+}
+
+size_t teleinfuse_stream_read (int meter, uint64_t * cursor, char * buf, size_t size)
+{
+  teleinfuse_stream_ring * ring = &(teleinfuse_streams[meter]);
+  uint64_t head = __atomic_load_n(&(ring->head), __ATOMIC_ACQUIRE);
+  uint64_t from = *cursor;
+  size_t length = (head - from < size) ? head - from : size;
+
+  if (head - from <= TELEINFUSE_STREAM_SIZE) {
+    size_t offset = from % TELEINFUSE_STREAM_SIZE;
+    size_t first = (length < TELEINFUSE_STREAM_SIZE - offset) ? length : TELEINFUSE_STREAM_SIZE - offset;
+    memcpy(buf, ring->data + offset, first);
+    memcpy(buf + first, ring->data, length - first);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&(ring->reserved), __ATOMIC_RELAXED) - from <= TELEINFUSE_STREAM_SIZE) {
+      if (length < head - from) {
+        // Cut after the last whole line, the rest comes with the next read
+        size_t end = length;
+        while (end && buf[end - 1] != '\n') {
+          end--;
+        }
+        length = end ? end : length;
+      }
+      *cursor = from + length;
+      return length;
+    }
+  }
+
+  // Overwritten before being read: the next line begins at head
+  length = (sizeof(TELEINFUSE_STREAM_OVERRUN) - 1 < size) ? sizeof(TELEINFUSE_STREAM_OVERRUN) - 1 : size;
+  memcpy(buf, TELEINFUSE_STREAM_OVERRUN, length);
+  *cursor = head;
+  return length;
+}
@@ -0,0 +1,63 @@
+/*
+ * teleinfuse is a FUSE module to access to the Télé information of linky electric meter running in standard mode
+ * Télé info data are transmitted by french electric meters (EDF/ERDF)
+ * [FR] Permet de lire la téléinformation cliente (TIC) d'un compteur linky en mode standard.
+ * [FR] Pour le mode TIC historique, voir le projet original
+ *
+ * Based on https://github.com/neomilium/teleinfuse project by Romuald Conty
+ *
+ * Copyright (C) 2020 itineric
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _TELEINFUSE_STREAM_H_
+#define _TELEINFUSE_STREAM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "teleinfo.h"
+
+#define TELEINFUSE_STREAM_FILENAME "stream"
+
+// Bytes kept per meter, about a hundred typical frames
+#define TELEINFUSE_STREAM_SIZE (64 * 1024)
+
+// Line given to a reader the writer has overrun
+#define TELEINFUSE_STREAM_OVERRUN "# overrun\n"
+
+// Every decoded frame of each meter as a "time\tLABEL=value\t...\n" line (time
+// in seconds with milliseconds, LABEL.datetime=... after a datetimed message),
+// in a ring written by the reader thread only. Readers keep their own cursor
+// and never hold the writer up: a reader overrun by the writer loses what it
+// has not read and goes on with the next frame.
+// meters: number of meters (meter arguments below are 0 to meters - 1)
+void teleinfuse_stream_init (size_t meters);
+void teleinfuse_stream_destroy (void);
+
+int teleinfuse_stream_enabled (void);
+
+void teleinfuse_stream_add (int meter, const teleinfo_frame * frame, const struct timespec * time);
+
+// Bytes ever written to the ring of meter: cursor of a reader starting now
+uint64_t teleinfuse_stream_head (int meter);
+
+// Copies at most size bytes from *cursor into buf (whole lines when one fits),
+// then moves the cursor. An overrun reader gets TELEINFUSE_STREAM_OVERRUN.
+// returns the number of bytes copied, 0 if there is nothing new
+size_t teleinfuse_stream_read (int meter, uint64_t * cursor, char * buf, size_t size);
+
+#endif